@@ -0,0 +1,483 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bimap.h"
+#include "concurrent_bimap.h"
+#include "flat_bimap.h"
+#include "mapped_bimap.h"
+#include "persistent_bimap.h"
+#include "small_bimap.h"
+
+namespace {
+using bench_clock = std::chrono::steady_clock;
+
+size_t checksum = 0;
+
+template <typename F>
+void measure(char const* name, size_t ops, F&& f) {
+  auto start = bench_clock::now();
+  f();
+  auto elapsed = std::chrono::duration<double, std::nano>(bench_clock::now() -
+                                                          start)
+                     .count();
+  std::printf("%-28s %10.1f ns/op\n", name, elapsed / ops);
+}
+
+std::vector<uint32_t> random_keys(size_t n, uint32_t seed) {
+  std::mt19937 e(seed);
+  std::vector<uint32_t> res(n);
+  for (uint32_t& x : res) {
+    x = e();
+  }
+  return res;
+}
+
+using treap_bimap = bimap<uint32_t, uint32_t>;
+using pooled_bimap =
+    bimap<uint32_t, uint32_t, std::less<uint32_t>, std::less<uint32_t>,
+          pool_allocator<std::pair<uint32_t, uint32_t>>>;
+using hashed_treap_bimap =
+    bimap<uint32_t, uint32_t, treap_index<std::less<>, hashed_priority>,
+          treap_index<std::less<>, hashed_priority>>;
+using btree_bimap = bimap<uint32_t, uint32_t, btree_index<std::less<uint32_t>>,
+                          btree_index<std::less<uint32_t>>>;
+using ranked_bimap =
+    bimap<uint32_t, uint32_t, ranked_index<>, ranked_index<>>;
+using hash_bimap = bimap<uint32_t, uint32_t, hash_index<>, hash_index<>>;
+using compact_bimap =
+    bimap<uint32_t, uint32_t, compact_index<>, compact_index<>>;
+
+template <typename Bimap>
+void bench_basic_ops(char const* index, size_t n) {
+  std::printf("-- %s (%zu bytes per node)\n", index,
+              sizeof(typename Bimap::node_t));
+  std::vector<uint32_t> lefts = random_keys(n, 1), rights = random_keys(n, 2),
+                        misses = random_keys(n, 3);
+  Bimap b;
+
+  measure("insert", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      b.insert(lefts[i], rights[i]);
+    }
+  });
+  measure("find_left (hit)", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += b.find_left(lefts[i]) != b.end_left();
+    }
+  });
+  measure("find_right (miss)", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += b.find_right(misses[i]) != b.end_right();
+    }
+  });
+  std::vector<typename Bimap::left_iterator> found;
+  found.reserve(n);
+  measure("find_left_many (hit)", n, [&] {
+    b.find_left_many(lefts.begin(), lefts.end(), std::back_inserter(found));
+    for (auto it : found) {
+      checksum += it != b.end_left();
+    }
+  });
+  if constexpr (Bimap::left_index_t::ordered) {
+    measure("lower_bound_left", n, [&] {
+      for (size_t i = 0; i < n; i++) {
+        checksum += b.lower_bound_left(misses[i]) != b.end_left();
+      }
+    });
+  }
+  measure("scan left + flip", b.size(), [&] {
+    for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+      checksum += *it.flip();
+    }
+  });
+  Bimap copy;
+  measure("copy", b.size(), [&] {
+    copy = b;
+    checksum += copy.size();
+  });
+  measure("clear", b.size(), [&] { copy.clear(); });
+  measure("erase_left (key)", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += b.erase_left(lefts[i]);
+    }
+  });
+}
+
+template <typename Bimap>
+void bench_hinted_append(char const* name, size_t n) {
+  Bimap b;
+  measure(name, n, [&] {
+    for (uint32_t i = 0; i < n; i++) {
+      b.insert(b.end_left(), b.end_right(), i, i);
+    }
+  });
+}
+
+// hinted appends at two map sizes and with subtree sizes kept, to see
+// whether the per-pair cost of an end() hint depends on the map size
+void bench_sorted_insert(size_t n) {
+  {
+    bimap<uint32_t, uint32_t> b;
+    measure("insert (in order)", n, [&] {
+      for (uint32_t i = 0; i < n; i++) {
+        b.insert(i, i);
+      }
+    });
+  }
+  bench_hinted_append<treap_bimap>("insert (in order, hinted)", n);
+  bench_hinted_append<treap_bimap>("insert (hinted, n / 64)", n / 64);
+  bench_hinted_append<ranked_bimap>("insert (hinted, ranked)", n);
+  bench_hinted_append<compact_bimap>("insert (hinted, compact)", n);
+  bench_hinted_append<compact_bimap>("insert (compact, n / 64)", n / 64);
+}
+// long keys with a common prefix in a map that fits in the cache, so that
+// comparisons rather than misses dominate lookups
+template <typename Compare>
+void bench_string_keys(char const* name, size_t n) {
+  size_t m = std::min<size_t>(n, 1 << 14);
+  std::vector<uint32_t> ids = random_keys(m, 1);
+  std::vector<std::string> keys(m);
+  for (size_t i = 0; i < m; i++) {
+    keys[i] = std::string(64, '/') + std::to_string(ids[i]);
+  }
+  bimap<std::string, uint32_t, Compare> b;
+  for (size_t i = 0; i < m; i++) {
+    b.insert(keys[i], uint32_t(i));
+  }
+  measure(name, n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += b.find_left(keys[i % m]) != b.end_left();
+    }
+  });
+}
+
+// read-mostly use: loaded once, then looked up and scanned
+void bench_flat(size_t n) {
+  std::printf("-- flat\n");
+  std::vector<uint32_t> lefts = random_keys(n, 1), rights = random_keys(n, 2),
+                        misses = random_keys(n, 3);
+  std::vector<std::pair<uint32_t, uint32_t>> pairs(n);
+  for (size_t i = 0; i < n; i++) {
+    pairs[i] = {lefts[i], rights[i]};
+  }
+  flat_bimap<uint32_t, uint32_t> b;
+  measure("assign", n,
+          [&] { checksum += b.assign(pairs.begin(), pairs.end()); });
+  measure("find_left (hit)", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += b.find_left(lefts[i]) != b.end_left();
+    }
+  });
+  measure("find_right (miss)", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += b.find_right(misses[i]) != b.end_right();
+    }
+  });
+  measure("lower_bound_left", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += b.lower_bound_left(misses[i]) != b.end_left();
+    }
+  });
+  measure("scan left + flip", b.size(), [&] {
+    for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+      checksum += *it.flip();
+    }
+  });
+  size_t m = std::min<size_t>(n, 1 << 14);
+  flat_bimap<uint32_t, uint32_t> small;
+  measure("insert (16k pairs)", m, [&] {
+    for (size_t i = 0; i < m; i++) {
+      small.insert(lefts[i], rights[i]);
+    }
+    small.commit();
+  });
+}
+
+// many maps of 8 pairs, built, queried and destroyed
+template <typename Map>
+void bench_small_maps(char const* name, size_t n) {
+  std::vector<uint32_t> keys = random_keys(n, 1);
+  char label[64];
+  std::snprintf(label, sizeof(label), "build + find (%s)", name);
+  measure(label, n, [&] {
+    for (size_t i = 0; i + 8 <= n; i += 8) {
+      Map m;
+      for (size_t j = i; j < i + 8; j++) {
+        m.insert(keys[j], uint32_t(j));
+      }
+      for (size_t j = i; j < i + 8; j++) {
+        checksum += *m.find_left(keys[j]).flip();
+      }
+    }
+  });
+}
+
+// moving every pair to another map, copying or relinking the nodes
+void bench_move_pairs(size_t n) {
+  std::vector<uint32_t> lefts = random_keys(n, 1), rights = random_keys(n, 2);
+  treap_bimap from, to;
+  auto fill = [&] {
+    for (size_t i = 0; i < n; i++) {
+      from.insert(lefts[i], rights[i]);
+    }
+  };
+  fill();
+  measure("erase + insert", n, [&] {
+    for (uint32_t x : lefts) {
+      auto it = from.find_left(x);
+      if (it != from.end_left()) {
+        to.insert(*it, *it.flip());
+        from.erase_left(it);
+      }
+    }
+  });
+  to.clear();
+  fill();
+  measure("extract + insert", n, [&] {
+    for (uint32_t x : lefts) {
+      to.insert(from.extract_left(x));
+    }
+  });
+  to.clear();
+  fill();
+  std::vector<uint32_t> others = random_keys(n, 3);
+  for (uint32_t x : others) {
+    to.insert(x, x);
+  }
+  measure("merge (into a full map)", n, [&] { to.merge(from); });
+  checksum += to.size();
+  measure("replace_left", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      auto it = to.find_left(lefts[i]);
+      if (it != to.end_left()) {
+        checksum += to.replace_left(it, others[i] ^ 1);
+      }
+    }
+  });
+}
+
+void bench_range_erase(size_t n, size_t window) {
+  treap_bimap b;
+  std::vector<uint32_t> rights = random_keys(n, 2);
+  for (uint32_t i = 0; i < n; i++) {
+    b.insert(b.end_left(), b.end_right(), i, rights[i]);
+  }
+  char name[64];
+  std::snprintf(name, sizeof(name), "erase_left (window %zu)", window);
+  measure(name, n, [&] {
+    for (uint32_t from = 0; from < n; from += window) {
+      b.erase_left(b.lower_bound_left(from), b.lower_bound_left(from + window));
+    }
+  });
+  checksum += b.size();
+}
+
+void bench_frozen(size_t n) {
+  std::vector<uint32_t> lefts = random_keys(n, 1), rights = random_keys(n, 2),
+                        misses = random_keys(n, 3);
+  treap_bimap b;
+  for (size_t i = 0; i < n; i++) {
+    b.insert(lefts[i], rights[i]);
+  }
+  std::printf("-- frozen\n");
+  frozen_bimap<uint32_t, uint32_t> f;
+  measure("freeze", b.size(), [&] { f = b.freeze(); });
+  measure("find_left (hit)", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += f.find_left(lefts[i]) != f.end_left();
+    }
+  });
+  measure("lower_bound_left", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += f.lower_bound_left(misses[i]) != f.end_left();
+    }
+  });
+  measure("scan left + flip", f.size(), [&] {
+    for (auto it = f.begin_left(); it != f.end_left(); ++it) {
+      checksum += *it.flip();
+    }
+  });
+
+  char const* path = "bench_frozen.bin";
+  {
+    std::ofstream out(path, std::ios::binary);
+    measure("write", f.size(), [&] { f.write(out); });
+  }
+  // one op is the whole start: mapping plus a lookup
+  measure("open mapped + find", 1, [&] {
+    mapped_bimap<uint32_t, uint32_t> m(path);
+    checksum += m.find_left(lefts[0]) != m.end_left();
+  });
+  {
+    mapped_bimap<uint32_t, uint32_t> m(path);
+    measure("mapped find_left (hit)", n, [&] {
+      for (size_t i = 0; i < n; i++) {
+        checksum += m.find_left(lefts[i]) != m.end_left();
+      }
+    });
+  }
+  std::remove(path);
+}
+
+void bench_persistent(size_t n) {
+  std::printf("-- persistent\n");
+  std::vector<uint32_t> lefts = random_keys(n, 1), rights = random_keys(n, 2);
+  persistent_bimap<uint32_t, uint32_t> b;
+  measure("insert", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      b.insert(lefts[i], rights[i]);
+    }
+  });
+  auto s = b.snapshot();
+  measure("find_left (hit)", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += s.find_left(lefts[i]) != s.end_left();
+    }
+  });
+  measure("scan left", s.size(), [&] {
+    for (auto it = s.begin_left(); it != s.end_left(); ++it) {
+      checksum += *it;
+    }
+  });
+  measure("snapshot", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += b.snapshot().size();
+    }
+  });
+  measure("erase_left (old snapshot kept)", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      checksum += b.erase_left(lefts[i]);
+    }
+  });
+  checksum += s.size();
+}
+
+// n operations split between the threads, half of them inserts and half
+// lookups of keys inserted before
+void bench_concurrent(size_t n, size_t shards) {
+  std::printf("-- concurrent, %zu shards\n", shards);
+  std::vector<uint32_t> lefts = random_keys(n, 1), rights = random_keys(n, 2);
+  for (size_t threads = 1; threads <= 64; threads *= 2) {
+    concurrent_bimap<uint32_t, uint32_t> b(shards);
+    std::vector<std::thread> workers;
+    size_t per_thread = n / threads;
+    char name[64];
+    std::snprintf(name, sizeof(name), "%zu threads", threads);
+    measure(name, per_thread * threads, [&] {
+      for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+          size_t from = t * per_thread, found = 0;
+          for (size_t i = from; i < from + per_thread; i++) {
+            if (i % 2 == 0) {
+              b.insert(lefts[i], rights[i]);
+            } else {
+              found += b.find_left(lefts[i - 1]).has_value();
+            }
+          }
+          static std::mutex m;
+          std::lock_guard lock(m);
+          checksum += found;
+        });
+      }
+      for (std::thread& w : workers) {
+        w.join();
+      }
+    });
+  }
+}
+
+void bench_insert_many(size_t n) {
+  std::vector<std::pair<uint32_t, uint32_t>> pairs(n);
+  std::vector<uint32_t> lefts = random_keys(n, 1), rights = random_keys(n, 2);
+  for (size_t i = 0; i < n; i++) {
+    pairs[i] = {lefts[i], rights[i]};
+  }
+  concurrent_bimap<uint32_t, uint32_t> one_by_one, batched;
+  measure("insert (concurrent)", n, [&] {
+    for (auto const& [l, r] : pairs) {
+      checksum += one_by_one.insert(l, r);
+    }
+  });
+  measure("insert_many (concurrent)", n, [&] {
+    checksum += batched.insert_many(pairs.begin(), pairs.end());
+  });
+  measure("find_left_many (concurrent)", n, [&] {
+    for (auto const& r : batched.find_left_many(lefts.begin(), lefts.end())) {
+      checksum += r.has_value();
+    }
+  });
+}
+
+// what the trees look like and what a lookup costs, with the counting
+// overhead measured against the plain treap above
+void bench_statistics(size_t n) {
+  using counted_bimap =
+      bimap<uint32_t, uint32_t,
+            treap_index<std::less<>, random_priority, collect_statistics>,
+            treap_index<std::less<>, random_priority, collect_statistics>>;
+  std::printf("-- treap, statistics\n");
+  std::vector<uint32_t> lefts = random_keys(n, 1), rights = random_keys(n, 2);
+  counted_bimap b;
+  measure("insert", n, [&] {
+    for (size_t i = 0; i < n; i++) {
+      b.insert(lefts[i], rights[i]);
+    }
+  });
+  operation_counts const& counts = b.statistics_left();
+  std::printf("per insert: %.1f comparisons, %.2f rotations\n",
+              double(counts.comparisons) / counts.inserts,
+              double(counts.rotations) / counts.inserts);
+  b.reset_statistics();
+  measure("find_left", n, [&] {
+    for (uint32_t x : lefts) {
+      checksum += b.find_left(x) != b.end_left();
+    }
+  });
+  std::printf("per lookup: %.1f visits\n",
+              double(counts.visits) / counts.lookups);
+  tree_shape shape = b.shape_left();
+  double depth = 0;
+  for (size_t d = 0; d < shape.depths.size(); d++) {
+    depth += double(d) * shape.depths[d];
+  }
+  std::printf("height %zu, average depth %.1f\n", shape.height,
+              depth / b.size());
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  size_t n = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  std::printf("n = %zu\n", n);
+  bench_basic_ops<treap_bimap>("treap", n);
+  bench_basic_ops<pooled_bimap>("treap, pool_allocator", n);
+  hashed_priority::seed(1);
+  bench_basic_ops<hashed_treap_bimap>("treap, hashed priority", n);
+  bench_basic_ops<btree_bimap>("btree", n);
+  bench_basic_ops<hash_bimap>("hash", n);
+  bench_basic_ops<compact_bimap>("compact", n);
+  bench_statistics(n);
+  bench_sorted_insert(n);
+  bench_move_pairs(n);
+  bench_small_maps<treap_bimap>("bimap", n);
+  bench_small_maps<small_bimap<uint32_t, uint32_t>>("small_bimap", n);
+  bench_string_keys<std::less<>>("find_left (string, less)", n);
+  bench_string_keys<compare_three_way>("find_left (string, three-way)", n);
+  bench_range_erase(n, 1000);
+  bench_range_erase(n, n / 4);
+  bench_frozen(n);
+  bench_flat(n);
+  bench_persistent(n);
+  bench_concurrent(n, 1);
+  bench_concurrent(
+      n, concurrent_bimap<uint32_t, uint32_t>::default_shard_count());
+  bench_insert_many(n);
+  std::printf("checksum %zu\n", checksum);
+}
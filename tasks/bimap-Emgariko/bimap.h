@@ -1,36 +1,67 @@
 #pragma once
 
+#include "btree.h"
+#include "compact_treap.h"
+#include "frozen_bimap.h"
+#include "hash_table.h"
+#include "pool_allocator.h"
 #include "treap.h"
+#include <algorithm>
+#include <cassert>
 #include <cstdint>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
 #include <utility>
+#include <vector>
 
+// Nodes come from Allocator, rebound to the node type. pool_allocator
+// recycles them through a process-wide pool that is never freed.
 template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
-          typename CompareRight = std::less<Right>>
-struct bimap {
+          typename CompareRight = std::less<Right>,
+          typename Allocator = std::allocator<std::pair<Left, Right>>>
+struct bimap : private details::node_allocator_t<Left, Right, CompareLeft,
+                                                 CompareRight, Allocator> {
   using left_t = Left;
   using right_t = Right;
+  using allocator_type = Allocator;
 
   using map_element_base = details::map_element_base;
   using left_tag = details::left_tag;
   using right_tag = details::right_tag;
 
-  using node_t = details::bimap_node<Left, Right>;
-  using left_node_t = details::map_element<Left, details::left_tag>;
-  using right_node_t = details::map_element<Right, details::right_tag>;
-  using left_treap_t = details::treap<left_t, details::left_tag, CompareLeft>;
-  using right_treap_t =
-      details::treap<right_t, details::right_tag, CompareRight>;
+  // each side is indexed by a treap unless its comparator selects another
+  // index, such as btree_index, hash_index or compact_index (treap_index
+  // keeps the treap and picks its priorities)
+  using left_index_t = details::index_t<left_t, left_tag, CompareLeft>;
+  using right_index_t = details::index_t<right_t, right_tag, CompareRight>;
+  using node_t = details::bimap_node_t<Left, Right, CompareLeft, CompareRight>;
+  using left_node_t = typename left_index_t::element_t;
+  using right_node_t = typename right_index_t::element_t;
+  using left_base_t = typename left_index_t::element_base_t;
+  using right_base_t = typename right_index_t::element_base_t;
+  static constexpr bool treap_indexed = details::is_treap_v<left_index_t> &&
+                                        details::is_treap_v<right_index_t>;
+  using node_allocator_t = details::node_allocator_t<Left, Right, CompareLeft,
+                                                    CompareRight, Allocator>;
+  using node_alloc_traits = std::allocator_traits<node_allocator_t>;
 
   template <typename value, typename Tag>
   struct iterator {
+    static constexpr bool is_left = std::is_same_v<Tag, left_tag>;
+    using index_t = std::conditional_t<is_left, left_index_t, right_index_t>;
+    using base_t = typename index_t::element_base_t;
+
     iterator() = delete;
 
-    explicit iterator(const map_element_base* ptr_) noexcept :
-          data(const_cast<map_element_base*>(ptr_)) {}
+    explicit iterator(const base_t* ptr_) noexcept :
+          data(const_cast<base_t*>(ptr_)) {}
 
     value const &operator *() const noexcept {
-      using to_t = std::conditional_t
-          <std::is_same_v<Tag, left_tag>, left_node_t, right_node_t>;
+      using to_t = std::conditional_t<is_left, left_node_t, right_node_t>;
       return static_cast<to_t*>(data)->val;
     }
 
@@ -39,19 +70,7 @@ struct bimap {
     }
 
     iterator &operator++() noexcept { // ++it
-      if (data->right) {
-        data = data->right;
-        while (data->left) {
-          data = data->left;
-        }
-      } else if (data->is_left_son()) {
-        data = data->par;
-      } else if(data->is_right_son()) {
-        while (data->is_right_son()) {
-          data = data->par;
-        }
-        data = data->par;
-      }
+      index_t::next(data);
       return *this;
     }
 
@@ -62,19 +81,7 @@ struct bimap {
     }
 
     iterator &operator--() noexcept {
-      if (data->left) {
-        data = data->left;
-        while (data->right) {
-          data = data->right;
-        }
-      } else if (data->is_right_son()) {
-        data = data->par;
-      } else {
-        while (data->is_left_son()) {
-          data = data->par;
-        }
-        data = data->par;
-      }
+      index_t::prev(data);
       return *this;
     }
 
@@ -84,25 +91,46 @@ struct bimap {
       return res;
     }
 
-    using other_tag = std::conditional_t
-        <std::is_same_v<Tag, left_tag>, right_tag, left_tag>;
-    using other_t = std::conditional_t
-        <std::is_same_v<Tag, left_tag>, right_t, left_t>;
+    iterator &operator+=(std::ptrdiff_t n) noexcept {
+      static_assert(details::is_ranked_v<index_t>,
+                    "iterator arithmetic needs a ranked_index");
+      data = index_t::advance(data, n);
+      return *this;
+    }
+
+    iterator &operator-=(std::ptrdiff_t n) noexcept {
+      return *this += -n;
+    }
+
+    friend iterator operator+(iterator it, std::ptrdiff_t n) noexcept {
+      return it += n;
+    }
+
+    friend iterator operator-(iterator it, std::ptrdiff_t n) noexcept {
+      return it -= n;
+    }
+
+    friend std::ptrdiff_t operator-(iterator const &a,
+                                    iterator const &b) noexcept {
+      static_assert(details::is_ranked_v<index_t>,
+                    "iterator arithmetic needs a ranked_index");
+      return static_cast<std::ptrdiff_t>(index_t::index_of(a.data)) -
+             static_cast<std::ptrdiff_t>(index_t::index_of(b.data));
+    }
+
+    using other_tag = std::conditional_t<is_left, right_tag, left_tag>;
+    using other_t = std::conditional_t<is_left, right_t, left_t>;
     using other_it = iterator<other_t, other_tag>;
 
     other_it flip() const noexcept {
-      map_element_base* ptr;
-      if (data->par == nullptr) { // fake node
-        ptr = data->right;
-      } else {
-        using from_t = std::conditional_t
-            <std::is_same_v<Tag, left_tag>, left_node_t, right_node_t>;
-        using to_t = std::conditional_t
-            <std::is_same_v<Tag, right_tag>, left_node_t, right_node_t>;
-        ptr = static_cast<to_t*>(
-            static_cast<node_t*>(static_cast<from_t*>(data)));
+      using other_index_t = typename other_it::index_t;
+      if (index_t::is_end(data)) {
+        return other_it(other_index_t::end_of(index_t::sibling(data)));
       }
-      return other_it(ptr);
+      using from_t = std::conditional_t<is_left, left_node_t, right_node_t>;
+      using to_t = std::conditional_t<is_left, right_node_t, left_node_t>;
+      return other_it(
+          static_cast<to_t*>(static_cast<node_t*>(static_cast<from_t*>(data))));
     }
 
     bool operator==(iterator const &other) const noexcept {
@@ -115,33 +143,105 @@ struct bimap {
 
     friend bimap;
   private:
-    map_element_base* data;
+    base_t* data;
   };
 
   using left_iterator = iterator<left_t, left_tag>;
   using right_iterator = iterator<right_t, right_tag>;
 
+  // Owns a pair taken out by extract_left/extract_right until it is
+  // inserted again, into this map or into another one with an equal
+  // allocator. The keys may be changed meanwhile.
+  struct node_type {
+    static_assert(!std::is_same_v<node_allocator_t,
+                                  details::arena_allocator<node_t>>,
+                  "nodes of a compact map live in its own arena");
+
+    node_type() noexcept = default;
+
+    node_type(node_type &&other) noexcept
+        : node(std::exchange(other.node, nullptr)),
+          alloc(std::move(other.alloc)) {}
+
+    node_type &operator=(node_type &&other) noexcept {
+      if (this != &other) {
+        reset();
+        node = std::exchange(other.node, nullptr);
+        alloc = std::move(other.alloc);
+      }
+      return *this;
+    }
+
+    ~node_type() {
+      reset();
+    }
+
+    bool empty() const noexcept {
+      return node == nullptr;
+    }
+
+    explicit operator bool() const noexcept {
+      return node != nullptr;
+    }
+
+    left_t &left() const noexcept {
+      return node_left_upcast(node)->val;
+    }
+
+    right_t &right() const noexcept {
+      return node_right_upcast(node)->val;
+    }
+
+    friend bimap;
+
+  private:
+    node_type(node_t *node_, node_allocator_t const &alloc_)
+        : node(node_), alloc(alloc_) {}
+
+    void reset() noexcept {
+      if (node != nullptr) {
+        node_alloc_traits::destroy(*alloc, node);
+        node_alloc_traits::deallocate(*alloc, node, 1);
+        node = nullptr;
+      }
+    }
+
+    node_t *node{nullptr};
+    std::optional<node_allocator_t> alloc;
+  };
+
   bimap(CompareLeft compare_left = CompareLeft(),
-        CompareRight compare_right = CompareRight()) noexcept
-      : left_treap(std::move(compare_left)),
-        right_treap(std::move(compare_right)) {
-    left_treap.fake.right = &right_treap.fake;
-    right_treap.fake.right = &left_treap.fake;
+        CompareRight compare_right = CompareRight(),
+        Allocator const& alloc = Allocator()) noexcept
+      : node_allocator_t(alloc), left_index(std::move(compare_left)),
+        right_index(std::move(compare_right)) {
+    link_sides();
+  }
+
+  template <typename InputIt, typename = typename std::iterator_traits<
+                                 InputIt>::iterator_category>
+  bimap(InputIt first, InputIt last, CompareLeft compare_left = CompareLeft(),
+        CompareRight compare_right = CompareRight(),
+        Allocator const& alloc = Allocator())
+      : bimap(std::move(compare_left), std::move(compare_right), alloc) {
+    bulk_load(first, last);
   }
 
   bimap(bimap const &other)
-      : left_treap(static_cast<CompareLeft const&>(other.left_treap)),
-        right_treap(static_cast<CompareRight const&>(other.right_treap)) {
-    left_treap.fake.right = &right_treap.fake;
-    right_treap.fake.right = &left_treap.fake;
-    for (left_iterator lit = other.begin_left(); lit != other.end_left(); ++lit) {
-      insert(*lit, *lit.flip());
-    }
+      : node_allocator_t(node_alloc_traits::select_on_container_copy_construction(
+            other.get_node_allocator())),
+        left_index(other.left_index.get_cmp()),
+        right_index(other.right_index.get_cmp()) {
+    link_sides();
+    clone_from(other);
   }
 
   bimap(bimap &&other) noexcept
-      : left_treap(std::move(other.left_treap)),
-        right_treap(std::move(other.right_treap)), sz(other.sz)  {}
+      : node_allocator_t(std::move(other.get_node_allocator())),
+        sz(std::exchange(other.sz, 0)), left_index(std::move(other.left_index)),
+        right_index(std::move(other.right_index)) {
+    link_sides();
+  }
 
   bimap &operator=(bimap const &other) {
     if (this == &other) {
@@ -157,48 +257,130 @@ struct bimap {
       return *this;
     }
     swap(other);
-    other.erase_left(begin_left(), end_left());
+    other.clear();
     return *this;
   }
 
   ~bimap() {
-    erase_left(begin_left(), end_left());
+    clear();
   }
 
   void swap(bimap& other) noexcept {
-    left_treap.swap(other.left_treap);
-    right_treap.swap(other.right_treap);
+    left_index.swap(other.left_index);
+    right_index.swap(other.right_index);
     std::swap(sz, other.sz);
+    std::swap(get_node_allocator(), other.get_node_allocator());
+  }
+
+  // Replaces the contents with pairs from [first, last), keeping what a loop
+  // of insert would: a pair is dropped if its left or right key belongs to a
+  // pair kept earlier in the input. The number of dropped pairs is returned.
+  // Sorted input skips the sorting step.
+  template <typename InputIt>
+  std::size_t assign(InputIt first, InputIt last) {
+    bimap tmp(left_index.get_cmp(), right_index.get_cmp(), get_allocator());
+    std::size_t dropped = tmp.bulk_load(first, last);
+    swap(tmp);
+    return dropped;
+  }
+
+  allocator_type get_allocator() const noexcept {
+    if constexpr (std::is_same_v<node_allocator_t,
+                                 details::arena_allocator<node_t>>) {
+      return allocator_type();
+    } else {
+      return allocator_type(get_node_allocator());
+    }
   }
 
   template <typename left_t_ = left_t, typename right_t_ = right_t>
   left_iterator insert(left_t_&&left, right_t_&&right) {
-    if (left_treap.find(left) != nullptr) {
+    typename left_index_t::position left_pos;
+    typename right_index_t::position right_pos;
+    if (left_index.locate(left, left_pos) != nullptr ||
+        right_index.locate(right, right_pos) != nullptr) {
       return end_left();
     }
-    if (right_treap.find(right) != nullptr) {
+    return insert_at(left_pos, right_pos, std::forward<left_t_>(left),
+                     std::forward<right_t_>(right));
+  }
+
+  // Hints point to the elements the new pair would precede on each side (as
+  // for std::map). A correct hint saves the search on its side, so feeding
+  // pairs in order with end hints needs no comparisons beyond the checks.
+  // A treap side still updates the subtree sizes of the ancestors, so each
+  // insert stays O(log n).
+  template <typename left_t_ = left_t, typename right_t_ = right_t>
+  left_iterator insert(left_iterator hint_left, right_iterator hint_right,
+                       left_t_&&left, right_t_&&right) {
+    typename left_index_t::position left_pos;
+    typename right_index_t::position right_pos;
+    if (!left_index.locate_by_hint(hint_left.data, left, left_pos) &&
+        left_index.locate(left, left_pos) != nullptr) {
       return end_left();
     }
-    auto* node =
-        new node_t(std::forward<left_t_>(left), std::forward<right_t_>(right));
-    map_element_base* l_ptr = left_treap.insert(*node);
-    right_treap.insert(*node);
-    sz++;
-    return left_iterator(l_ptr);
+    if (!right_index.locate_by_hint(hint_right.data, right, right_pos) &&
+        right_index.locate(right, right_pos) != nullptr) {
+      return end_left();
+    }
+    return insert_at(left_pos, right_pos, std::forward<left_t_>(left),
+                     std::forward<right_t_>(right));
+  }
+
+  // Links the pair of nh if both of its keys are absent here and empties
+  // nh. Otherwise the end is returned and nh keeps the pair. Nothing is
+  // allocated or copied.
+  left_iterator insert(node_type &&nh) {
+    if (nh.empty()) {
+      return end_left();
+    }
+    assert(same_allocator(*nh.alloc));
+    typename left_index_t::position left_pos;
+    typename right_index_t::position right_pos;
+    if (left_index.locate(nh.left(), left_pos) != nullptr ||
+        right_index.locate(nh.right(), right_pos) != nullptr) {
+      return end_left();
+    }
+    link_node(left_pos, right_pos, *nh.node);
+    return left_iterator(node_left_upcast(std::exchange(nh.node, nullptr)));
+  }
+
+  // Gives the pair of it a new key on this side if no other pair has it.
+  // The node moves within this side's index only, the other index and the
+  // iterators to the pair stay valid. If a B+-tree or hash side fails to
+  // make room, the pair keeps its key and place.
+  bool replace_left(left_iterator it, left_t left) {
+    static_assert(std::is_nothrow_swappable_v<left_t>,
+                  "replacing keys needs a nothrow swap");
+    left_node_t *e = left_base_downcast(it.data);
+    return rekey(left_index, e, left);
+  }
+
+  bool replace_right(right_iterator it, right_t right) {
+    static_assert(std::is_nothrow_swappable_v<right_t>,
+                  "replacing keys needs a nothrow swap");
+    right_node_t *e = right_base_downcast(it.data);
+    return rekey(right_index, e, right);
   }
 
   left_iterator erase_left(left_iterator it) noexcept {
     left_iterator copy(it.data);
     ++copy;
     node_t* ptr = left_base_double_downcast(it.data);
-    left_treap.erase(it.data);
-    right_treap.erase(node_right_upcast(ptr));
-    delete ptr;
+    left_index.erase(it.data);
+    right_index.erase(node_right_upcast(ptr));
+    destroy_node(ptr);
     sz--;
     return copy;
   }
 
   bool erase_left(left_t const &left) noexcept {
+    return erase_left<left_t>(left);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<left_index_t, K>>>
+  bool erase_left(K const &left) noexcept {
     left_iterator it = find_left(left);
     if (it == end_left()) {
       return false;
@@ -212,14 +394,20 @@ struct bimap {
     right_iterator copy(it.data);
     ++copy;
     node_t* ptr = right_base_double_downcast(it.data);
-    left_treap.erase(node_left_upcast(ptr));
-    right_treap.erase(it.data);
-    delete ptr;
+    left_index.erase(node_left_upcast(ptr));
+    right_index.erase(it.data);
+    destroy_node(ptr);
     sz--;
     return copy;
   }
 
   bool erase_right(right_t const &right) noexcept {
+    return erase_right<right_t>(right);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<right_index_t, K>>>
+  bool erase_right(K const &right) noexcept {
     right_iterator it = find_right(right);
     if (it == end_right()) {
       return false;
@@ -229,31 +417,229 @@ struct bimap {
     }
   }
 
+  // Unlinks a pair without freeing it, see node_type. A missing key gives
+  // an empty handle.
+  node_type extract_left(left_iterator it) {
+    node_t *ptr = left_base_double_downcast(it.data);
+    return extract(ptr);
+  }
+
+  node_type extract_left(left_t const &left) {
+    return extract_left<left_t>(left);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<left_index_t, K>>>
+  node_type extract_left(K const &left) {
+    left_iterator it = find_left(left);
+    return it == end_left() ? node_type() : extract_left(it);
+  }
+
+  node_type extract_right(right_iterator it) {
+    node_t *ptr = right_base_double_downcast(it.data);
+    return extract(ptr);
+  }
+
+  node_type extract_right(right_t const &right) {
+    return extract_right<right_t>(right);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<right_index_t, K>>>
+  node_type extract_right(K const &right) {
+    right_iterator it = find_right(right);
+    return it == end_right() ? node_type() : extract_right(it);
+  }
+
+  // A treap side cuts the range out in O(log n), the pairs are then removed
+  // from the other side and freed.
   left_iterator erase_left(left_iterator first, left_iterator last) noexcept {
-    while (first != last) {
-      erase_left(first++);
+    if constexpr (details::is_treap_v<left_index_t>) {
+      if (first != last) {
+        erase_cut<left_index_t>(left_index.cut(first.data, last.data),
+                                right_index);
+      }
+    } else {
+      while (first != last) {
+        erase_left(first++);
+      }
     }
-    return first;
+    return last;
   }
 
   right_iterator erase_right(right_iterator first, right_iterator last) noexcept {
-    while (first != last) {
-      erase_right(first++);
+    if constexpr (details::is_treap_v<right_index_t>) {
+      if (first != last) {
+        erase_cut<right_index_t>(right_index.cut(first.data, last.data),
+                                 left_index);
+      }
+    } else {
+      while (first != last) {
+        erase_right(first++);
+      }
+    }
+    return last;
+  }
+
+  // Frees all pairs in O(n): the right index is dropped without unlinking
+  // the nodes, then they are visited once through the left one.
+  void clear() noexcept {
+    right_index.release();
+    left_index.clear([this](left_node_t* e) {
+      destroy_node(left_base_double_downcast(e));
+    });
+    sz = 0;
+  }
+
+  // Moves the pairs of other whose left and right keys are both absent here
+  // into this map by relinking their nodes. The rest stays in other. The
+  // allocators must be equal.
+  void merge_union(bimap &other) noexcept {
+    static_assert(treap_indexed, "set operations need treap indexes");
+    if (this == &other || other.empty()) {
+      return;
+    }
+    assert(same_allocator(other.get_node_allocator()));
+    unsigned depth = fork_depth();
+    auto any = [](auto const &, auto const &) { return true; };
+
+    std::size_t n = sz + other.sz;
+    auto [left_taken, left_free] = left_index.partition(
+        left_index.root(), other.left_index.release(), any, depth, n);
+    left_index_t::for_each(left_taken, [&other](left_node_t *e) {
+      other.right_index.erase(node_right_upcast(left_base_double_downcast(e)));
+    });
+    auto [right_taken, right_free] = right_index.partition(
+        right_index.root(), other.right_index.release(), any, depth, n);
+    other.left_index.reset(left_free);
+    right_index_t::for_each(right_taken, [&other](right_node_t *e) {
+      other.left_index.erase(node_left_upcast(right_base_double_downcast(e)));
+    });
+    left_free = other.left_index.release();
+
+    std::size_t moved = left_index_t::count(left_free);
+    details::fork_join(
+        depth > 0 && moved >= left_index_t::parallel_cutoff,
+        [&, left_free = left_free] {
+          left_index.reset(
+              left_index.unite(left_index.release(), left_free, depth,
+                               sz + moved));
+        },
+        [&, right_free = right_free] {
+          right_index.reset(
+              right_index.unite(right_index.release(), right_free, depth,
+                                sz + moved));
+        });
+    sz += moved;
+    other.sz -= moved;
+
+    // pairs taken on one side only lost their link on the other one
+    other.left_index.reset(left_taken);
+    other.right_index.reset(right_taken);
+    right_index_t::for_each(right_taken, [&other](right_node_t *e) {
+      other.left_index.insert(*node_left_upcast(right_base_double_downcast(e)));
+    });
+    left_index_t::for_each(other.left_index.fake.left, [&other](left_node_t *e) {
+      right_node_t *r = node_right_upcast(left_base_double_downcast(e));
+      if (r->par == nullptr) {
+        other.right_index.insert(*r);
+      }
+    });
+  }
+
+  // Moves the pairs of other whose keys are both absent here by relinking
+  // their nodes, as std::map::merge does. Treap maps do it with
+  // merge_union, the others pair by pair. The allocators must be equal. If
+  // a B+-tree or hash side fails to allocate, the pair being moved stays
+  // in other.
+  void merge(bimap &other) {
+    static_assert(!std::is_same_v<node_allocator_t,
+                                  details::arena_allocator<node_t>>,
+                  "nodes of a compact map live in its own arena");
+    if constexpr (treap_indexed) {
+      merge_union(other);
+    } else {
+      if (this == &other) {
+        return;
+      }
+      assert(same_allocator(other.get_node_allocator()));
+      for (left_iterator it = other.begin_left(); it != other.end_left();) {
+        node_t *node = left_base_double_downcast(it.data);
+        ++it;
+        typename left_index_t::position left_pos;
+        typename right_index_t::position right_pos;
+        if (left_index.locate(node_left_upcast(node)->val, left_pos) ==
+                nullptr &&
+            right_index.locate(node_right_upcast(node)->val, right_pos) ==
+                nullptr) {
+          take_node(other, left_pos, right_pos, *node);
+        }
+      }
+    }
+  }
+
+  // Keeps only the pairs that are present in other as well.
+  void intersect(bimap const &other) noexcept {
+    static_assert(treap_indexed, "set operations need treap indexes");
+    if (this != &other) {
+      filter_by(other, true);
     }
-    return first;
   }
 
+  // Removes the pairs that are present in other.
+  void difference(bimap const &other) noexcept {
+    static_assert(treap_indexed, "set operations need treap indexes");
+    if (this == &other) {
+      clear();
+    } else {
+      filter_by(other, false);
+    }
+  }
+
+  // Lookups take keys of other types without converting them if the side's
+  // comparator is transparent (for hash_index, the hash and the equality).
   left_iterator find_left(left_t const &left) const noexcept {
-    map_element_base* ptr = left_treap.find(left);
+    return find_left<left_t>(left);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<left_index_t, K>>>
+  left_iterator find_left(K const &left) const noexcept {
+    left_node_t* ptr = left_index.find(left);
     return ptr == nullptr ? end_left() : left_iterator(ptr);
   }
 
   right_iterator find_right(right_t const &right) const noexcept {
-    map_element_base* ptr = right_treap.find(right);
+    return find_right<right_t>(right);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<right_index_t, K>>>
+  right_iterator find_right(K const &right) const noexcept {
+    right_node_t* ptr = right_index.find(right);
     return ptr == nullptr ? end_right() : right_iterator(ptr);
   }
 
+  // Writes an iterator for every key of [first, last) to out, the end one
+  // for missing keys. Treap and hash sides look up a group of keys at a
+  // time so that the cache misses of different keys overlap.
+  template <typename RandomIt, typename OutputIt>
+  OutputIt find_left_many(RandomIt first, RandomIt last, OutputIt out) const {
+    return find_many<left_iterator>(left_index, first, last, out);
+  }
+
+  template <typename RandomIt, typename OutputIt>
+  OutputIt find_right_many(RandomIt first, RandomIt last, OutputIt out) const {
+    return find_many<right_iterator>(right_index, first, last, out);
+  }
+
   right_t const &at_left(left_t const &key) const {
+    return at_left<left_t>(key);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<left_index_t, K>>>
+  right_t const &at_left(K const &key) const {
     left_iterator it = find_left(key);
     if (it != end_left()) {
       return *it.flip();
@@ -263,6 +649,12 @@ struct bimap {
   }
 
   left_t const &at_right(right_t const &key) const {
+    return at_right<right_t>(key);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<right_index_t, K>>>
+  left_t const &at_right(K const &key) const {
     right_iterator it = find_right(key);
     if (it != end_right()) {
       return *it.flip();
@@ -280,10 +672,7 @@ struct bimap {
       right_t dflt_r = right_t();
       right_iterator rit = find_right(dflt_r);
       if (rit != end_right()) {
-        left_iterator lit1 = rit.flip();
-        left_treap.erase(lit1.data);
-        left_base_downcast(lit1.data)->val = key;
-        left_treap.insert(*left_base_downcast(lit1.data));
+        replace_left(rit.flip(), key);
         return *rit;
       } else {
         return *insert(key, std::move(dflt_r)).flip();
@@ -300,10 +689,7 @@ struct bimap {
       left_t dflt_l = left_t();
       left_iterator lit = find_left(dflt_l);
       if (lit != end_left()) {
-        right_iterator rit1= lit.flip();
-        right_treap.erase(rit1.data);
-        right_base_downcast(rit1.data)->val = key;
-        right_treap.insert(*right_base_downcast(rit1.data));
+        replace_right(lit.flip(), key);
         return *lit;
       } else {
         return *insert(std::move(dflt_l), key);
@@ -312,34 +698,163 @@ struct bimap {
   }
 
   left_iterator lower_bound_left(const left_t &left) const noexcept {
-    return left_iterator(left_treap.lower_bound(left));
+    return lower_bound_left<left_t>(left);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<left_index_t, K>>>
+  left_iterator lower_bound_left(K const &left) const noexcept {
+    static_assert(left_index_t::ordered, "bounds need an ordered index");
+    return left_iterator(left_index.lower_bound(left));
   }
   left_iterator upper_bound_left(const left_t &left) const noexcept {
-    return left_iterator(left_treap.upper_bound(left));
+    return upper_bound_left<left_t>(left);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<left_index_t, K>>>
+  left_iterator upper_bound_left(K const &left) const noexcept {
+    static_assert(left_index_t::ordered, "bounds need an ordered index");
+    return left_iterator(left_index.upper_bound(left));
   }
 
   right_iterator lower_bound_right(const right_t &right) const noexcept {
-    return right_iterator(right_treap.lower_bound(right));
+    return lower_bound_right<right_t>(right);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<right_index_t, K>>>
+  right_iterator lower_bound_right(K const &right) const noexcept {
+    static_assert(right_index_t::ordered, "bounds need an ordered index");
+    return right_iterator(right_index.lower_bound(right));
   }
 
   right_iterator upper_bound_right(const right_t &right) const noexcept {
-    return right_iterator(right_treap.upper_bound(right));
+    return upper_bound_right<right_t>(right);
+  }
+
+  template <typename K, typename = std::enable_if_t<
+                            details::accepts_key_v<right_index_t, K>>>
+  right_iterator upper_bound_right(K const &right) const noexcept {
+    static_assert(right_index_t::ordered, "bounds need an ordered index");
+    return right_iterator(right_index.upper_bound(right));
+  }
+
+  // Order statistics need subtree sizes, kept by a ranked_index side. They
+  // are templates so that a bimap without them still instantiates.
+  template <typename Index = left_index_t>
+  left_iterator nth_left(std::size_t k) const noexcept {
+    static_assert(details::is_ranked_v<Index>,
+                  "order statistics need a ranked_index");
+    return left_iterator(left_index.nth(k));
+  }
+
+  template <typename Index = right_index_t>
+  right_iterator nth_right(std::size_t k) const noexcept {
+    static_assert(details::is_ranked_v<Index>,
+                  "order statistics need a ranked_index");
+    return right_iterator(right_index.nth(k));
+  }
+
+  // number of keys less than the given one
+  template <typename Index = left_index_t>
+  std::size_t rank_left(left_t const &left) const noexcept {
+    static_assert(details::is_ranked_v<Index>,
+                  "order statistics need a ranked_index");
+    return left_index.rank(left);
+  }
+
+  template <typename Index = right_index_t>
+  std::size_t rank_right(right_t const &right) const noexcept {
+    static_assert(details::is_ranked_v<Index>,
+                  "order statistics need a ranked_index");
+    return right_index.rank(right);
+  }
+
+  // number of keys in [lo, hi)
+  template <typename Index = left_index_t>
+  std::size_t count_left(left_t const &lo, left_t const &hi) const noexcept {
+    std::size_t l = rank_left<Index>(lo), r = rank_left<Index>(hi);
+    return l < r ? r - l : 0;
+  }
+
+  template <typename Index = right_index_t>
+  std::size_t count_right(right_t const &lo, right_t const &hi) const noexcept {
+    std::size_t l = rank_right<Index>(lo), r = rank_right<Index>(hi);
+    return l < r ? r - l : 0;
   }
 
   left_iterator begin_left() const noexcept {
-    return left_iterator(left_treap.min());
+    return left_iterator(left_index.begin());
   }
 
   left_iterator end_left() const noexcept {
-    return left_iterator(&left_treap.fake);
+    return left_iterator(left_index.end());
   }
 
   right_iterator begin_right() const noexcept {
-    return right_iterator(right_treap.min());
+    return right_iterator(right_index.begin());
   }
 
   right_iterator end_right() const noexcept {
-    return right_iterator(&right_treap.fake);
+    return right_iterator(right_index.end());
+  }
+
+  // Immutable copy for maps that are only queried from now on, see
+  // frozen_bimap.
+  frozen_bimap<Left, Right, CompareLeft, CompareRight> freeze() const {
+    static_assert(left_index_t::ordered && right_index_t::ordered,
+                  "freezing needs ordered indexes");
+    std::vector<std::pair<left_t, right_t>> pairs;
+    pairs.reserve(sz);
+    for (left_iterator it = begin_left(); it != end_left(); ++it) {
+      pairs.emplace_back(*it, *it.flip());
+    }
+    return frozen_bimap<Left, Right, CompareLeft, CompareRight>(
+        pairs.begin(), pairs.end(), left_index.get_cmp(),
+        right_index.get_cmp());
+  }
+
+  // Counters of the sides whose comparator is treap_index<...,
+  // collect_statistics>. Counting is not synchronized, so such a map must
+  // not be read by several threads at once, and its set operations do not
+  // fork.
+  template <typename Compare = CompareLeft>
+  operation_counts const &statistics_left() const noexcept {
+    static_assert(details::statistics_of_t<Compare>::enabled,
+                  "statistics are collected with treap_index<..., "
+                  "collect_statistics>");
+    return left_index.get_stats().counts;
+  }
+
+  template <typename Compare = CompareRight>
+  operation_counts const &statistics_right() const noexcept {
+    static_assert(details::statistics_of_t<Compare>::enabled,
+                  "statistics are collected with treap_index<..., "
+                  "collect_statistics>");
+    return right_index.get_stats().counts;
+  }
+
+  void reset_statistics() noexcept {
+    if constexpr (details::statistics_of_t<CompareLeft>::enabled) {
+      left_index.get_stats().counts = {};
+    }
+    if constexpr (details::statistics_of_t<CompareRight>::enabled) {
+      right_index.get_stats().counts = {};
+    }
+  }
+
+  // depth and height histograms of a side, walks the whole tree
+  tree_shape shape_left() const {
+    static_assert(details::is_treap_v<left_index_t>,
+                  "shapes are computed for treap indexes");
+    return left_index.shape();
+  }
+
+  tree_shape shape_right() const {
+    static_assert(details::is_treap_v<right_index_t>,
+                  "shapes are computed for treap indexes");
+    return right_index.shape();
   }
 
   bool empty() const noexcept {
@@ -354,10 +869,20 @@ struct bimap {
     if (a.sz != b.sz) {
       return false;
     }
+    if constexpr (!left_index_t::ordered) {
+      for (left_iterator a_lit = a.begin_left(); a_lit != a.end_left(); ++a_lit) {
+        left_iterator b_lit = b.find_left(*a_lit);
+        if (b_lit == b.end_left() ||
+            !a.right_index.equal(*a_lit.flip(), *b_lit.flip())) {
+          return false;
+        }
+      }
+      return true;
+    }
     left_iterator a_lit = a.begin_left(), b_lit = b.begin_left(), a_end = a.end_left();
     while (a_lit != a_end) {
-      if (!(a.left_treap.equal(*a_lit, *b_lit) &&
-            a.right_treap.equal(*a_lit.flip(), *b_lit.flip()))) {
+      if (!(a.left_index.equal(*a_lit, *b_lit) &&
+            a.right_index.equal(*a_lit.flip(), *b_lit.flip()))) {
         return false;
       }
       a_lit++, b_lit++;
@@ -370,8 +895,439 @@ struct bimap {
 
 private:
   size_t sz{0};
-  left_treap_t left_treap;
-  right_treap_t right_treap;
+  left_index_t left_index;
+  right_index_t right_index;
+
+  node_allocator_t& get_node_allocator() noexcept {
+    return static_cast<node_allocator_t&>(*this);
+  }
+
+  node_allocator_t const& get_node_allocator() const noexcept {
+    return static_cast<node_allocator_t const&>(*this);
+  }
+
+  // nodes relinked from elsewhere are freed by this map's allocator later
+  bool same_allocator(node_allocator_t const& other) const noexcept {
+    if constexpr (node_alloc_traits::is_always_equal::value) {
+      return true;
+    } else {
+      return get_node_allocator() == other;
+    }
+  }
+
+  template <typename... Args>
+  node_t* create_node(Args&&... args) {
+    node_t* node = node_alloc_traits::allocate(get_node_allocator(), 1);
+    record(&operation_counts::allocations);
+    try {
+      node_alloc_traits::construct(get_node_allocator(), node,
+                                   std::forward<Args>(args)...);
+    } catch (...) {
+      node_alloc_traits::deallocate(get_node_allocator(), node, 1);
+      throw;
+    }
+    return node;
+  }
+
+  void record(std::uint64_t operation_counts::*counter) const noexcept {
+    if constexpr (details::is_treap_v<left_index_t>) {
+      left_index.record(counter);
+    }
+    if constexpr (details::is_treap_v<right_index_t>) {
+      right_index.record(counter);
+    }
+  }
+
+  // counters are plain integers, so counting maps stay on one thread
+  static unsigned fork_depth() noexcept {
+    if constexpr (details::statistics_of_t<CompareLeft>::enabled ||
+                  details::statistics_of_t<CompareRight>::enabled) {
+      return 0;
+    } else {
+      return details::fork_depth();
+    }
+  }
+
+  template <typename It, typename Index, typename RandomIt, typename OutputIt>
+  static OutputIt find_many(Index const& index, RandomIt first, RandomIt last,
+                            OutputIt out) {
+    constexpr std::size_t batch = 64;
+    typename Index::element_t* found[batch];
+    while (first != last) {
+      std::size_t n = std::min<std::size_t>(batch, last - first);
+      index.find_many(first, n, found);
+      for (std::size_t i = 0; i < n; i++) {
+        *out++ = found[i] == nullptr ? It(index.end()) : It(found[i]);
+      }
+      first += n;
+    }
+    return out;
+  }
+
+  void destroy_node(node_t* node) noexcept {
+    record(&operation_counts::deallocations);
+    node_alloc_traits::destroy(get_node_allocator(), node);
+    node_alloc_traits::deallocate(get_node_allocator(), node, 1);
+  }
+
+  // Keeps the pairs that are (or are not) present in other, frees the rest.
+  void filter_by(bimap const &other, bool keep_present) noexcept {
+    unsigned depth = fork_depth();
+    auto same_right = [this](left_node_t const &a, left_node_t const &b) {
+      return right_index.equal(right_value(a), right_value(b));
+    };
+    auto same_left = [this](right_node_t const &a, right_node_t const &b) {
+      return left_index.equal(left_value(a), left_value(b));
+    };
+    std::pair<left_node_t *, left_node_t *> left_parts;
+    std::pair<right_node_t *, right_node_t *> right_parts;
+    details::fork_join(
+        depth > 0 && sz + other.sz >= left_index_t::parallel_cutoff,
+        [&] {
+          left_parts = left_index.partition(
+              other.left_index.root(), left_index.release(), same_right,
+              depth > 0 ? depth - 1 : 0, sz + other.sz);
+        },
+        [&] {
+          right_parts = right_index.partition(
+              other.right_index.root(), right_index.release(), same_left,
+              depth > 0 ? depth - 1 : 0, sz + other.sz);
+        });
+    if (keep_present) {
+      left_index.reset(left_parts.first);
+      right_index.reset(right_parts.first);
+      sz -= destroy_subtree(left_parts.second);
+    } else {
+      left_index.reset(left_parts.second);
+      right_index.reset(right_parts.second);
+      sz -= destroy_subtree(left_parts.first);
+    }
+  }
+
+  // Removes the pairs of a tree cut out of a treap index from the other
+  // index and frees them. A treap drops many of them in one pass.
+  template <typename Index, typename Other>
+  void erase_cut(typename Index::element_t *root, Other &other) noexcept {
+    using other_element_t = typename Other::element_t;
+    std::size_t removed = Index::count(root);
+    bool batch = false;
+    if constexpr (details::is_treap_v<Other>) {
+      std::size_t depth = 1;
+      for (std::size_t n = sz; n > 1; n /= 2) {
+        depth++;
+      }
+      if (removed * depth > sz) {
+        Index::for_each(root, [](auto *e) {
+          Other::mark(static_cast<other_element_t *>(static_cast<node_t *>(e)));
+        });
+        other.drop_marked();
+        batch = true;
+      }
+    }
+    Index::dismantle(root, [this, &other, batch](auto *e) {
+      node_t *node = static_cast<node_t *>(e);
+      if (!batch) {
+        other.erase(static_cast<other_element_t *>(node));
+      }
+      destroy_node(node);
+    });
+    sz -= removed;
+  }
+
+  // returns the number of freed pairs
+  std::size_t destroy_subtree(left_node_t *root) noexcept {
+    std::size_t res = 0;
+    left_index_t::dismantle(root, [this, &res](left_node_t *e) {
+      destroy_node(left_base_double_downcast(e));
+      res++;
+    });
+    return res;
+  }
+
+  void link_sides() noexcept {
+    left_index.set_sibling(right_index.sentinel());
+    right_index.set_sibling(left_index.sentinel());
+  }
+
+  template <typename left_t_, typename right_t_>
+  left_iterator insert_at(typename left_index_t::position left_pos,
+                          typename right_index_t::position right_pos,
+                          left_t_&& left, right_t_&& right) {
+    node_t* node =
+        create_node(std::forward<left_t_>(left), std::forward<right_t_>(right));
+    try {
+      link_node(left_pos, right_pos, *node);
+    } catch (...) {
+      destroy_node(node);
+      throw;
+    }
+    return left_iterator(node_left_upcast(node));
+  }
+
+  // linking into a B+-tree may fail to allocate a tree node, the node is
+  // then linked to neither side
+  void link_node(typename left_index_t::position left_pos,
+                 typename right_index_t::position right_pos, node_t& node) {
+    left_index.link_at(left_pos, node);
+    try {
+      right_index.link_at(right_pos, node);
+    } catch (...) {
+      left_index.erase(node_left_upcast(&node));
+      throw;
+    }
+    sz++;
+  }
+
+  // The key is swapped in, so key gets the old one. An equivalent key
+  // keeps the element in place.
+  template <typename Index, typename T>
+  bool rekey(Index &index, typename Index::element_t *e, T &key) {
+    typename Index::position pos;
+    typename Index::element_t *found = index.locate(key, pos);
+    if (found == e) {
+      using std::swap;
+      swap(e->val, key);
+      return true;
+    }
+    if (found != nullptr) {
+      return false;
+    }
+    index.relink(*e, key);
+    return true;
+  }
+
+  // Moves a node of other here. It is linked here before it leaves other,
+  // with the links into the indexes of either map put back in turn, so if
+  // linking fails it stays in other as it was.
+  void take_node(bimap &other, typename left_index_t::position left_pos,
+                 typename right_index_t::position right_pos, node_t &node) {
+    left_base_t &left = *node_left_upcast(&node);
+    right_base_t &right = *node_right_upcast(&node);
+    left_base_t left_there = left;
+    right_base_t right_there = right;
+    try {
+      link_node(left_pos, right_pos, node);
+    } catch (...) {
+      left = left_there;
+      right = right_there;
+      throw;
+    }
+    left_base_t left_here = left;
+    right_base_t right_here = right;
+    left = left_there;
+    right = right_there;
+    other.unlink_node(&node);
+    left = left_here;
+    right = right_here;
+  }
+
+  void unlink_node(node_t* node) noexcept {
+    left_index.erase(node_left_upcast(node));
+    right_index.erase(node_right_upcast(node));
+    sz--;
+  }
+
+  node_type extract(node_t* node) {
+    node_type res(node, get_node_allocator());
+    unlink_node(node);
+    return res;
+  }
+
+  // Maps the nodes of a bimap being copied to their copies, by address with
+  // linear probing. It is filled once and never erased from.
+  struct node_copies {
+    explicit node_copies(std::size_t n) {
+      std::size_t capacity = 8;
+      while (capacity < n * 2) {
+        capacity *= 2;
+        shift--;
+      }
+      slots.resize(capacity);
+    }
+
+    void put(node_t const* from, node_t* to) noexcept {
+      std::size_t i = home(from);
+      while (slots[i].first != nullptr) {
+        i = (i + 1) & (slots.size() - 1);
+      }
+      slots[i] = {from, to};
+    }
+
+    node_t* get(node_t const* from) const noexcept {
+      std::size_t i = home(from);
+      while (slots[i].first != from) {
+        i = (i + 1) & (slots.size() - 1);
+      }
+      return slots[i].second;
+    }
+
+    std::vector<std::pair<node_t const*, node_t*>> slots;
+
+  private:
+    unsigned shift = 64 - 3;
+
+    std::size_t home(node_t const* from) const noexcept {
+      return static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(from)) *
+                 0x9E3779B97F4A7C15ull >>
+             shift;
+    }
+  };
+
+  // Copies the pairs of other in one pass over each index. Both indexes get
+  // the shape of their counterparts in other (for treaps with the same
+  // priorities), so nothing is compared or searched for. Nodes are created
+  // while copying the left index and found again by their originals when
+  // copying the right one.
+  void clone_from(bimap const &other) {
+    node_copies copies(other.sz);
+    try {
+      left_index.clone(other.left_index, [this, &copies](left_node_t const* e) {
+        node_t const* from = static_cast<node_t const*>(e);
+        node_t* to = create_node(e->val, right_value(*e));
+        copies.put(from, to);
+        return node_left_upcast(to);
+      });
+      right_index.clone(other.right_index, [&copies](right_node_t const* e) {
+        return node_right_upcast(copies.get(static_cast<node_t const*>(e)));
+      });
+      sz = other.sz;
+    } catch (...) {
+      left_index.release();
+      right_index.release();
+      for (auto const& [from, to] : copies.slots) {
+        if (to != nullptr) {
+          destroy_node(to);
+        }
+      }
+      throw;
+    }
+  }
+
+  template <typename InputIt>
+  std::size_t bulk_load(InputIt first, InputIt last) {
+    std::vector<node_t*> nodes;
+    try {
+      for (; first != last; ++first) {
+        auto&& p = *first;
+        nodes.push_back(nullptr);
+        nodes.back() =
+            create_node(std::get<0>(std::forward<decltype(p)>(p)),
+                        std::get<1>(std::forward<decltype(p)>(p)));
+      }
+
+      std::vector<std::size_t> left_key, right_key;
+      std::vector<std::size_t> left_order =
+          rank_side(left_index, nodes, left_key, &node_left_upcast);
+      std::vector<std::size_t> right_order =
+          rank_side(right_index, nodes, right_key, &node_right_upcast);
+      // pairs are taken in input order, a key is only blocked by a kept pair
+      std::vector<char> dropped(nodes.size(), false);
+      std::vector<char> left_taken(left_key.size(), false);
+      std::vector<char> right_taken(right_key.size(), false);
+      for (std::size_t i = 0; i < nodes.size(); i++) {
+        typename left_index_t::position left_pos;
+        typename right_index_t::position right_pos;
+        if (key_taken(left_index, left_key, left_taken, nodes[i], i, left_pos,
+                      &node_left_upcast) ||
+            key_taken(right_index, right_key, right_taken, nodes[i], i,
+                      right_pos, &node_right_upcast)) {
+          dropped[i] = true;
+          continue;
+        }
+        take_key(left_index, left_key, left_taken, nodes[i], i, left_pos,
+                 &node_left_upcast);
+        take_key(right_index, right_key, right_taken, nodes[i], i, right_pos,
+                 &node_right_upcast);
+      }
+      link_side(left_index, left_order, nodes, dropped, &node_left_upcast);
+      link_side(right_index, right_order, nodes, dropped, &node_right_upcast);
+      for (std::size_t i = 0; i < nodes.size(); i++) {
+        if (dropped[i]) {
+          destroy_node(nodes[i]);
+        }
+      }
+      sz = std::count(dropped.begin(), dropped.end(), false);
+      return nodes.size() - sz;
+    } catch (...) {
+      left_index.release();
+      right_index.release();
+      for (node_t* node : nodes) {
+        if (node != nullptr) {
+          destroy_node(node);
+        }
+      }
+      throw;
+    }
+  }
+
+  // Returns the pairs in key order on this side and gives pairs with equal
+  // keys the same id. A hash index has no order, it is probed with the kept
+  // pairs instead and both vectors stay empty.
+  template <typename Index, typename Upcast>
+  static std::vector<std::size_t>
+  rank_side(Index &index, std::vector<node_t *> const &nodes,
+            std::vector<std::size_t> &key_id, Upcast upcast) {
+    std::vector<std::size_t> order;
+    if constexpr (Index::ordered) {
+      order.resize(nodes.size());
+      std::iota(order.begin(), order.end(), 0);
+      auto less = [&](std::size_t a, std::size_t b) {
+        return index.less(upcast(nodes[a])->val, upcast(nodes[b])->val);
+      };
+      if (!std::is_sorted(order.begin(), order.end(), less)) {
+        std::stable_sort(order.begin(), order.end(), less);
+      }
+      key_id.resize(nodes.size());
+      for (std::size_t i = 0; i < order.size(); i++) {
+        key_id[order[i]] = i > 0 && !less(order[i - 1], order[i])
+                               ? key_id[order[i - 1]]
+                               : i;
+      }
+    }
+    return order;
+  }
+
+  // whether a kept pair already has the key of nodes[i] on this side
+  template <typename Index, typename Upcast>
+  static bool key_taken(Index &index, std::vector<std::size_t> const &key_id,
+                        std::vector<char> const &taken, node_t *node,
+                        std::size_t i, typename Index::position &pos,
+                        Upcast upcast) {
+    if constexpr (Index::ordered) {
+      return taken[key_id[i]];
+    } else {
+      return index.locate(upcast(node)->val, pos) != nullptr;
+    }
+  }
+
+  // a hash index links the kept pair right away, pos comes from key_taken
+  template <typename Index, typename Upcast>
+  static void take_key(Index &index, std::vector<std::size_t> const &key_id,
+                       std::vector<char> &taken, node_t *node, std::size_t i,
+                       typename Index::position pos, Upcast upcast) {
+    if constexpr (Index::ordered) {
+      taken[key_id[i]] = true;
+    } else {
+      index.link_at(pos, *upcast(node));
+    }
+  }
+
+  // links the kept pairs of an ordered side, order comes from rank_side
+  template <typename Index, typename Upcast>
+  static void link_side(Index &index, std::vector<std::size_t> const &order,
+                        std::vector<node_t *> const &nodes,
+                        std::vector<char> const &dropped, Upcast upcast) {
+    if constexpr (Index::ordered) {
+      std::vector<typename Index::element_t *> elements;
+      elements.reserve(order.size());
+      for (std::size_t i : order) {
+        if (!dropped[i]) {
+          elements.push_back(upcast(nodes[i]));
+        }
+      }
+      index.build(elements.begin(), elements.end());
+    }
+  }
 
   static right_node_t* node_right_upcast(node_t* node) noexcept {
     return static_cast<right_node_t*>(node);
@@ -381,19 +1337,29 @@ private:
     return static_cast<left_node_t*>(node);
   }
 
-  static left_node_t* left_base_downcast(map_element_base* left) noexcept {
+  static left_node_t* left_base_downcast(left_base_t* left) noexcept {
     return static_cast<left_node_t*>(left);
   }
 
-  static right_node_t* right_base_downcast(map_element_base* right) noexcept {
+  static right_node_t* right_base_downcast(right_base_t* right) noexcept {
     return static_cast<right_node_t*>(right);
   }
 
-  static node_t* left_base_double_downcast(map_element_base* left) noexcept {
+  static node_t* left_base_double_downcast(left_base_t* left) noexcept {
     return static_cast<node_t*>(static_cast<left_node_t*>(left));
   }
 
-  static node_t* right_base_double_downcast(map_element_base* right) noexcept {
+  static node_t* right_base_double_downcast(right_base_t* right) noexcept {
     return static_cast<node_t*>(static_cast<right_node_t*>(right));
   }
+
+  static right_t const &right_value(left_node_t const &left) noexcept {
+    return static_cast<right_node_t const &>(static_cast<node_t const &>(left))
+        .val;
+  }
+
+  static left_t const &left_value(right_node_t const &right) noexcept {
+    return static_cast<left_node_t const &>(static_cast<node_t const &>(right))
+        .val;
+  }
 };
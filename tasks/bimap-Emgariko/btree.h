@@ -0,0 +1,858 @@
+#pragma once
+
+#include "treap.h"
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename Left, typename Right, typename CompareLeft,
+          typename CompareRight, typename Allocator>
+struct bimap;
+
+// Comparator wrapper that makes bimap index its side with a B+-tree instead
+// of a treap, e.g. bimap<int, int, btree_index<std::less<int>>>.
+template <typename Compare = std::less<>>
+struct btree_index : Compare {
+  btree_index() = default;
+  btree_index(Compare cmp) : Compare(std::move(cmp)) {}
+};
+
+namespace details {
+
+struct btree_node_base {
+  btree_node_base* parent{nullptr};
+  std::size_t count{0};
+  bool is_leaf{false};
+};
+
+struct btree_element_base;
+
+// leaves form a circular list through the header of their tree
+struct btree_leaf_links {
+  btree_leaf_links* prev{this};
+  btree_leaf_links* next{this};
+  // the slot holding the first element of a leaf, the header's one holds the
+  // header itself, so the list is walked without telling them apart
+  btree_element_base* const* first{nullptr};
+};
+
+struct btree_element_base {
+  btree_element_base() noexcept = default;
+
+  template <typename Left, typename Right, typename CompareLeft,
+            typename CompareRight, typename Allocator>
+  friend struct ::bimap;
+
+  template <typename T_, typename Tag_, typename Compare_>
+  friend struct btree;
+
+private:
+  // leaf holding the element and its slot there, the header has no leaf
+  btree_node_base* leaf{nullptr};
+  std::size_t slot{0};
+};
+
+// end element of a tree, it also links to the end of the other index
+struct btree_header : btree_element_base, btree_leaf_links {
+  btree_header() noexcept : self(this) {
+    first = &self;
+  }
+  btree_header(btree_header const&) = delete;
+  btree_header& operator=(btree_header const&) = delete;
+
+  btree_element_base* self;
+  void* sibling{nullptr};
+};
+
+template <typename T, typename Tag>
+struct btree_element : btree_element_base {
+  btree_element() noexcept = default;
+
+  explicit btree_element(T val_) noexcept : val(std::move(val_)) {}
+
+  btree_element(btree_element const&) = delete;
+  btree_element& operator=(btree_element const&) = delete;
+
+  template <typename Left, typename Right, typename CompareLeft,
+            typename CompareRight, typename Allocator>
+  friend struct ::bimap;
+
+  template <typename T_, typename Tag_, typename Compare_>
+  friend struct btree;
+
+private:
+  T val;
+};
+
+// Leaves keep copies of the keys next to the element pointers, so a lookup
+// reads a few contiguous nodes instead of one element per level. Elements
+// know their leaf and slot, which keeps flip() and iteration O(1) and
+// iterators valid while their element stays in the tree.
+template <typename T, typename Tag, typename Compare>
+struct btree : Compare {
+  using element_t = btree_element<T, Tag>;
+  using element_base_t = btree_element_base;
+  using key_type = T;
+  static constexpr bool ordered = true;
+  static constexpr bool transparent = is_transparent_v<Compare>;
+
+  static_assert(std::is_default_constructible_v<T> &&
+                    std::is_copy_constructible_v<T> &&
+                    std::is_nothrow_move_assignable_v<T>,
+                "btree_index keys must be default and copy constructible and "
+                "nothrow move assignable");
+
+  // keys per node, even so that both halves of a split are at least half full
+  static constexpr std::size_t capacity =
+      std::clamp<std::size_t>(256 / sizeof(T), 4, 32) / 2 * 2;
+  static constexpr std::size_t min_count = capacity / 2;
+
+  struct leaf : btree_node_base, btree_leaf_links {
+    leaf() {
+      is_leaf = true;
+      first = elems;
+    }
+
+    T keys[capacity];
+    btree_element_base* elems[capacity];
+  };
+
+  struct inner : btree_node_base {
+    T keys[capacity];
+    btree_node_base* children[capacity + 1];
+  };
+
+  // slot of a leaf where a new element is to be inserted, there is no leaf
+  // if the tree is empty
+  struct position {
+    leaf* node;
+    std::size_t slot;
+  };
+
+  btree() noexcept = default;
+  explicit btree(Compare const& cmp_) : Compare(cmp_) {}
+  btree(btree const&) = delete;
+  btree(btree&& other) noexcept {
+    swap(other);
+  }
+  btree& operator=(btree const&) = delete;
+  btree& operator=(btree&&) = delete;
+
+  ~btree() {
+    free_subtree(root_);
+  }
+
+  bool empty() const noexcept {
+    return root_ == nullptr;
+  }
+
+  // the tree's end element keeps its link to the other index of the bimap
+  void swap(btree& other) noexcept {
+    std::swap(root_, other.root_);
+    std::swap(header.prev, other.header.prev);
+    std::swap(header.next, other.header.next);
+    relink_header();
+    other.relink_header();
+    std::swap(get_cmp(), other.get_cmp());
+  }
+
+  btree_element_base const* begin() const noexcept {
+    return first_of(header.next);
+  }
+
+  btree_element_base const* end() const noexcept {
+    return &header;
+  }
+
+  void* sentinel() noexcept {
+    return static_cast<btree_element_base*>(&header);
+  }
+
+  void set_sibling(void* other_sentinel) noexcept {
+    header.sibling = other_sentinel;
+  }
+
+  static bool is_end(btree_element_base const* e) noexcept {
+    return e->leaf == nullptr;
+  }
+
+  static void* sibling(btree_element_base* end) noexcept {
+    return static_cast<btree_header*>(end)->sibling;
+  }
+
+  static btree_element_base* end_of(void* sentinel) noexcept {
+    return static_cast<btree_element_base*>(sentinel);
+  }
+
+  static void next(btree_element_base*& e) noexcept {
+    leaf* l = to_leaf(e->leaf);
+    e = e->slot + 1 < l->count ? l->elems[e->slot + 1] : first_of(l->next);
+  }
+
+  static void prev(btree_element_base*& e) noexcept {
+    btree_leaf_links* links;
+    if (is_end(e)) {
+      links = static_cast<btree_header*>(e)->prev;
+    } else if (e->slot > 0) {
+      e = to_leaf(e->leaf)->elems[e->slot - 1];
+      return;
+    } else {
+      links = to_leaf(e->leaf)->prev;
+    }
+    leaf* l = static_cast<leaf*>(links);
+    e = l->elems[l->count - 1];
+  }
+
+  btree_element_base* insert(element_t& e) {
+    position pos;
+    locate(e.val, pos);
+    link_at(pos, e);
+    return &e;
+  }
+
+  // returns an element equal to x or stores the slot x belongs to in pos
+  element_t* locate(T const& x, position& pos) const noexcept {
+    pos = {nullptr, 0};
+    if (root_ == nullptr) {
+      return nullptr;
+    }
+    leaf* l = descend(x);
+    std::size_t j = lower_index(l, x);
+    if (j < l->count && !less(x, l->keys[j])) {
+      return to_derived_ptr(l->elems[j]);
+    }
+    pos = {l, j};
+    return nullptr;
+  }
+
+  // succeeds if x belongs right before hint, which may be the end
+  bool locate_by_hint(btree_element_base* hint, T const& x,
+                      position& pos) const noexcept {
+    if (!is_end(hint) && !less(x, value(hint))) {
+      return false;
+    }
+    if (root_ == nullptr) {
+      pos = {nullptr, 0};
+      return true;
+    }
+    btree_element_base* before = hint;
+    bool first = hint == begin();
+    if (!first) {
+      prev(before);
+      if (!less(value(before), x)) {
+        return false;
+      }
+    }
+    if (is_end(hint)) {
+      leaf* last = static_cast<leaf*>(header.prev);
+      pos = {last, last->count};
+      return true;
+    }
+    pos = {to_leaf(hint->leaf), hint->slot};
+    if (hint->slot == 0 && !first) {
+      // x may be below the separator in front of the hint's leaf
+      btree_node_base* node = pos.node;
+      inner* p = to_inner(node->parent);
+      std::size_t i;
+      while ((i = child_index(p, node)) == 0) {
+        node = p;
+        p = to_inner(node->parent);
+      }
+      if (less(x, p->keys[i - 1])) {
+        leaf* l = to_leaf(before->leaf);
+        pos = {l, l->count};
+      }
+    }
+    return true;
+  }
+
+  // may throw if a node or a key copy can not be made, the tree is
+  // unchanged then
+  void link_at(position pos, element_t& e) {
+    link_at(pos, e, T(e.val));
+  }
+
+  // Gives e the key, which gets the old one in exchange, and moves e to
+  // the key's slot. No other element may have the key. The new slot is
+  // filled before the old one is left, so if that fails nothing changes.
+  void relink(element_t& e, T& key) {
+    position pos;
+    locate(key, pos);
+    link_at(pos, e, T(key));
+    // e is in two slots now, the old one still holds the old key
+    place(e, e.val);
+    erase(&e);
+    using std::swap;
+    swap(e.val, key);
+    place(e, e.val);
+  }
+
+  // as link_at, key is the copy of e's key kept in the leaf
+  void link_at(position pos, element_t& e, T&& key) {
+    if (root_ == nullptr) {
+      leaf* l = new leaf();
+      l->prev = l->next = &header;
+      header.prev = header.next = l;
+      root_ = l;
+      pos = {l, 0};
+    }
+    if (pos.node->count < capacity) {
+      put(pos.node, pos.slot, std::move(key), &e);
+    } else {
+      split_and_put(pos.node, pos.slot, std::move(key), &e);
+    }
+  }
+
+  // elements must be strictly increasing and the tree must be empty
+  template <typename It>
+  void build(It first, It last) {
+    std::size_t n = std::distance(first, last);
+    if (n == 0) {
+      return;
+    }
+    std::size_t leaves = (n + capacity - 1) / capacity;
+    std::vector<btree_node_base*> created, level, next_level;
+    std::vector<T const*> mins, next_mins;
+    created.reserve(2 * leaves + 64);
+    try {
+      level.reserve(leaves);
+      mins.reserve(leaves);
+      for (std::size_t k = 0; k < leaves; k++) {
+        leaf* l = new leaf();
+        created.push_back(l);
+        l->count = n / leaves + (k < n % leaves);
+        for (std::size_t j = 0; j < l->count; j++, ++first) {
+          l->keys[j] = to_derived_ptr(*first)->val;
+          l->elems[j] = *first;
+        }
+        level.push_back(l);
+        mins.push_back(l->keys);
+      }
+      while (level.size() > 1) {
+        std::size_t groups = (level.size() + capacity) / (capacity + 1);
+        next_level.clear();
+        next_mins.clear();
+        next_level.reserve(groups);
+        next_mins.reserve(groups);
+        for (std::size_t g = 0, k = 0; g < groups; g++) {
+          inner* in = new inner();
+          created.push_back(in);
+          std::size_t children =
+              level.size() / groups + (g < level.size() % groups);
+          for (std::size_t c = 0; c < children; c++) {
+            in->children[c] = level[k + c];
+            if (c > 0) {
+              in->keys[c - 1] = *mins[k + c];
+            }
+          }
+          in->count = children - 1;
+          next_level.push_back(in);
+          next_mins.push_back(mins[k]);
+          k += children;
+        }
+        level.swap(next_level);
+        mins.swap(next_mins);
+      }
+    } catch (...) {
+      for (btree_node_base* node : created) {
+        delete_node(node);
+      }
+      throw;
+    }
+    for (btree_node_base* node : created) {
+      if (node->is_leaf) {
+        leaf* l = to_leaf(node);
+        fix_slots(l, 0);
+        l->next = &header;
+        l->prev = header.prev;
+        header.prev->next = l;
+        header.prev = l;
+      } else {
+        inner* in = to_inner(node);
+        for (std::size_t c = 0; c <= in->count; c++) {
+          in->children[c]->parent = in;
+        }
+      }
+    }
+    root_ = level[0];
+  }
+
+  // builds the tree from the copies of the elements of other, map returns
+  // the copy of each one, the tree must be empty
+  template <typename Map>
+  void clone(btree const& other, Map&& map) {
+    std::vector<element_t*> elements;
+    for (btree_leaf_links* l = other.header.next; l != &other.header;
+         l = l->next) {
+      leaf* from = static_cast<leaf*>(l);
+      for (std::size_t j = 0; j < from->count; j++) {
+        elements.push_back(map(to_derived_ptr(from->elems[j])));
+      }
+    }
+    build(elements.begin(), elements.end());
+  }
+
+  template <typename K>
+  element_t* find(K const& x) const noexcept {
+    if (root_ == nullptr) {
+      return nullptr;
+    }
+    leaf* l = descend(x);
+    std::size_t j = lower_index(l, x);
+    return j < l->count && !less(x, l->keys[j]) ? to_derived_ptr(l->elems[j])
+                                                : nullptr;
+  }
+
+  // Stores the element of keys[i] (or nullptr) to res[i] for i < n.
+  template <typename It>
+  void find_many(It keys, std::size_t n, element_t** res) const noexcept {
+    for (std::size_t i = 0; i < n; i++) {
+      res[i] = find(keys[i]);
+    }
+  }
+
+  // drops all elements without touching them, leaving the tree empty
+  void release() noexcept {
+    free_subtree(root_);
+    root_ = nullptr;
+    relink_header();
+  }
+
+  // calls f for every element and leaves the tree empty, f may free the
+  // element
+  template <typename F>
+  void clear(F&& f) noexcept {
+    for (btree_leaf_links* l = header.next; l != &header; l = l->next) {
+      leaf* from = static_cast<leaf*>(l);
+      for (std::size_t j = 0; j < from->count; j++) {
+        f(to_derived_ptr(from->elems[j]));
+      }
+    }
+    release();
+  }
+
+  void erase(btree_element_base* e) noexcept {
+    leaf* l = to_leaf(e->leaf);
+    std::size_t j = e->slot;
+    std::move(l->keys + j + 1, l->keys + l->count, l->keys + j);
+    std::copy(l->elems + j + 1, l->elems + l->count, l->elems + j);
+    l->count--;
+    fix_slots(l, j);
+    e->leaf = nullptr;
+    e->slot = 0;
+    if (l == root_) {
+      if (l->count == 0) {
+        unlink_leaf(l);
+        delete l;
+        root_ = nullptr;
+      }
+    } else if (l->count < min_count) {
+      rebalance(l);
+    }
+  }
+
+  template <typename K>
+  btree_element_base const* lower_bound(K const& x) const noexcept {
+    if (root_ == nullptr) {
+      return &header;
+    }
+    leaf* l = descend(x);
+    return at(l, lower_index(l, x));
+  }
+
+  template <typename K>
+  btree_element_base const* upper_bound(K const& x) const noexcept {
+    if (root_ == nullptr) {
+      return &header;
+    }
+    leaf* l = descend(x);
+    return at(l, std::upper_bound(l->keys, l->keys + l->count, x, key_less()) -
+                     l->keys);
+  }
+
+  template <typename A, typename B>
+  bool less(A const& a, B const& b) const noexcept {
+    return get_cmp()(a, b);
+  }
+
+  bool equal(T const& a, T const& b) const noexcept {
+    return !less(a, b) && !less(b, a);
+  }
+
+  template <typename Left, typename Right, typename CompareLeft,
+            typename CompareRight, typename Allocator>
+  friend struct ::bimap;
+
+private:
+  btree_node_base* root_{nullptr};
+  btree_header header;
+
+  // nodes allocated up front, so that a split can not fail halfway
+  struct spare_nodes {
+    spare_nodes() noexcept = default;
+    spare_nodes(spare_nodes const&) = delete;
+    spare_nodes& operator=(spare_nodes const&) = delete;
+
+    ~spare_nodes() {
+      for (std::size_t i = 0; i < count; i++) {
+        delete nodes[i];
+      }
+    }
+
+    inner* take() noexcept {
+      return nodes[--count];
+    }
+
+    inner* nodes[64];
+    std::size_t count{0};
+  };
+
+  Compare& get_cmp() {
+    return static_cast<Compare&>(*this);
+  }
+
+  Compare const& get_cmp() const {
+    return static_cast<Compare const&>(*this);
+  }
+
+  auto key_less() const noexcept {
+    return [this](auto const& a, auto const& b) { return less(a, b); };
+  }
+
+  static leaf* to_leaf(btree_node_base* node) noexcept {
+    return static_cast<leaf*>(node);
+  }
+
+  static inner* to_inner(btree_node_base* node) noexcept {
+    return static_cast<inner*>(node);
+  }
+
+  static element_t* to_derived_ptr(btree_element_base* e) noexcept {
+    return static_cast<element_t*>(e);
+  }
+
+  static T const& value(btree_element_base const* e) noexcept {
+    return static_cast<element_t const*>(e)->val;
+  }
+
+  static btree_element_base* first_of(btree_leaf_links* links) noexcept {
+    return *links->first;
+  }
+
+  static btree_element_base* at(leaf* l, std::size_t j) noexcept {
+    return j < l->count ? l->elems[j] : first_of(l->next);
+  }
+
+  static std::size_t child_index(inner* p, btree_node_base* child) noexcept {
+    return std::find(p->children, p->children + p->count + 1, child) -
+           p->children;
+  }
+
+  template <typename K>
+  leaf* descend(K const& x) const noexcept {
+    btree_node_base* node = root_;
+    while (!node->is_leaf) {
+      inner* in = to_inner(node);
+      node = in->children[std::upper_bound(in->keys, in->keys + in->count, x,
+                                           key_less()) -
+                          in->keys];
+    }
+    return to_leaf(node);
+  }
+
+  template <typename K>
+  std::size_t lower_index(leaf* l, K const& x) const noexcept {
+    return std::lower_bound(l->keys, l->keys + l->count, x, key_less()) -
+           l->keys;
+  }
+
+  void relink_header() noexcept {
+    if (root_ == nullptr) {
+      header.prev = header.next = &header;
+    } else {
+      header.next->prev = &header;
+      header.prev->next = &header;
+    }
+  }
+
+  static void unlink_leaf(leaf* l) noexcept {
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+  }
+
+  // points e to the slot of key, where e must be
+  void place(element_t& e, T const& key) const noexcept {
+    leaf* l = descend(key);
+    e.leaf = l;
+    e.slot = lower_index(l, key);
+  }
+
+  static void fix_slots(leaf* l, std::size_t from) noexcept {
+    for (std::size_t i = from; i < l->count; i++) {
+      l->elems[i]->leaf = l;
+      l->elems[i]->slot = i;
+    }
+  }
+
+  // the leaf must have a free slot
+  static void put(leaf* l, std::size_t j, T&& key,
+                  btree_element_base* e) noexcept {
+    std::move_backward(l->keys + j, l->keys + l->count,
+                       l->keys + l->count + 1);
+    std::copy_backward(l->elems + j, l->elems + l->count,
+                       l->elems + l->count + 1);
+    l->keys[j] = std::move(key);
+    l->elems[j] = e;
+    l->count++;
+    fix_slots(l, j);
+  }
+
+  void split_and_put(leaf* l, std::size_t j, T&& key, btree_element_base* e) {
+    constexpr std::size_t left_count = capacity / 2 + 1;
+    std::size_t moved_from = j < left_count ? left_count - 1 : left_count;
+    // the first key of the new leaf becomes the separator
+    T separator = j == left_count ? key : l->keys[moved_from];
+
+    std::size_t needed = 0;
+    btree_node_base* p = l->parent;
+    for (; p != nullptr && p->count == capacity; p = p->parent) {
+      needed++;
+    }
+    if (p == nullptr) {
+      needed++;
+    }
+    std::unique_ptr<leaf> new_leaf(new leaf());
+    spare_nodes spare;
+    for (; spare.count < needed; spare.count++) {
+      spare.nodes[spare.count] = new inner();
+    }
+
+    leaf* r = new_leaf.release();
+    std::move(l->keys + moved_from, l->keys + capacity, r->keys);
+    std::copy(l->elems + moved_from, l->elems + capacity, r->elems);
+    r->count = capacity - moved_from;
+    l->count = moved_from;
+    fix_slots(r, 0);
+    if (j < left_count) {
+      put(l, j, std::move(key), e);
+    } else {
+      put(r, j - left_count, std::move(key), e);
+    }
+    r->prev = l;
+    r->next = l->next;
+    l->next->prev = r;
+    l->next = r;
+    insert_into_parent(l, std::move(separator), r, spare);
+  }
+
+  void insert_into_parent(btree_node_base* left, T&& separator,
+                          btree_node_base* right,
+                          spare_nodes& spare) noexcept {
+    while (true) {
+      inner* p = to_inner(left->parent);
+      if (p == nullptr) {
+        p = spare.take();
+        p->keys[0] = std::move(separator);
+        p->children[0] = left;
+        p->children[1] = right;
+        p->count = 1;
+        left->parent = right->parent = p;
+        root_ = p;
+        return;
+      }
+      std::size_t i = child_index(p, left);
+      if (p->count < capacity) {
+        std::move_backward(p->keys + i, p->keys + p->count,
+                           p->keys + p->count + 1);
+        std::copy_backward(p->children + i + 1, p->children + p->count + 1,
+                           p->children + p->count + 2);
+        p->keys[i] = std::move(separator);
+        p->children[i + 1] = right;
+        right->parent = p;
+        p->count++;
+        return;
+      }
+
+      // p is full, split it and move its middle key up
+      T keys[capacity + 1];
+      btree_node_base* children[capacity + 2];
+      std::move(p->keys, p->keys + i, keys);
+      keys[i] = std::move(separator);
+      std::move(p->keys + i, p->keys + capacity, keys + i + 1);
+      std::copy(p->children, p->children + i + 1, children);
+      children[i + 1] = right;
+      std::copy(p->children + i + 1, p->children + capacity + 1,
+                children + i + 2);
+
+      constexpr std::size_t half = capacity / 2;
+      inner* q = spare.take();
+      std::move(keys, keys + half, p->keys);
+      std::copy(children, children + half + 1, p->children);
+      p->count = half;
+      separator = std::move(keys[half]);
+      std::move(keys + half + 1, keys + capacity + 1, q->keys);
+      std::copy(children + half + 1, children + capacity + 2, q->children);
+      q->count = capacity - half;
+      for (std::size_t c = 0; c <= p->count; c++) {
+        p->children[c]->parent = p;
+      }
+      for (std::size_t c = 0; c <= q->count; c++) {
+        q->children[c]->parent = q;
+      }
+      left = p;
+      right = q;
+    }
+  }
+
+  // merges an underfull leaf with a sibling or borrows from one
+  void rebalance(leaf* l) noexcept {
+    inner* p = to_inner(l->parent);
+    std::size_t i = child_index(p, l);
+    leaf* left = i > 0 ? to_leaf(p->children[i - 1]) : nullptr;
+    leaf* right = i < p->count ? to_leaf(p->children[i + 1]) : nullptr;
+    if (left != nullptr && left->count + l->count <= capacity) {
+      merge_leaves(left, l);
+      remove_child(p, i);
+    } else if (right != nullptr && l->count + right->count <= capacity) {
+      merge_leaves(l, right);
+      remove_child(p, i + 1);
+    } else {
+      // the separator needs a copy of a key, if it can not be made the leaf
+      // just stays underfull
+      try {
+        if (left != nullptr) {
+          T separator = left->keys[left->count - 1];
+          left->count--;
+          put(l, 0, std::move(left->keys[left->count]),
+              left->elems[left->count]);
+          p->keys[i - 1] = std::move(separator);
+        } else {
+          T separator = right->keys[1];
+          put(l, l->count, std::move(right->keys[0]), right->elems[0]);
+          std::move(right->keys + 1, right->keys + right->count, right->keys);
+          std::copy(right->elems + 1, right->elems + right->count,
+                    right->elems);
+          right->count--;
+          fix_slots(right, 0);
+          p->keys[i] = std::move(separator);
+        }
+      } catch (...) {
+      }
+      return;
+    }
+    rebalance(p);
+  }
+
+  void rebalance(inner* p) noexcept {
+    while (true) {
+      if (p == root_) {
+        if (p->count == 0) {
+          root_ = p->children[0];
+          root_->parent = nullptr;
+          delete p;
+        }
+        return;
+      }
+      if (p->count >= min_count) {
+        return;
+      }
+      inner* g = to_inner(p->parent);
+      std::size_t i = child_index(g, p);
+      inner* left = i > 0 ? to_inner(g->children[i - 1]) : nullptr;
+      inner* right = i < g->count ? to_inner(g->children[i + 1]) : nullptr;
+      if (left != nullptr && left->count + p->count < capacity) {
+        merge_inner(left, std::move(g->keys[i - 1]), p);
+        remove_child(g, i);
+      } else if (right != nullptr && p->count + right->count < capacity) {
+        merge_inner(p, std::move(g->keys[i]), right);
+        remove_child(g, i + 1);
+      } else if (left != nullptr) {
+        std::move_backward(p->keys, p->keys + p->count,
+                           p->keys + p->count + 1);
+        std::copy_backward(p->children, p->children + p->count + 1,
+                           p->children + p->count + 2);
+        p->keys[0] = std::move(g->keys[i - 1]);
+        p->children[0] = left->children[left->count];
+        p->children[0]->parent = p;
+        g->keys[i - 1] = std::move(left->keys[left->count - 1]);
+        left->count--;
+        p->count++;
+        return;
+      } else {
+        p->keys[p->count] = std::move(g->keys[i]);
+        p->children[p->count + 1] = right->children[0];
+        p->children[p->count + 1]->parent = p;
+        g->keys[i] = std::move(right->keys[0]);
+        std::move(right->keys + 1, right->keys + right->count, right->keys);
+        std::copy(right->children + 1, right->children + right->count + 1,
+                  right->children);
+        right->count--;
+        p->count++;
+        return;
+      }
+      p = g;
+    }
+  }
+
+  static void merge_leaves(leaf* a, leaf* b) noexcept {
+    std::move(b->keys, b->keys + b->count, a->keys + a->count);
+    std::copy(b->elems, b->elems + b->count, a->elems + a->count);
+    std::size_t from = a->count;
+    a->count += b->count;
+    fix_slots(a, from);
+    unlink_leaf(b);
+    delete b;
+  }
+
+  static void merge_inner(inner* a, T&& separator, inner* b) noexcept {
+    a->keys[a->count] = std::move(separator);
+    std::move(b->keys, b->keys + b->count, a->keys + a->count + 1);
+    std::copy(b->children, b->children + b->count + 1,
+              a->children + a->count + 1);
+    for (std::size_t c = 0; c <= b->count; c++) {
+      b->children[c]->parent = a;
+    }
+    a->count += b->count + 1;
+    delete b;
+  }
+
+  // removes the k-th child and the key in front of it, k > 0
+  static void remove_child(inner* p, std::size_t k) noexcept {
+    std::move(p->keys + k, p->keys + p->count, p->keys + k - 1);
+    std::copy(p->children + k + 1, p->children + p->count + 1,
+              p->children + k);
+    p->count--;
+  }
+
+  static void delete_node(btree_node_base* node) noexcept {
+    if (node->is_leaf) {
+      delete to_leaf(node);
+    } else {
+      delete to_inner(node);
+    }
+  }
+
+  static void free_subtree(btree_node_base* node) noexcept {
+    if (node == nullptr) {
+      return;
+    }
+    if (!node->is_leaf) {
+      inner* in = to_inner(node);
+      for (std::size_t c = 0; c <= in->count; c++) {
+        free_subtree(in->children[c]);
+      }
+    }
+    delete_node(node);
+  }
+};
+
+template <typename T, typename Tag, typename Compare>
+struct index_traits<T, Tag, btree_index<Compare>> {
+  using type = btree<T, Tag, Compare>;
+};
+}
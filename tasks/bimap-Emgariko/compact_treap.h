@@ -0,0 +1,642 @@
+#pragma once
+
+#include "node_arena.h"
+#include "treap.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename Left, typename Right, typename CompareLeft,
+          typename CompareRight, typename Allocator>
+struct bimap;
+
+// Comparator wrapper that makes bimap index its side with a compact treap,
+// e.g. bimap<int, int, compact_index<>, compact_index<>>. Its elements link
+// to each other by 32-bit ids instead of pointers and store no priorities,
+// the nodes of such a map are kept in an arena of its own. Order statistics
+// and set operations are not available for it.
+template <typename Compare = std::less<>>
+struct compact_index : Compare {
+  compact_index() = default;
+  compact_index(Compare cmp) : Compare(std::move(cmp)) {}
+};
+
+namespace details {
+
+// links are arena ids of the elements, 0 if there is none
+struct compact_element_base {
+  compact_element_base() noexcept = default;
+
+  template <typename Left, typename Right, typename CompareLeft,
+            typename CompareRight, typename Allocator>
+  friend struct ::bimap;
+
+  template <typename T_, typename Tag_, typename Compare_>
+  friend struct compact_treap;
+
+  friend struct compact_header;
+
+private:
+  static constexpr std::uint32_t nil = 0;
+  // parent of the root, the end of the index is found through the arena
+  static constexpr std::uint32_t root_mark = 0xFFFFFFFF;
+  // parent of the end element itself
+  static constexpr std::uint32_t end_mark = 0xFFFFFFFE;
+
+  std::uint32_t par{nil};
+  std::uint32_t left{nil};
+  std::uint32_t right{nil};
+};
+
+// end element of a compact treap, it also links to the end of the other index
+struct compact_header : compact_element_base {
+  compact_header() noexcept {
+    par = end_mark;
+  }
+
+  compact_element_base* root{nullptr};
+  void* sibling{nullptr};
+};
+
+template <typename T, typename Tag>
+struct compact_element : compact_element_base {
+  compact_element() noexcept = default;
+
+  explicit compact_element(T val_) noexcept : val(std::move(val_)) {}
+
+  compact_element(compact_element const&) = delete;
+  compact_element& operator=(compact_element const&) = delete;
+
+  template <typename Left, typename Right, typename CompareLeft,
+            typename CompareRight, typename Allocator>
+  friend struct ::bimap;
+
+  template <typename T_, typename Tag_, typename Compare_>
+  friend struct compact_treap;
+
+private:
+  T val;
+};
+
+// A treap whose priorities are hashes of the element ids. All elements are
+// in the arena of the map, which also records where the end of each index
+// is, so iterating from an element needs nothing but the element.
+template <typename T, typename Tag, typename Compare>
+struct compact_treap : Compare {
+  using element_t = compact_element<T, Tag>;
+  using element_base_t = compact_element_base;
+  using key_type = T;
+  static constexpr bool ordered = true;
+  static constexpr bool transparent = is_transparent_v<Compare>;
+  static constexpr std::size_t side = std::is_same_v<Tag, left_tag> ? 0 : 1;
+
+  // empty child slot of parent where a new element is to be linked, the
+  // parent is the end element if the treap is empty
+  struct position {
+    compact_element_base* parent;
+    bool to_left;
+  };
+
+  compact_treap() noexcept = default;
+  explicit compact_treap(Compare const& cmp_) : Compare(cmp_) {}
+  compact_treap(compact_treap const&) = delete;
+  compact_treap(compact_treap&& other) noexcept {
+    swap(other);
+  }
+  compact_treap& operator=(compact_treap const&) = delete;
+  compact_treap& operator=(compact_treap&&) = delete;
+
+  bool empty() const noexcept {
+    return header.root == nullptr;
+  }
+
+  // the headers keep their links to the other index of the bimap
+  void swap(compact_treap& other) noexcept {
+    std::swap(header.root, other.header.root);
+    set_root(header.root);
+    other.set_root(other.header.root);
+    std::swap(last, other.last);
+    std::swap(get_cmp(), other.get_cmp());
+  }
+
+  compact_element_base const* begin() const noexcept {
+    return empty() ? &header : leftmost(header.root);
+  }
+
+  compact_element_base const* end() const noexcept {
+    return &header;
+  }
+
+  void* sentinel() noexcept {
+    return static_cast<compact_element_base*>(&header);
+  }
+
+  void set_sibling(void* other_sentinel) noexcept {
+    header.sibling = other_sentinel;
+  }
+
+  static bool is_end(compact_element_base const* e) noexcept {
+    return e->par == compact_element_base::end_mark;
+  }
+
+  static void* sibling(compact_element_base* end) noexcept {
+    return static_cast<compact_header*>(end)->sibling;
+  }
+
+  static compact_element_base* end_of(void* sentinel) noexcept {
+    return static_cast<compact_element_base*>(sentinel);
+  }
+
+  static void next(compact_element_base*& e) noexcept {
+    node_arena const& a = node_arena::of(e);
+    if (e->right != nil) {
+      e = leftmost(at(a, e->right));
+      return;
+    }
+    std::uint32_t from = id(e);
+    while (e->par != root_mark) {
+      std::uint32_t p = e->par;
+      e = at(a, p);
+      if (e->left == from) {
+        return;
+      }
+      from = p;
+    }
+    e = end_of(a.ends[side]);
+  }
+
+  static void prev(compact_element_base*& e) noexcept {
+    if (is_end(e)) {
+      e = rightmost(static_cast<compact_header*>(e)->root);
+      return;
+    }
+    node_arena const& a = node_arena::of(e);
+    if (e->left != nil) {
+      e = rightmost(at(a, e->left));
+      return;
+    }
+    std::uint32_t from = id(e);
+    while (true) {
+      std::uint32_t p = e->par;
+      e = at(a, p);
+      if (e->right == from) {
+        return;
+      }
+      from = p;
+    }
+  }
+
+  compact_element_base* insert(element_t& e) noexcept {
+    position pos;
+    locate(e.val, pos);
+    link_at(pos, e);
+    return &e;
+  }
+
+  // returns an element equal to x or stores the slot x belongs to in pos
+  element_t* locate(T const& x, position& pos) noexcept {
+    pos = {&header, true};
+    compact_element_base* cur = header.root;
+    if (cur == nullptr) {
+      return nullptr;
+    }
+    node_arena const& a = node_arena::of(cur);
+    while (true) {
+      std::uint32_t next;
+      if (less(value(cur), x)) {
+        pos = {cur, false};
+        next = cur->right;
+      } else if (less(x, value(cur))) {
+        pos = {cur, true};
+        next = cur->left;
+      } else {
+        return to_derived_ptr(cur);
+      }
+      if (next == nil) {
+        return nullptr;
+      }
+      cur = at(a, next);
+    }
+  }
+
+  // succeeds if x belongs right before hint, which may be the end element,
+  // the end is resolved in O(1) while the greatest element is cached
+  bool locate_by_hint(compact_element_base* hint, T const& x,
+                      position& pos) noexcept {
+    if (!is_end(hint) && !less(x, value(hint))) {
+      return false;
+    }
+    compact_element_base* prev;
+    if (!is_end(hint)) {
+      prev = predecessor(hint);
+    } else if (empty()) {
+      prev = nullptr;
+    } else {
+      if (last == nil) {
+        last = id(rightmost(header.root));
+      }
+      prev = at(node_arena::of(header.root), last);
+    }
+    if (prev != nullptr && !less(value(prev), x)) {
+      return false;
+    }
+    if (!is_end(hint) && hint->left == nil) {
+      pos = {hint, true};
+    } else if (prev != nullptr) {
+      pos = {prev, false};
+    } else {
+      pos = {&header, true};
+    }
+    return true;
+  }
+
+  void link_at(position pos, element_t& e) noexcept {
+    e.left = e.right = nil;
+    if (is_end(pos.parent)) {
+      set_root(&e);
+      last = id(&e);
+      return;
+    }
+    node_arena const& a = node_arena::of(&e);
+    std::uint32_t e_id = id(&e);
+    if (!pos.to_left && id(pos.parent) == last) {
+      last = e_id;
+    }
+    (pos.to_left ? pos.parent->left : pos.parent->right) = e_id;
+    e.par = id(pos.parent);
+    while (e.par != root_mark && priority(e.par) < priority(e_id)) {
+      rotate_up(a, &e, e_id);
+    }
+  }
+
+  // elements must be strictly increasing and the treap must be empty
+  template <typename It>
+  void build(It first, It last) noexcept {
+    compact_element_base* rightmost = nullptr;
+    for (; first != last; ++first) {
+      compact_element_base* e = *first;
+      node_arena const& a = node_arena::of(e);
+      std::uint32_t e_id = id(e);
+      std::uint32_t popped = nil;
+      while (rightmost != nullptr && priority(id(rightmost)) < priority(e_id)) {
+        popped = id(rightmost);
+        rightmost = rightmost->par == root_mark ? nullptr
+                                                : at(a, rightmost->par);
+      }
+      e->left = popped;
+      e->right = nil;
+      if (popped != nil) {
+        at(a, popped)->par = e_id;
+      }
+      if (rightmost == nullptr) {
+        set_root(e);
+      } else {
+        rightmost->right = e_id;
+        e->par = id(rightmost);
+      }
+      rightmost = e;
+    }
+    this->last = rightmost == nullptr ? nil : id(rightmost);
+  }
+
+  // Builds the treap from the copies of the elements of other, map returns
+  // the copy of each one. Copies have ids and so priorities of their own,
+  // the shape is not copied. The treap must be empty.
+  template <typename Map>
+  void clone(compact_treap const& other, Map&& map) {
+    std::vector<element_t*> elements;
+    compact_element_base* e = const_cast<compact_element_base*>(other.begin());
+    for (; !is_end(e); next(e)) {
+      elements.push_back(map(to_derived_ptr(e)));
+    }
+    build(elements.begin(), elements.end());
+  }
+
+  template <typename K>
+  element_t* find(K const& x) const noexcept {
+    compact_element_base* cur = header.root;
+    if (cur == nullptr) {
+      return nullptr;
+    }
+    node_arena const& a = node_arena::of(cur);
+    while (true) {
+      std::uint32_t next;
+      if (less(value(cur), x)) {
+        next = cur->right;
+      } else if (less(x, value(cur))) {
+        next = cur->left;
+      } else {
+        return to_derived_ptr(cur);
+      }
+      if (next == nil) {
+        return nullptr;
+      }
+      cur = at(a, next);
+    }
+  }
+
+  // Stores the element of keys[i] (or nullptr) to res[i] for i < n, going
+  // down one level per round for a group of keys like treap::find_many.
+  template <typename It>
+  void find_many(It keys, std::size_t n, element_t** res) const noexcept {
+    if (header.root == nullptr) {
+      std::fill(res, res + n, nullptr);
+      return;
+    }
+    node_arena const& a = node_arena::of(header.root);
+    constexpr std::size_t lanes = 16;
+    std::size_t live[lanes];
+    for (std::size_t from = 0; from < n; from += lanes) {
+      std::size_t count = 0;
+      for (std::size_t i = from; i < from + lanes && i < n; i++) {
+        res[i] = to_derived_ptr(header.root);
+        live[count++] = i;
+      }
+      while (count > 0) {
+        std::size_t still = 0;
+        for (std::size_t j = 0; j < count; j++) {
+          std::size_t i = live[j];
+          std::uint32_t next;
+          if (less(res[i]->val, keys[i])) {
+            next = res[i]->right;
+          } else if (less(keys[i], res[i]->val)) {
+            next = res[i]->left;
+          } else {
+            continue;
+          }
+          if (next == nil) {
+            res[i] = nullptr;
+          } else {
+            res[i] = to_derived_ptr(at(a, next));
+            prefetch(res[i]);
+            live[still++] = i;
+          }
+        }
+        count = still;
+      }
+    }
+  }
+
+  template <typename K>
+  compact_element_base const* lower_bound(K const& x) const noexcept {
+    return bound([this, &x](compact_element_base const* e) {
+      return less(value(e), x);
+    });
+  }
+
+  template <typename K>
+  compact_element_base const* upper_bound(K const& x) const noexcept {
+    return bound([this, &x](compact_element_base const* e) {
+      return !less(x, value(e));
+    });
+  }
+
+  // drops all elements without touching them, leaving the treap empty
+  void release() noexcept {
+    header.root = nullptr;
+    last = nil;
+  }
+
+  // calls f for every element in post-order and leaves the treap empty, f
+  // may free the element
+  template <typename F>
+  void clear(F&& f) noexcept {
+    compact_element_base* t = std::exchange(header.root, nullptr);
+    last = nil;
+    if (t == nullptr) {
+      return;
+    }
+    node_arena const& a = node_arena::of(t);
+    while (t != nullptr) {
+      if (t->left != nil) {
+        t = at(a, t->left);
+      } else if (t->right != nil) {
+        t = at(a, t->right);
+      } else {
+        compact_element_base* p = nullptr;
+        if (t->par != root_mark) {
+          p = at(a, t->par);
+          (p->left == id(t) ? p->left : p->right) = nil;
+        }
+        f(to_derived_ptr(t));
+        t = p;
+      }
+    }
+  }
+
+  // rotates e down to a leaf and unlinks it
+  // as treap::relink
+  void relink(element_t& e, T& key) noexcept {
+    erase(&e);
+    using std::swap;
+    swap(e.val, key);
+    position pos;
+    locate(e.val, pos);
+    link_at(pos, e);
+  }
+
+  void erase(compact_element_base* e) noexcept {
+    node_arena const& a = node_arena::of(e);
+    std::uint32_t e_id = id(e);
+    if (e_id == last) {
+      last = nil;
+    }
+    while (e->left != nil || e->right != nil) {
+      std::uint32_t c = e->left == nil    ? e->right
+                        : e->right == nil ? e->left
+                        : priority(e->left) > priority(e->right) ? e->left
+                                                                 : e->right;
+      rotate_up(a, at(a, c), c);
+    }
+    if (e->par == root_mark) {
+      header.root = nullptr;
+    } else {
+      compact_element_base* p = at(a, e->par);
+      (p->left == e_id ? p->left : p->right) = nil;
+    }
+    e->par = nil;
+  }
+
+  template <typename A, typename B>
+  bool less(A const& a, B const& b) const noexcept {
+    return get_cmp()(a, b);
+  }
+
+  bool equal(T const& a, T const& b) const noexcept {
+    return !less(a, b) && !less(b, a);
+  }
+
+  template <typename Left, typename Right, typename CompareLeft,
+            typename CompareRight, typename Allocator>
+  friend struct ::bimap;
+
+private:
+  static constexpr std::uint32_t nil = compact_element_base::nil;
+  static constexpr std::uint32_t root_mark = compact_element_base::root_mark;
+
+  compact_header header;
+  // id of the greatest element, or nil if it is not known yet
+  std::uint32_t last{nil};
+
+  Compare& get_cmp() {
+    return static_cast<Compare&>(*this);
+  }
+
+  Compare const& get_cmp() const {
+    return static_cast<Compare const&>(*this);
+  }
+
+  static std::uint32_t id(compact_element_base const* e) noexcept {
+    return node_arena::id(e);
+  }
+
+  static compact_element_base* at(node_arena const& a,
+                                  std::uint32_t id) noexcept {
+    return static_cast<compact_element_base*>(a.at(id));
+  }
+
+  // murmur3 finalizer, ids of neighbouring elements differ by a few units
+  static std::uint32_t priority(std::uint32_t id) noexcept {
+    id ^= id >> 16;
+    id *= 0x85EBCA6Bu;
+    id ^= id >> 13;
+    id *= 0xC2B2AE35u;
+    id ^= id >> 16;
+    return id;
+  }
+
+  static element_t* to_derived_ptr(compact_element_base* e) noexcept {
+    return static_cast<element_t*>(e);
+  }
+
+  static T const& value(compact_element_base const* e) noexcept {
+    return static_cast<element_t const*>(e)->val;
+  }
+
+  // the root is the only element with root_mark as its parent, the arena
+  // knows where the end of the index is
+  void set_root(compact_element_base* root) noexcept {
+    header.root = root;
+    if (root != nullptr) {
+      root->par = root_mark;
+      node_arena::of(root).ends[side] = sentinel();
+    }
+  }
+
+  static compact_element_base* leftmost(compact_element_base* t) noexcept {
+    node_arena const& a = node_arena::of(t);
+    while (t->left != nil) {
+      t = at(a, t->left);
+    }
+    return t;
+  }
+
+  static compact_element_base* rightmost(compact_element_base* t) noexcept {
+    node_arena const& a = node_arena::of(t);
+    while (t->right != nil) {
+      t = at(a, t->right);
+    }
+    return t;
+  }
+
+  compact_element_base* predecessor(compact_element_base* t) noexcept {
+    if (is_end(t)) {
+      return empty() ? nullptr : rightmost(header.root);
+    }
+    if (t->left != nil) {
+      return rightmost(at(node_arena::of(t), t->left));
+    }
+    node_arena const& a = node_arena::of(t);
+    std::uint32_t from = id(t);
+    while (t->par != root_mark) {
+      std::uint32_t p = t->par;
+      t = at(a, p);
+      if (t->right == from) {
+        return t;
+      }
+      from = p;
+    }
+    return nullptr;
+  }
+
+  // first element for which go_right fails, or the end
+  template <typename F>
+  compact_element_base const* bound(F&& go_right) const noexcept {
+    compact_element_base const* res = &header;
+    compact_element_base* cur = header.root;
+    if (cur == nullptr) {
+      return res;
+    }
+    node_arena const& a = node_arena::of(cur);
+    while (true) {
+      std::uint32_t next;
+      if (go_right(cur)) {
+        next = cur->right;
+      } else {
+        res = cur;
+        next = cur->left;
+      }
+      if (next == nil) {
+        return res;
+      }
+      cur = at(a, next);
+    }
+  }
+
+  // moves x above its parent
+  void rotate_up(node_arena const& a, compact_element_base* x,
+                 std::uint32_t x_id) noexcept {
+    std::uint32_t p_id = x->par;
+    compact_element_base* p = at(a, p_id);
+    std::uint32_t g_id = p->par;
+    if (p->left == x_id) {
+      p->left = x->right;
+      if (x->right != nil) {
+        at(a, x->right)->par = p_id;
+      }
+      x->right = p_id;
+    } else {
+      p->right = x->left;
+      if (x->left != nil) {
+        at(a, x->left)->par = p_id;
+      }
+      x->left = p_id;
+    }
+    p->par = x_id;
+    if (g_id == root_mark) {
+      set_root(x);
+    } else {
+      compact_element_base* g = at(a, g_id);
+      (g->left == p_id ? g->left : g->right) = x_id;
+      x->par = g_id;
+    }
+  }
+};
+
+template <typename T, typename Tag, typename Compare>
+struct index_traits<T, Tag, compact_index<Compare>> {
+  using type = compact_treap<T, Tag, Compare>;
+};
+
+template <typename Index>
+inline constexpr bool is_compact_v = false;
+
+template <typename T, typename Tag, typename Compare>
+inline constexpr bool is_compact_v<compact_treap<T, Tag, Compare>> = true;
+
+// allocator of the nodes of a bimap, maps with a compact side keep their
+// nodes in an arena of their own
+template <typename Left, typename Right, typename CompareLeft,
+          typename CompareRight, typename Allocator>
+using node_allocator_t = std::conditional_t<
+    is_compact_v<index_t<Left, left_tag, CompareLeft>> ||
+        is_compact_v<index_t<Right, right_tag, CompareRight>>,
+    arena_allocator<bimap_node_t<Left, Right, CompareLeft, CompareRight>>,
+    typename std::allocator_traits<Allocator>::template rebind_alloc<
+        bimap_node_t<Left, Right, CompareLeft, CompareRight>>>;
+}
@@ -0,0 +1,363 @@
+#pragma once
+
+#include "bimap.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A bimap for many threads. Keys are spread over shards by their hash, a
+// pair is kept in the shard of its left key and in the shard of its right
+// one, each shard is a bimap under its own lock. When an operation needs two
+// shards it locks the one with the smaller number first, so threads never
+// wait for each other in a cycle.
+//
+// Lookups return copies, since a reference into a shard is not safe once
+// its lock is released.
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>,
+          typename Hash = details::default_hash>
+struct concurrent_bimap : private Hash {
+  using left_t = Left;
+  using right_t = Right;
+  using shard_map_t = bimap<Left, Right, CompareLeft, CompareRight>;
+
+  // the number of shards is rounded up to a power of two
+  explicit concurrent_bimap(std::size_t shard_count = default_shard_count(),
+                            CompareLeft compare_left = CompareLeft(),
+                            CompareRight compare_right = CompareRight(),
+                            Hash hash = Hash())
+      : Hash(std::move(hash)), compare_left(std::move(compare_left)),
+        compare_right(std::move(compare_right)) {
+    while (mask + 1 < shard_count) {
+      mask = mask * 2 + 1;
+    }
+    shards = std::make_unique<shard[]>(mask + 1);
+    for (std::size_t i = 0; i <= mask; i++) {
+      shards[i].map = shard_map_t(this->compare_left, this->compare_right);
+    }
+  }
+
+  concurrent_bimap(concurrent_bimap const&) = delete;
+  concurrent_bimap& operator=(concurrent_bimap const&) = delete;
+
+  bool insert(left_t left, right_t right) {
+    std::size_t a = shard_of(left), b = shard_of(right);
+    locked_pair locks(shards.get(), a, b);
+    return insert_locked(a, b, std::move(left), std::move(right));
+  }
+
+  bool erase_left(left_t const& left) {
+    return erase<true>(left);
+  }
+
+  bool erase_right(right_t const& right) {
+    return erase<false>(right);
+  }
+
+  std::optional<right_t> find_left(left_t const& left) const {
+    shard const& s = shards[shard_of(left)];
+    std::shared_lock lock(s.lock);
+    return copy_of(s.map.find_left(left), s.map.end_left());
+  }
+
+  std::optional<left_t> find_right(right_t const& right) const {
+    shard const& s = shards[shard_of(right)];
+    std::shared_lock lock(s.lock);
+    return copy_of(s.map.find_right(right), s.map.end_right());
+  }
+
+  // Inserts pairs from [first, last) taking the locks once per pair of
+  // shards instead of once per pair. Returns the number of inserted pairs.
+  // The result is that of inserting the pairs one by one in input order: a
+  // pair is only tried once every earlier pair sharing a key with it has
+  // been, so it is rejected by the map, not by other pairs of the input.
+  template <typename InputIt>
+  std::size_t insert_many(InputIt first, InputIt last) {
+    std::vector<std::pair<left_t, right_t>> pairs;
+    for (; first != last; ++first) {
+      pairs.emplace_back(first->first, first->second);
+    }
+    std::vector<std::size_t> left_before = previous_equal<true>(pairs);
+    std::vector<std::size_t> right_before = previous_equal<false>(pairs);
+    std::vector<std::pair<std::size_t, std::size_t>> order;
+    for (std::size_t i = 0; i < pairs.size(); i++) {
+      std::size_t a = shard_of(pairs[i].first);
+      std::size_t b = shard_of(pairs[i].second);
+      order.emplace_back(std::min(a, b) * (mask + 1) + std::max(a, b), i);
+    }
+    std::sort(order.begin(), order.end());
+
+    // Pairs sharing a key may fall into different groups. Each round tries
+    // the pairs whose earlier rivals are done and keeps the rest for the
+    // next one. The first pair left is always ready, and with few repeated
+    // keys one round does it all.
+    std::vector<char> done(pairs.size(), false);
+    auto ready = [&](std::size_t i) {
+      return (left_before[i] == pairs.size() || done[left_before[i]]) &&
+             (right_before[i] == pairs.size() || done[right_before[i]]);
+    };
+    std::size_t inserted = 0;
+    while (!order.empty()) {
+      std::size_t waiting = 0;
+      for (std::size_t i = 0; i < order.size();) {
+        std::optional<locked_pair> locks;
+        for (std::size_t group = order[i].first;
+             i < order.size() && order[i].first == group; i++) {
+          std::size_t k = order[i].second;
+          if (!ready(k)) {
+            order[waiting++] = order[i];
+            continue;
+          }
+          auto& [left, right] = pairs[k];
+          std::size_t a = shard_of(left), b = shard_of(right);
+          if (!locks) {
+            locks.emplace(shards.get(), a, b);
+          }
+          inserted += insert_locked(a, b, std::move(left), std::move(right));
+          done[k] = true;
+        }
+      }
+      order.resize(waiting);
+    }
+    return inserted;
+  }
+
+  // Looks up the keys of [first, last), taking each shard lock once.
+  // The i-th result belongs to the i-th key.
+  template <typename RandomIt>
+  std::vector<std::optional<right_t>> find_left_many(RandomIt first,
+                                                     RandomIt last) const {
+    return find_many<true>(first, last);
+  }
+
+  template <typename RandomIt>
+  std::vector<std::optional<left_t>> find_right_many(RandomIt first,
+                                                     RandomIt last) const {
+    return find_many<false>(first, last);
+  }
+
+  // not a consistent snapshot while other threads modify the map
+  std::size_t size() const {
+    std::size_t res = 0;
+    for (std::size_t i = 0; i <= mask; i++) {
+      std::shared_lock lock(shards[i].lock);
+      res += shards[i].owned;
+    }
+    return res;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  std::size_t shard_count() const noexcept {
+    return mask + 1;
+  }
+
+  static std::size_t default_shard_count() noexcept {
+    return std::max(1u, std::thread::hardware_concurrency()) * 4;
+  }
+
+private:
+  // aligned so that threads working on neighbouring shards do not share a
+  // cache line
+  struct alignas(64) shard {
+    mutable std::shared_mutex lock;
+    shard_map_t map;
+    // pairs whose left key belongs here
+    std::size_t owned{0};
+  };
+
+  // exclusive locks of two shards taken in order, or of one if they match
+  struct locked_pair {
+    locked_pair(shard* shards, std::size_t a, std::size_t b)
+        : first(shards[std::min(a, b)].lock),
+          second(a == b ? std::unique_lock<std::shared_mutex>()
+                        : std::unique_lock(shards[std::max(a, b)].lock)) {}
+
+    std::unique_lock<std::shared_mutex> first, second;
+  };
+
+  CompareLeft compare_left;
+  CompareRight compare_right;
+  std::unique_ptr<shard[]> shards;
+  std::size_t mask{0};
+
+  template <typename K>
+  std::size_t shard_of(K const& x) const noexcept {
+    return static_cast<std::size_t>(
+               static_cast<std::uint64_t>(static_cast<Hash const&>(*this)(x)) *
+                   0x9E3779B97F4A7C15ull >>
+               32) &
+           mask;
+  }
+
+  // For each pair, the last earlier pair of the input with an equivalent key
+  // on this side, or pairs.size() if there is none. Hash sides go by the
+  // shard hash, which equivalent keys share.
+  template <bool is_left>
+  std::vector<std::size_t>
+  previous_equal(std::vector<std::pair<left_t, right_t>> const& pairs) const {
+    using index_t = std::conditional_t<is_left,
+                                       typename shard_map_t::left_index_t,
+                                       typename shard_map_t::right_index_t>;
+    auto const& compare = [this]() -> auto const& {
+      if constexpr (is_left) {
+        return compare_left;
+      } else {
+        return compare_right;
+      }
+    }();
+    auto key = [&pairs](std::size_t i) -> auto const& {
+      return std::get<is_left ? 0 : 1>(pairs[i]);
+    };
+    std::size_t n = pairs.size();
+    std::vector<std::size_t> prev(n, n);
+    if constexpr (index_t::ordered) {
+      std::vector<std::size_t> order(n);
+      std::iota(order.begin(), order.end(), 0);
+      auto less = [&](std::size_t a, std::size_t b) {
+        return compare(key(a), key(b));
+      };
+      std::stable_sort(order.begin(), order.end(), less);
+      for (std::size_t i = 1; i < n; i++) {
+        if (!less(order[i - 1], order[i])) {
+          prev[order[i]] = order[i - 1];
+        }
+      }
+    } else {
+      index_t index(compare);
+      std::vector<std::pair<std::uint64_t, std::size_t>> order;
+      for (std::size_t i = 0; i < n; i++) {
+        order.emplace_back(static_cast<Hash const&>(*this)(key(i)), i);
+      }
+      std::sort(order.begin(), order.end());
+      for (std::size_t i = 1; i < n; i++) {
+        for (std::size_t j = i; j-- > 0 && order[j].first == order[i].first;) {
+          if (index.equal(key(order[j].second), key(order[i].second))) {
+            prev[order[i].second] = order[j].second;
+            break;
+          }
+        }
+      }
+    }
+    return prev;
+  }
+
+  template <typename It>
+  static auto copy_of(It it, It end) {
+    return it == end ? std::nullopt : std::optional(*it.flip());
+  }
+
+  // a key present anywhere is present in the shard it belongs to, so the
+  // two lookups decide whether the pair is new
+  bool insert_locked(std::size_t a, std::size_t b, left_t&& left,
+                     right_t&& right) {
+    shard_map_t& to = shards[a].map;
+    shard_map_t& from = shards[b].map;
+    if (to.find_left(left) != to.end_left() ||
+        from.find_right(right) != from.end_right()) {
+      return false;
+    }
+    if (a == b) {
+      to.insert(std::move(left), std::move(right));
+    } else {
+      auto it = to.insert(left, right);
+      try {
+        from.insert(std::move(left), std::move(right));
+      } catch (...) {
+        to.erase_left(it);
+        throw;
+      }
+    }
+    shards[a].owned++;
+    return true;
+  }
+
+  template <bool is_left, typename K>
+  bool erase(K const& key) {
+    auto find = [](shard_map_t& map, K const& key) {
+      if constexpr (is_left) {
+        return std::pair(map.find_left(key), map.end_left());
+      } else {
+        return std::pair(map.find_right(key), map.end_right());
+      }
+    };
+    auto other_shard = [this](auto it) { return shard_of(*it.flip()); };
+    std::size_t a = shard_of(key);
+    while (true) {
+      std::unique_lock first(shards[a].lock);
+      auto [it, end] = find(shards[a].map, key);
+      if (it == end) {
+        return false;
+      }
+      std::size_t b = other_shard(it);
+      std::unique_lock<std::shared_mutex> second;
+      if (b > a) {
+        second = std::unique_lock(shards[b].lock);
+      } else if (b < a) {
+        // take the locks again in order, the pair may change meanwhile
+        first.unlock();
+        second = std::unique_lock(shards[b].lock);
+        first.lock();
+        std::tie(it, end) = find(shards[a].map, key);
+        if (it == end) {
+          return false;
+        }
+        if (other_shard(it) != b) {
+          continue;
+        }
+      }
+      if (a != b) {
+        if constexpr (is_left) {
+          shards[b].map.erase_right(*it.flip());
+        } else {
+          shards[b].map.erase_left(*it.flip());
+        }
+      }
+      shards[is_left ? a : b].owned--;
+      if constexpr (is_left) {
+        shards[a].map.erase_left(it);
+      } else {
+        shards[a].map.erase_right(it);
+      }
+      return true;
+    }
+  }
+
+  template <bool is_left, typename RandomIt>
+  auto find_many(RandomIt first, RandomIt last) const {
+    using result_t = std::optional<std::conditional_t<is_left, right_t, left_t>>;
+    std::size_t n = static_cast<std::size_t>(last - first);
+    std::vector<std::pair<std::size_t, std::size_t>> order(n);
+    for (std::size_t i = 0; i < n; i++) {
+      order[i] = {shard_of(first[i]), i};
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<result_t> res(n);
+    for (std::size_t i = 0; i < n;) {
+      shard const& s = shards[order[i].first];
+      std::shared_lock lock(s.lock);
+      for (std::size_t group = order[i].first;
+           i < n && order[i].first == group; i++) {
+        auto const& key = first[order[i].second];
+        if constexpr (is_left) {
+          res[order[i].second] = copy_of(s.map.find_left(key), s.map.end_left());
+        } else {
+          res[order[i].second] =
+              copy_of(s.map.find_right(key), s.map.end_right());
+        }
+      }
+    }
+    return res;
+  }
+};
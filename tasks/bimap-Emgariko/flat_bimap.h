@@ -0,0 +1,708 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <numeric>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A bimap for maps that are read far more often than written, with the
+// interface of bimap. The pairs are kept in one array, and for each side an
+// array of their indexes sorted by that side's keys is searched by binary
+// search. New pairs go to a short delta at the end of the array, which each
+// side keeps sorted as well, and are merged into the sorted arrays in
+// batches: when the delta is full, before an erase or on commit(). Queries
+// read the sorted arrays and the delta together and change nothing, so
+// const calls are safe for concurrent readers, as for bimap.
+//
+// An iterator names its pair by index, so flip() is free and iterators stay
+// valid across inserts. Unlike with bimap, references to keys (from
+// operator*, at_left or at_right) do not, as an insert may move the pairs.
+// An erase moves pairs and invalidates both.
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct flat_bimap {
+  using left_t = Left;
+  using right_t = Right;
+
+  static constexpr std::size_t delta_capacity = 64;
+
+  template <bool is_left>
+  struct iterator {
+    using value = std::conditional_t<is_left, left_t, right_t>;
+
+    iterator() = delete;
+
+    value const &operator*() const noexcept {
+      return map->template key<is_left>(idx);
+    }
+
+    value const *operator->() const noexcept {
+      return &**this;
+    }
+
+    iterator &operator++() {
+      return *this = map->template at<is_left>(rank() + 1);
+    }
+
+    iterator operator++(int) {
+      iterator res = *this;
+      ++*this;
+      return res;
+    }
+
+    iterator &operator--() {
+      return *this = map->template at<is_left>(rank() - 1);
+    }
+
+    iterator operator--(int) {
+      iterator res = *this;
+      --*this;
+      return res;
+    }
+
+    iterator &operator+=(std::ptrdiff_t n) {
+      return *this = map->template at<is_left>(rank() + n);
+    }
+
+    iterator &operator-=(std::ptrdiff_t n) {
+      return *this += -n;
+    }
+
+    friend iterator operator+(iterator it, std::ptrdiff_t n) {
+      return it += n;
+    }
+
+    friend iterator operator-(iterator it, std::ptrdiff_t n) {
+      return it -= n;
+    }
+
+    friend std::ptrdiff_t operator-(iterator const &a, iterator const &b) {
+      return static_cast<std::ptrdiff_t>(a.rank()) -
+             static_cast<std::ptrdiff_t>(b.rank());
+    }
+
+    // the end of one side flips to the end of the other one, as for bimap
+    iterator<!is_left> flip() const noexcept {
+      return iterator<!is_left>(map, idx, no_pos);
+    }
+
+    bool operator==(iterator const &other) const noexcept {
+      return idx == other.idx;
+    }
+
+    bool operator!=(iterator const &other) const noexcept {
+      return !(*this == other);
+    }
+
+    friend flat_bimap;
+    template <bool>
+    friend struct iterator;
+
+  private:
+    static constexpr std::size_t side = is_left ? 0 : 1;
+
+    iterator(flat_bimap const *map_, std::uint32_t idx_,
+             std::uint32_t pos_) noexcept
+        : map(map_), idx(idx_), pos(pos_) {}
+
+    // position among the keys of this side, pos is a hint that is right
+    // while stepping
+    std::size_t rank() const {
+      if (idx == end_index) {
+        return map->size();
+      }
+      if (map->template index_at<is_left>(pos) == idx) {
+        return pos;
+      }
+      return map->template rank_of<is_left>(idx);
+    }
+
+    flat_bimap const *map;
+    std::uint32_t idx;
+    std::uint32_t pos;
+  };
+
+  using left_iterator = iterator<true>;
+  using right_iterator = iterator<false>;
+
+  explicit flat_bimap(CompareLeft compare_left_ = CompareLeft(),
+                      CompareRight compare_right_ = CompareRight())
+      : compare_left(std::move(compare_left_)),
+        compare_right(std::move(compare_right_)) {}
+
+  // a pair is dropped if a pair kept earlier in the input has its left or
+  // right key, as in a loop of insert
+  template <typename InputIt, typename = typename std::iterator_traits<
+                                 InputIt>::iterator_category>
+  flat_bimap(InputIt first, InputIt last,
+             CompareLeft compare_left_ = CompareLeft(),
+             CompareRight compare_right_ = CompareRight())
+      : flat_bimap(std::move(compare_left_), std::move(compare_right_)) {
+    assign(first, last);
+  }
+
+  void swap(flat_bimap &other) noexcept {
+    std::swap(compare_left, other.compare_left);
+    std::swap(compare_right, other.compare_right);
+    pairs.swap(other.pairs);
+    for (std::size_t side = 0; side < 2; side++) {
+      orders[side].swap(other.orders[side]);
+      ranks[side].swap(other.ranks[side]);
+      deltas[side].swap(other.deltas[side]);
+    }
+    std::swap(merged, other.merged);
+  }
+
+  // Replaces the contents with pairs from [first, last), sorting each side
+  // once. Returns the number of dropped pairs.
+  template <typename InputIt>
+  std::size_t assign(InputIt first, InputIt last) {
+    flat_bimap tmp(compare_left, compare_right);
+    for (; first != last; ++first) {
+      auto &&p = *first;
+      tmp.pairs.emplace_back(std::get<0>(std::forward<decltype(p)>(p)),
+                             std::get<1>(std::forward<decltype(p)>(p)));
+    }
+    std::vector<std::uint32_t> left_key = tmp.key_ids<true>();
+    std::vector<std::uint32_t> right_key = tmp.key_ids<false>();
+    // a key is only blocked by a pair kept earlier, as in a loop of insert
+    std::vector<char> dead(tmp.pairs.size(), false);
+    std::vector<char> left_taken(dead.size(), false);
+    std::vector<char> right_taken(dead.size(), false);
+    for (std::size_t i = 0; i < dead.size(); i++) {
+      if (left_taken[left_key[i]] || right_taken[right_key[i]]) {
+        dead[i] = true;
+      } else {
+        left_taken[left_key[i]] = right_taken[right_key[i]] = true;
+      }
+    }
+    tmp.compact(dead);
+    tmp.sort_side<true>();
+    tmp.sort_side<false>();
+    swap(tmp);
+    return static_cast<std::size_t>(
+        std::count(dead.begin(), dead.end(), true));
+  }
+
+  template <typename left_t_ = left_t, typename right_t_ = right_t>
+  left_iterator insert(left_t_ &&left, right_t_ &&right) {
+    if (pairs.size() - merged >= delta_capacity) {
+      commit();
+    }
+    delta_slot left_slot{}, right_slot{};
+    if (locate<true>(left, left_slot) != end_index ||
+        locate<false>(right, right_slot) != end_index) {
+      return end_left();
+    }
+    reserve_delta();
+    pairs.emplace_back(std::forward<left_t_>(left),
+                       std::forward<right_t_>(right));
+    auto idx = static_cast<std::uint32_t>(pairs.size() - 1);
+    deltas[0].insert(deltas[0].begin() + left_slot.at, {idx, left_slot.pos});
+    deltas[1].insert(deltas[1].begin() + right_slot.at, {idx, right_slot.pos});
+    return left_iterator(this, idx, no_pos);
+  }
+
+  left_iterator erase_left(left_iterator it) {
+    return erase(it, next_after(it));
+  }
+
+  bool erase_left(left_t const &left) {
+    left_iterator it = find_left(left);
+    if (it == end_left()) {
+      return false;
+    }
+    erase_left(it);
+    return true;
+  }
+
+  right_iterator erase_right(right_iterator it) {
+    return erase(it, next_after(it));
+  }
+
+  bool erase_right(right_t const &right) {
+    right_iterator it = find_right(right);
+    if (it == end_right()) {
+      return false;
+    }
+    erase_right(it);
+    return true;
+  }
+
+  left_iterator erase_left(left_iterator first, left_iterator last) {
+    return erase(first, last);
+  }
+
+  right_iterator erase_right(right_iterator first, right_iterator last) {
+    return erase(first, last);
+  }
+
+  void clear() noexcept {
+    pairs.clear();
+    for (std::size_t side = 0; side < 2; side++) {
+      orders[side].clear();
+      ranks[side].clear();
+      deltas[side].clear();
+    }
+    merged = 0;
+  }
+
+  left_iterator find_left(left_t const &left) const {
+    return left_iterator(this, locate<true>(left), no_pos);
+  }
+
+  right_iterator find_right(right_t const &right) const {
+    return right_iterator(this, locate<false>(right), no_pos);
+  }
+
+  right_t const &at_left(left_t const &key) const {
+    std::uint32_t idx = locate<true>(key);
+    if (idx == end_index) {
+      throw std::out_of_range("no such element");
+    }
+    return pairs[idx].second;
+  }
+
+  left_t const &at_right(right_t const &key) const {
+    std::uint32_t idx = locate<false>(key);
+    if (idx == end_index) {
+      throw std::out_of_range("no such element");
+    }
+    return pairs[idx].first;
+  }
+
+  // As for bimap: the value of key, or the default value paired with key.
+  // If a pair already holds the default value, it is re-keyed instead.
+  template <typename right_t_ = right_t,
+            typename = std::enable_if_t<
+                std::is_default_constructible_v<right_t_>>>
+  right_t const &at_left_or_default(left_t const &key) {
+    std::uint32_t idx = locate<true>(key);
+    if (idx != end_index) {
+      return pairs[idx].second;
+    }
+    right_t dflt = right_t();
+    right_iterator it = find_right(dflt);
+    if (it == end_right()) {
+      return *insert(key, std::move(dflt)).flip();
+    }
+    left_t new_key(key);
+    reserve_delta();
+    erase_right(it);
+    return *insert(std::move(new_key), std::move(dflt)).flip();
+  }
+
+  template <typename left_t_ = left_t,
+            typename = std::enable_if_t<
+                std::is_default_constructible_v<left_t_>>>
+  left_t const &at_right_or_default(right_t const &key) {
+    std::uint32_t idx = locate<false>(key);
+    if (idx != end_index) {
+      return pairs[idx].first;
+    }
+    left_t dflt = left_t();
+    left_iterator it = find_left(dflt);
+    if (it == end_left()) {
+      return *insert(std::move(dflt), key);
+    }
+    right_t new_key(key);
+    reserve_delta();
+    erase_left(it);
+    return *insert(std::move(dflt), std::move(new_key));
+  }
+
+  left_iterator lower_bound_left(left_t const &left) const {
+    return at<true>(lower_bound<true>(left));
+  }
+
+  left_iterator upper_bound_left(left_t const &left) const {
+    return at<true>(upper_bound<true>(left));
+  }
+
+  right_iterator lower_bound_right(right_t const &right) const {
+    return at<false>(lower_bound<false>(right));
+  }
+
+  right_iterator upper_bound_right(right_t const &right) const {
+    return at<false>(upper_bound<false>(right));
+  }
+
+  left_iterator nth_left(std::size_t k) const {
+    return at<true>(k);
+  }
+
+  right_iterator nth_right(std::size_t k) const {
+    return at<false>(k);
+  }
+
+  // number of keys less than the given one
+  std::size_t rank_left(left_t const &left) const {
+    return lower_bound<true>(left);
+  }
+
+  std::size_t rank_right(right_t const &right) const {
+    return lower_bound<false>(right);
+  }
+
+  left_iterator begin_left() const {
+    return at<true>(0);
+  }
+
+  left_iterator end_left() const noexcept {
+    return left_iterator(this, end_index, no_pos);
+  }
+
+  right_iterator begin_right() const {
+    return at<false>(0);
+  }
+
+  right_iterator end_right() const noexcept {
+    return right_iterator(this, end_index, no_pos);
+  }
+
+  // merges the pending inserts into the sorted arrays, which makes the
+  // ordered queries that follow skip the delta
+  void commit() {
+    if (merged == pairs.size()) {
+      return;
+    }
+    for (std::size_t side = 0; side < 2; side++) {
+      orders[side].reserve(pairs.size());
+      ranks[side].resize(pairs.size());
+    }
+    merge_delta<true>();
+    merge_delta<false>();
+    merged = pairs.size();
+  }
+
+  bool empty() const noexcept {
+    return pairs.empty();
+  }
+
+  std::size_t size() const noexcept {
+    return pairs.size();
+  }
+
+  friend bool operator==(flat_bimap const &a, flat_bimap const &b) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (auto const &[left, right] : a.pairs) {
+      std::uint32_t idx = b.template locate<true>(left);
+      if (idx == end_index ||
+          a.compare_right(right, b.pairs[idx].second) ||
+          a.compare_right(b.pairs[idx].second, right)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  friend bool operator!=(flat_bimap const &a, flat_bimap const &b) {
+    return !(a == b);
+  }
+
+private:
+  static constexpr std::uint32_t end_index = UINT32_MAX;
+  static constexpr std::uint32_t no_pos = UINT32_MAX;
+
+  // A pending pair on one side and the number of merged keys below its key.
+  // Its position among all keys is pos plus its place in the delta.
+  struct delta_entry {
+    std::uint32_t idx;
+    std::uint32_t pos;
+  };
+
+  // where a key is or would go on a side: pos as in delta_entry, at is its
+  // place in the delta
+  struct delta_slot {
+    std::uint32_t pos;
+    std::size_t at;
+  };
+
+  CompareLeft compare_left;
+  CompareRight compare_right;
+  // the first merged pairs are in the sorted arrays, the rest is the delta
+  std::vector<std::pair<left_t, right_t>> pairs;
+  // indexes of the merged pairs sorted by the keys of a side and their
+  // positions there
+  std::vector<std::uint32_t> orders[2];
+  std::vector<std::uint32_t> ranks[2];
+  // the delta sorted by the keys of a side
+  std::vector<delta_entry> deltas[2];
+  std::size_t merged{0};
+
+  template <typename It>
+  static It next_after(It it) {
+    return ++it;
+  }
+
+  template <bool is_left>
+  auto const &key(std::uint32_t idx) const noexcept {
+    if constexpr (is_left) {
+      return pairs[idx].first;
+    } else {
+      return pairs[idx].second;
+    }
+  }
+
+  template <bool is_left, typename A, typename B>
+  bool less(A const &a, B const &b) const {
+    if constexpr (is_left) {
+      return compare_left(a, b);
+    } else {
+      return compare_right(a, b);
+    }
+  }
+
+  // iterator to the pair at position pos of a side, the end past the last
+  template <bool is_left>
+  iterator<is_left> at(std::size_t pos) const noexcept {
+    std::uint32_t idx = index_at<is_left>(pos);
+    return iterator<is_left>(
+        this, idx, idx == end_index ? no_pos : static_cast<std::uint32_t>(pos));
+  }
+
+  // pair at position pos among all keys of a side, end_index past the last
+  template <bool is_left>
+  std::uint32_t index_at(std::size_t pos) const noexcept {
+    std::vector<std::uint32_t> const &order = orders[is_left ? 0 : 1];
+    std::vector<delta_entry> const &delta = deltas[is_left ? 0 : 1];
+    if (delta.empty()) {
+      return pos < order.size() ? order[pos] : end_index;
+    }
+    // pending keys before position pos
+    std::size_t lo = 0, hi = delta.size();
+    while (lo < hi) {
+      std::size_t mid = (lo + hi) / 2;
+      if (mid + delta[mid].pos < pos) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo < delta.size() && lo + delta[lo].pos == pos) {
+      return delta[lo].idx;
+    }
+    return pos - lo < order.size() ? order[pos - lo] : end_index;
+  }
+
+  // position of a pair among all keys of a side
+  template <bool is_left>
+  std::size_t rank_of(std::uint32_t idx) const {
+    std::vector<delta_entry> const &delta = deltas[is_left ? 0 : 1];
+    if (idx >= merged) {
+      std::size_t at = delta_lower_bound<is_left>(key<is_left>(idx));
+      return at + delta[at].pos;
+    }
+    // pending keys go before the merged key at pos if fewer keys are below
+    // them
+    std::size_t pos = ranks[is_left ? 0 : 1][idx];
+    return pos + (std::upper_bound(delta.begin(), delta.end(), pos,
+                                   [](std::size_t pos, delta_entry const &e) {
+                                     return pos < e.pos;
+                                   }) -
+                  delta.begin());
+  }
+
+  // positions among all keys
+  template <bool is_left, typename K>
+  std::size_t lower_bound(K const &x) const {
+    return merged_lower_bound<is_left>(x) + delta_lower_bound<is_left>(x);
+  }
+
+  template <bool is_left, typename K>
+  std::size_t upper_bound(K const &x) const {
+    return merged_upper_bound<is_left>(x) + delta_upper_bound<is_left>(x);
+  }
+
+  template <bool is_left, typename K>
+  std::size_t merged_lower_bound(K const &x) const {
+    std::vector<std::uint32_t> const &order = orders[is_left ? 0 : 1];
+    return std::lower_bound(order.begin(), order.end(), x,
+                            [this](std::uint32_t idx, K const &x) {
+                              return less<is_left>(key<is_left>(idx), x);
+                            }) -
+           order.begin();
+  }
+
+  template <bool is_left, typename K>
+  std::size_t merged_upper_bound(K const &x) const {
+    std::vector<std::uint32_t> const &order = orders[is_left ? 0 : 1];
+    return std::upper_bound(order.begin(), order.end(), x,
+                            [this](K const &x, std::uint32_t idx) {
+                              return less<is_left>(x, key<is_left>(idx));
+                            }) -
+           order.begin();
+  }
+
+  template <bool is_left, typename K>
+  std::size_t delta_lower_bound(K const &x) const {
+    std::vector<delta_entry> const &delta = deltas[is_left ? 0 : 1];
+    return std::lower_bound(delta.begin(), delta.end(), x,
+                            [this](delta_entry const &e, K const &x) {
+                              return less<is_left>(key<is_left>(e.idx), x);
+                            }) -
+           delta.begin();
+  }
+
+  template <bool is_left, typename K>
+  std::size_t delta_upper_bound(K const &x) const {
+    std::vector<delta_entry> const &delta = deltas[is_left ? 0 : 1];
+    return std::upper_bound(delta.begin(), delta.end(), x,
+                            [this](K const &x, delta_entry const &e) {
+                              return less<is_left>(x, key<is_left>(e.idx));
+                            }) -
+           delta.begin();
+  }
+
+  template <bool is_left, typename K>
+  std::uint32_t locate(K const &x) const {
+    delta_slot slot;
+    return locate<is_left>(x, slot);
+  }
+
+  // index of the pair with key x on a side, searching the merged keys and
+  // then the delta, or end_index and the slot x would go to
+  template <bool is_left, typename K>
+  std::uint32_t locate(K const &x, delta_slot &slot) const {
+    std::vector<std::uint32_t> const &order = orders[is_left ? 0 : 1];
+    std::size_t pos = merged_lower_bound<is_left>(x);
+    if (pos < order.size() && !less<is_left>(x, key<is_left>(order[pos]))) {
+      return order[pos];
+    }
+    std::vector<delta_entry> const &delta = deltas[is_left ? 0 : 1];
+    std::size_t at = delta_lower_bound<is_left>(x);
+    if (at < delta.size() && !less<is_left>(x, key<is_left>(delta[at].idx))) {
+      return delta[at].idx;
+    }
+    slot = {static_cast<std::uint32_t>(pos), at};
+    return end_index;
+  }
+
+  // the sorted arrays have room for the delta, so nothing here throws
+  template <bool is_left>
+  void merge_delta() noexcept {
+    constexpr std::size_t side = is_left ? 0 : 1;
+    std::vector<std::uint32_t> &order = orders[side];
+    std::vector<delta_entry> &delta = deltas[side];
+    std::size_t from = order.size();
+    order.resize(order.size() + delta.size());
+    // from the back, each pending pair goes after the keys below its own
+    std::size_t to = order.size();
+    for (std::size_t i = delta.size(); i-- > 0;) {
+      while (from > delta[i].pos) {
+        order[--to] = order[--from];
+      }
+      order[--to] = delta[i].idx;
+    }
+    std::vector<std::uint32_t> &rank = ranks[side];
+    for (std::size_t pos = delta.empty() ? order.size() : delta[0].pos;
+         pos < order.size(); pos++) {
+      rank[order[pos]] = static_cast<std::uint32_t>(pos);
+    }
+    delta.clear();
+  }
+
+  // sorts all pairs on a side, there must be no delta
+  template <bool is_left>
+  void sort_side() {
+    constexpr std::size_t side = is_left ? 0 : 1;
+    std::vector<std::uint32_t> &order = orders[side];
+    order.resize(pairs.size());
+    std::iota(order.begin(), order.end(), std::uint32_t(0));
+    std::sort(order.begin(), order.end(),
+              [this](std::uint32_t a, std::uint32_t b) {
+                return less<is_left>(key<is_left>(a), key<is_left>(b));
+              });
+    std::vector<std::uint32_t> &rank = ranks[side];
+    rank.resize(pairs.size());
+    for (std::size_t pos = 0; pos < order.size(); pos++) {
+      rank[order[pos]] = static_cast<std::uint32_t>(pos);
+    }
+  }
+
+  // numbers the distinct keys of a side, pairs with equal keys share an id
+  template <bool is_left>
+  std::vector<std::uint32_t> key_ids() const {
+    std::vector<std::uint32_t> order(pairs.size());
+    for (std::size_t i = 0; i < order.size(); i++) {
+      order[i] = static_cast<std::uint32_t>(i);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [this](std::uint32_t a, std::uint32_t b) {
+                       return less<is_left>(key<is_left>(a), key<is_left>(b));
+                     });
+    std::vector<std::uint32_t> id(pairs.size());
+    for (std::size_t i = 0; i < order.size(); i++) {
+      id[order[i]] =
+          i > 0 && !less<is_left>(key<is_left>(order[i - 1]),
+                                  key<is_left>(order[i]))
+              ? id[order[i - 1]]
+              : static_cast<std::uint32_t>(i);
+    }
+    return id;
+  }
+
+  // Erases the pairs of [first, last) of a side in one pass over the
+  // arrays and returns the iterator that follows them.
+  template <bool is_left>
+  iterator<is_left> erase(iterator<is_left> first, iterator<is_left> last) {
+    commit();
+    std::vector<char> dead(pairs.size(), false);
+    std::vector<std::uint32_t> const &order = orders[is_left ? 0 : 1];
+    std::size_t from = first.rank(), to = last.rank();
+    for (std::size_t pos = from; pos < to; pos++) {
+      dead[order[pos]] = true;
+    }
+    compact(dead);
+    return at<is_left>(from);
+  }
+
+  // Once the deltas have room, an insert right after an erase allocates
+  // nothing, which is what re-keying in at_*_or_default relies on.
+  void reserve_delta() {
+    for (std::vector<delta_entry> &delta : deltas) {
+      delta.reserve(delta_capacity);
+    }
+  }
+
+  // drops the marked pairs, the others keep their order
+  void compact(std::vector<char> const &dead) {
+    std::vector<std::uint32_t> remap(pairs.size());
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < pairs.size(); i++) {
+      if (!dead[i]) {
+        remap[i] = static_cast<std::uint32_t>(n);
+        if (n != i) {
+          pairs[n] = std::move(pairs[i]);
+        }
+        n++;
+      }
+    }
+    pairs.erase(pairs.begin() + n, pairs.end());
+    for (std::size_t side = 0; side < 2; side++) {
+      std::vector<std::uint32_t> &order = orders[side];
+      std::size_t kept = 0;
+      for (std::uint32_t idx : order) {
+        if (!dead[idx]) {
+          order[kept++] = remap[idx];
+        }
+      }
+      order.resize(kept);
+      ranks[side].resize(kept);
+      for (std::size_t pos = 0; pos < kept; pos++) {
+        ranks[side][order[pos]] = static_cast<std::uint32_t>(pos);
+      }
+    }
+    // erase() merged the delta first, assign() sorts the pairs afterwards
+    merged = pairs.size();
+  }
+};
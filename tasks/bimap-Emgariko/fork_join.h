@@ -0,0 +1,38 @@
+#pragma once
+
+#include <thread>
+#include <utility>
+
+namespace details {
+
+// Runs both tasks and returns when they are done. If fork is set, the first
+// one runs on a separate thread, falling back to sequential execution when a
+// thread can not be started.
+template <typename F1, typename F2>
+void fork_join(bool fork, F1&& f1, F2&& f2) {
+  std::thread worker;
+  if (fork) {
+    try {
+      worker = std::thread(std::ref(f1));
+    } catch (...) {
+      fork = false;
+    }
+  }
+  if (!fork) {
+    f1();
+  }
+  f2();
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+inline unsigned fork_depth() noexcept {
+  unsigned depth = 0;
+  for (unsigned threads = std::thread::hardware_concurrency(); threads > 1;
+       threads = (threads + 1) / 2) {
+    depth++;
+  }
+  return depth;
+}
+}
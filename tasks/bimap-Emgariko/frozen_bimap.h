@@ -0,0 +1,480 @@
+#pragma once
+
+#include "treap.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace details {
+
+// Keys of one side in Eytzinger order: the node at position k (counted from
+// 1) has its children at 2k and 2k + 1, which gives a search that touches
+// the array top-down and needs no pointers. cross[k - 1] is the position of
+// the paired key on the other side. The arrays belong to whoever made the
+// side, a frozen_bimap or a mapped file.
+template <typename T, typename Tag, typename Compare>
+struct frozen_side : Compare {
+  explicit frozen_side(Compare const& cmp) : Compare(cmp) {}
+
+  T const* keys{nullptr};
+  std::uint32_t const* cross{nullptr};
+  std::uint32_t n{0};
+
+  std::uint32_t size() const noexcept {
+    return n;
+  }
+
+  T const& key(std::uint32_t k) const noexcept {
+    return keys[k - 1];
+  }
+
+  template <typename A, typename B>
+  bool less(A const& a, B const& b) const {
+    return static_cast<Compare const&>(*this)(a, b);
+  }
+
+  // Goes down to a leaf without branching on the comparisons, a path of
+  // turns is kept in the bits of k. Dropping the trailing right turns and
+  // the left turn before them gives the last node where the search went
+  // left, or 0 if there was none. The keys four levels down share a few
+  // cache lines and are prefetched.
+  template <typename K>
+  std::uint32_t bound(K const& x, bool upper) const {
+    std::uint64_t k = 1;
+    while (k <= n) {
+      if (16 * k <= n) {
+        prefetch(&keys[16 * k - 1]);
+      }
+      bool right = upper ? !less(x, key(static_cast<std::uint32_t>(k)))
+                         : less(key(static_cast<std::uint32_t>(k)), x);
+      k = 2 * k + right;
+    }
+    return static_cast<std::uint32_t>(k >> (count_trailing_ones(k) + 1));
+  }
+
+  // positions of the first and the last key in order, 0 if there are none
+  std::uint32_t first() const noexcept {
+    return descend(1, false, n);
+  }
+
+  std::uint32_t last() const noexcept {
+    return descend(1, true, n);
+  }
+
+  // in-order neighbours, 0 stands for the end
+  std::uint32_t next(std::uint32_t k) const noexcept {
+    return next(k, n);
+  }
+
+  std::uint32_t prev(std::uint32_t k) const noexcept {
+    if (k == 0) {
+      return last();
+    }
+    if (2 * std::uint64_t(k) <= n) {
+      return descend(2 * k, true, n);
+    }
+    return k >> (count_trailing_ones(~k) + 1);
+  }
+
+  // Eytzinger positions of the ranks 0..n-1 of a sorted sequence
+  static std::vector<std::uint32_t> positions(std::uint32_t n) {
+    std::vector<std::uint32_t> res(n);
+    std::uint32_t rank = 0;
+    for (std::uint32_t k = descend(1, false, n); k != 0; k = next(k, n)) {
+      res[rank++] = k;
+    }
+    return res;
+  }
+
+private:
+  static std::uint32_t next(std::uint32_t k, std::uint32_t n) noexcept {
+    if (2 * std::uint64_t(k) + 1 <= n) {
+      return descend(2 * k + 1, false, n);
+    }
+    return k >> (count_trailing_ones(k) + 1);
+  }
+
+  static std::uint32_t descend(std::uint32_t k, bool to_right,
+                               std::uint32_t n) noexcept {
+    if (k > n) {
+      return 0;
+    }
+    while (2 * std::uint64_t(k) + to_right <= n) {
+      k = 2 * k + to_right;
+    }
+    return k;
+  }
+
+  // k has a zero bit, positions stay far below 2^64
+  static unsigned count_trailing_ones(std::uint64_t k) noexcept {
+#if defined(__GNUC__)
+    return static_cast<unsigned>(__builtin_ctzll(~k));
+#else
+    unsigned res = 0;
+    for (; k & 1; k >>= 1) {
+      res++;
+    }
+    return res;
+#endif
+  }
+};
+
+// Lookups and iteration over the sides of a frozen bimap, shared by the
+// bimaps that own their arrays and the ones that map them from a file.
+template <typename Left, typename Right, typename CompareLeft,
+          typename CompareRight>
+struct frozen_view {
+  using left_t = Left;
+  using right_t = Right;
+  using left_side_t = frozen_side<Left, left_tag, CompareLeft>;
+  using right_side_t = frozen_side<Right, right_tag, CompareRight>;
+
+  template <typename value, typename Tag>
+  struct iterator {
+    static constexpr bool is_left = std::is_same_v<Tag, left_tag>;
+    using side_t = std::conditional_t<is_left, left_side_t, right_side_t>;
+
+    value const& operator*() const noexcept {
+      return side().key(pos);
+    }
+
+    value const* operator->() const noexcept {
+      return &**this;
+    }
+
+    iterator& operator++() noexcept {
+      pos = side().next(pos);
+      return *this;
+    }
+
+    iterator operator++(int) noexcept {
+      iterator res = *this;
+      ++*this;
+      return res;
+    }
+
+    iterator& operator--() noexcept {
+      pos = side().prev(pos);
+      return *this;
+    }
+
+    iterator operator--(int) noexcept {
+      iterator res = *this;
+      --*this;
+      return res;
+    }
+
+    using other_tag = std::conditional_t<is_left, right_tag, left_tag>;
+    using other_t = std::conditional_t<is_left, right_t, left_t>;
+    using other_it = iterator<other_t, other_tag>;
+
+    other_it flip() const noexcept {
+      return other_it(map, pos == 0 ? 0 : side().cross[pos - 1]);
+    }
+
+    bool operator==(iterator const& other) const noexcept {
+      return pos == other.pos;
+    }
+
+    bool operator!=(iterator const& other) const noexcept {
+      return !(*this == other);
+    }
+
+    friend frozen_view;
+
+    template <typename, typename>
+    friend struct iterator;
+
+  private:
+    iterator(frozen_view const* map_, std::uint32_t pos_) noexcept
+        : map(map_), pos(pos_) {}
+
+    side_t const& side() const noexcept {
+      if constexpr (is_left) {
+        return map->left_side;
+      } else {
+        return map->right_side;
+      }
+    }
+
+    frozen_view const* map;
+    // Eytzinger position, 0 is the end
+    std::uint32_t pos;
+  };
+
+  using left_iterator = iterator<left_t, left_tag>;
+  using right_iterator = iterator<right_t, right_tag>;
+
+  left_iterator find_left(left_t const& left) const {
+    left_iterator it = lower_bound_left(left);
+    return it == end_left() || left_side.less(left, *it) ? end_left() : it;
+  }
+
+  right_iterator find_right(right_t const& right) const {
+    right_iterator it = lower_bound_right(right);
+    return it == end_right() || right_side.less(right, *it) ? end_right()
+                                                             : it;
+  }
+
+  right_t const& at_left(left_t const& key) const {
+    left_iterator it = find_left(key);
+    if (it == end_left()) {
+      throw std::out_of_range("no such element");
+    }
+    return *it.flip();
+  }
+
+  left_t const& at_right(right_t const& key) const {
+    right_iterator it = find_right(key);
+    if (it == end_right()) {
+      throw std::out_of_range("no such element");
+    }
+    return *it.flip();
+  }
+
+  left_iterator lower_bound_left(left_t const& left) const {
+    return left_iterator(this, left_side.bound(left, false));
+  }
+
+  left_iterator upper_bound_left(left_t const& left) const {
+    return left_iterator(this, left_side.bound(left, true));
+  }
+
+  right_iterator lower_bound_right(right_t const& right) const {
+    return right_iterator(this, right_side.bound(right, false));
+  }
+
+  right_iterator upper_bound_right(right_t const& right) const {
+    return right_iterator(this, right_side.bound(right, true));
+  }
+
+  left_iterator begin_left() const noexcept {
+    return left_iterator(this, left_side.first());
+  }
+
+  left_iterator end_left() const noexcept {
+    return left_iterator(this, 0);
+  }
+
+  right_iterator begin_right() const noexcept {
+    return right_iterator(this, right_side.first());
+  }
+
+  right_iterator end_right() const noexcept {
+    return right_iterator(this, 0);
+  }
+
+  bool empty() const noexcept {
+    return size() == 0;
+  }
+
+  std::size_t size() const noexcept {
+    return left_side.size();
+  }
+
+protected:
+  frozen_view(CompareLeft const& compare_left,
+              CompareRight const& compare_right)
+      : left_side(compare_left), right_side(compare_right) {}
+
+  frozen_view(frozen_view const&) = default;
+  frozen_view& operator=(frozen_view const&) = default;
+  ~frozen_view() = default;
+
+  left_side_t left_side;
+  right_side_t right_side;
+};
+
+// Header of the file written by frozen_bimap::write(). The arrays of the
+// sides follow it at the given offsets, each aligned to 64 bytes, in the
+// byte order and with the key layout of the machine that wrote them.
+struct frozen_file_header {
+  static constexpr char signature[8] = {'B', 'I', 'M', 'A', 'P', 'F', 'Z', 0};
+  static constexpr std::uint32_t current_version = 1;
+  static constexpr std::uint32_t byte_order_mark = 0x01020304;
+  static constexpr std::size_t alignment = 64;
+
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint32_t left_size;
+  std::uint32_t right_size;
+  std::uint64_t count;
+  // left keys, left cross indexes, right keys, right cross indexes
+  std::uint64_t offsets[4];
+  std::uint64_t file_size;
+};
+}
+
+// Immutable bimap made by bimap::freeze(). Each side is a flat array in
+// Eytzinger order, searched without branches, and a pair is found from
+// either side through cross indexes. Iteration visits the keys in order.
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct frozen_bimap
+    : details::frozen_view<Left, Right, CompareLeft, CompareRight> {
+  using view_t = details::frozen_view<Left, Right, CompareLeft, CompareRight>;
+  using left_t = Left;
+  using right_t = Right;
+
+  explicit frozen_bimap(CompareLeft compare_left = CompareLeft(),
+                        CompareRight compare_right = CompareRight())
+      : view_t(compare_left, compare_right) {}
+
+  // Takes pairs with unique keys on both sides in any order.
+  template <typename InputIt>
+  frozen_bimap(InputIt first, InputIt last,
+               CompareLeft compare_left = CompareLeft(),
+               CompareRight compare_right = CompareRight())
+      : frozen_bimap(std::move(compare_left), std::move(compare_right)) {
+    std::vector<std::pair<left_t, right_t>> pairs(first, last);
+    if (pairs.size() > UINT32_MAX) {
+      throw std::length_error("frozen_bimap is too large");
+    }
+    std::uint32_t n = static_cast<std::uint32_t>(pairs.size());
+    std::vector<std::uint32_t> by_left(n), by_right(n);
+    std::iota(by_left.begin(), by_left.end(), 0);
+    std::iota(by_right.begin(), by_right.end(), 0);
+    std::sort(by_left.begin(), by_left.end(),
+              [&](std::uint32_t a, std::uint32_t b) {
+                return this->left_side.less(pairs[a].first, pairs[b].first);
+              });
+    std::sort(by_right.begin(), by_right.end(),
+              [&](std::uint32_t a, std::uint32_t b) {
+                return this->right_side.less(pairs[a].second,
+                                             pairs[b].second);
+              });
+    // both sides have the shape of n keys, the rank of a key in its side
+    // gives its position
+    std::vector<std::uint32_t> positions =
+        view_t::left_side_t::positions(n);
+    std::vector<std::uint32_t> left_pos(n), right_pos(n);
+    for (std::uint32_t r = 0; r < n; r++) {
+      left_pos[by_left[r]] = positions[r];
+      right_pos[by_right[r]] = positions[r];
+    }
+    std::vector<std::uint32_t> left_at(n), right_at(n);
+    for (std::uint32_t i = 0; i < n; i++) {
+      left_at[left_pos[i] - 1] = i;
+      right_at[right_pos[i] - 1] = i;
+    }
+    left_keys.reserve(n);
+    right_keys.reserve(n);
+    left_cross.resize(n);
+    right_cross.resize(n);
+    for (std::uint32_t k = 0; k < n; k++) {
+      left_keys.push_back(std::move(pairs[left_at[k]].first));
+      left_cross[k] = right_pos[left_at[k]];
+      right_keys.push_back(std::move(pairs[right_at[k]].second));
+      right_cross[k] = left_pos[right_at[k]];
+    }
+    link();
+  }
+
+  frozen_bimap(frozen_bimap const& other)
+      : view_t(other), left_keys(other.left_keys),
+        right_keys(other.right_keys), left_cross(other.left_cross),
+        right_cross(other.right_cross) {
+    link();
+  }
+
+  frozen_bimap(frozen_bimap&& other) noexcept
+      : view_t(other), left_keys(std::move(other.left_keys)),
+        right_keys(std::move(other.right_keys)),
+        left_cross(std::move(other.left_cross)),
+        right_cross(std::move(other.right_cross)) {
+    link();
+    other.link();
+  }
+
+  frozen_bimap& operator=(frozen_bimap const& other) {
+    if (this != &other) {
+      *this = frozen_bimap(other);
+    }
+    return *this;
+  }
+
+  frozen_bimap& operator=(frozen_bimap&& other) noexcept {
+    if (this != &other) {
+      view_t::operator=(other);
+      left_keys = std::move(other.left_keys);
+      right_keys = std::move(other.right_keys);
+      left_cross = std::move(other.left_cross);
+      right_cross = std::move(other.right_cross);
+      link();
+      other.link();
+    }
+    return *this;
+  }
+
+  ~frozen_bimap() = default;
+
+  // Writes the arrays in the format that mapped_bimap opens, preceded by a
+  // details::frozen_file_header.
+  void write(std::ostream& out) const {
+    static_assert(std::is_trivially_copyable_v<Left> &&
+                      std::is_trivially_copyable_v<Right>,
+                  "only trivially copyable keys can be written");
+    using header_t = details::frozen_file_header;
+    header_t header{};
+    std::memcpy(header.magic, header_t::signature, sizeof(header.magic));
+    header.version = header_t::current_version;
+    header.byte_order = header_t::byte_order_mark;
+    header.left_size = sizeof(Left);
+    header.right_size = sizeof(Right);
+    header.count = left_keys.size();
+    std::pair<void const*, std::size_t> arrays[4] = {
+        {left_keys.data(), left_keys.size() * sizeof(Left)},
+        {left_cross.data(), left_cross.size() * sizeof(std::uint32_t)},
+        {right_keys.data(), right_keys.size() * sizeof(Right)},
+        {right_cross.data(), right_cross.size() * sizeof(std::uint32_t)}};
+    std::uint64_t end = sizeof(header_t);
+    for (int i = 0; i < 4; i++) {
+      header.offsets[i] = padded(end);
+      end = header.offsets[i] + arrays[i].second;
+    }
+    header.file_size = end;
+    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    std::uint64_t written = sizeof(header_t);
+    for (int i = 0; i < 4; i++) {
+      static constexpr char zeros[header_t::alignment] = {};
+      out.write(zeros, static_cast<std::streamsize>(header.offsets[i] -
+                                                    written));
+      out.write(static_cast<char const*>(arrays[i].first),
+                static_cast<std::streamsize>(arrays[i].second));
+      written = header.offsets[i] + arrays[i].second;
+    }
+    if (!out) {
+      throw std::runtime_error("can not write frozen_bimap");
+    }
+  }
+
+private:
+  std::vector<Left> left_keys;
+  std::vector<Right> right_keys;
+  std::vector<std::uint32_t> left_cross;
+  std::vector<std::uint32_t> right_cross;
+
+  // points the sides to the arrays
+  void link() noexcept {
+    this->left_side.keys = left_keys.data();
+    this->left_side.cross = left_cross.data();
+    this->left_side.n = static_cast<std::uint32_t>(left_keys.size());
+    this->right_side.keys = right_keys.data();
+    this->right_side.cross = right_cross.data();
+    this->right_side.n = static_cast<std::uint32_t>(right_keys.size());
+  }
+
+  static std::uint64_t padded(std::uint64_t offset) noexcept {
+    std::uint64_t a = details::frozen_file_header::alignment;
+    return (offset + a - 1) / a * a;
+  }
+};
@@ -0,0 +1,472 @@
+#pragma once
+
+#include "treap.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+
+template <typename Left, typename Right, typename CompareLeft,
+          typename CompareRight, typename Allocator>
+struct bimap;
+
+namespace details {
+
+struct default_hash {
+  template <typename T>
+  std::size_t operator()(T const& x) const {
+    return std::hash<T>{}(x);
+  }
+};
+}
+
+// Comparator replacement that makes bimap index its side with a hash table,
+// e.g. bimap<int, int, hash_index<>, std::less<int>>. The side keeps find,
+// erase and flip(), but its iteration order is unspecified and it has no
+// bounds.
+template <typename Hash = details::default_hash,
+          typename KeyEqual = std::equal_to<>>
+struct hash_index : Hash, KeyEqual {
+  hash_index() = default;
+  hash_index(Hash hash, KeyEqual equal = KeyEqual())
+      : Hash(std::move(hash)), KeyEqual(std::move(equal)) {}
+};
+
+namespace details {
+
+struct hash_element_base;
+struct hash_header;
+
+// An element is live if elem is set. A free entry is empty or deleted,
+// deleted ones do not stop a probe sequence.
+struct hash_entry {
+  static constexpr std::uint64_t empty = 0;
+  static constexpr std::uint64_t deleted = 1;
+
+  std::uint64_t hash{empty};
+  hash_element_base* elem{nullptr};
+};
+
+// entries of a table, elements refer to it so that swapping tables is O(1)
+struct hash_block {
+  hash_header* header;
+  std::size_t capacity;
+  unsigned shift;
+  std::size_t size{0};
+  // live and deleted entries
+  std::size_t used{0};
+  std::unique_ptr<hash_entry[]> entries;
+};
+
+struct hash_element_base {
+  hash_element_base() noexcept = default;
+
+  template <typename Left, typename Right, typename CompareLeft,
+            typename CompareRight, typename Allocator>
+  friend struct ::bimap;
+
+  template <typename T_, typename Tag_, typename Hash_, typename KeyEqual_>
+  friend struct hash_table;
+
+private:
+  // table holding the element and its entry there, the header has no table
+  hash_block* block{nullptr};
+  std::size_t slot{0};
+};
+
+// end element of a table, it also links to the end of the other index
+struct hash_header : hash_element_base {
+  hash_block* table{nullptr};
+  void* sibling{nullptr};
+};
+
+template <typename T, typename Tag>
+struct hash_element : hash_element_base {
+  hash_element() noexcept = default;
+
+  explicit hash_element(T val_) noexcept : val(std::move(val_)) {}
+
+  hash_element(hash_element const&) = delete;
+  hash_element& operator=(hash_element const&) = delete;
+
+  template <typename Left, typename Right, typename CompareLeft,
+            typename CompareRight, typename Allocator>
+  friend struct ::bimap;
+
+  template <typename T_, typename Tag_, typename Hash_, typename KeyEqual_>
+  friend struct hash_table;
+
+private:
+  T val;
+};
+
+// Open addressing with linear probing over pointers to the elements. Entries
+// cache the hash, so a probe only reads an element when the hashes match.
+// Erased entries are marked deleted rather than shifted, so erasing one
+// element never moves another and erasing while iterating is safe.
+template <typename T, typename Tag, typename Hash, typename KeyEqual>
+struct hash_table : hash_index<Hash, KeyEqual> {
+  using policy_t = hash_index<Hash, KeyEqual>;
+  using element_t = hash_element<T, Tag>;
+  using element_base_t = hash_element_base;
+  using key_type = T;
+  static constexpr bool ordered = false;
+  // other key types need both the hash and the equality to accept them
+  static constexpr bool transparent =
+      is_transparent_v<Hash> && is_transparent_v<KeyEqual>;
+
+  static constexpr std::size_t min_capacity = 8;
+
+  // entry where a new element is to be put, it is looked up again if the
+  // table has to grow first
+  struct position {
+    std::uint64_t hash;
+    std::size_t slot;
+  };
+
+  hash_table() noexcept = default;
+  explicit hash_table(policy_t const& policy) : policy_t(policy) {}
+  hash_table(hash_table const&) = delete;
+  hash_table(hash_table&& other) noexcept {
+    swap(other);
+  }
+  hash_table& operator=(hash_table const&) = delete;
+  hash_table& operator=(hash_table&&) = delete;
+
+  ~hash_table() {
+    delete header.table;
+  }
+
+  bool empty() const noexcept {
+    return header.table == nullptr || header.table->size == 0;
+  }
+
+  // the header keeps its link to the other index of the bimap
+  void swap(hash_table& other) noexcept {
+    std::swap(header.table, other.header.table);
+    if (header.table != nullptr) {
+      header.table->header = &header;
+    }
+    if (other.header.table != nullptr) {
+      other.header.table->header = &other.header;
+    }
+    std::swap(get_cmp(), other.get_cmp());
+  }
+
+  hash_element_base const* begin() const noexcept {
+    return header.table == nullptr ? &header : first_from(header.table, 0);
+  }
+
+  hash_element_base const* end() const noexcept {
+    return &header;
+  }
+
+  void* sentinel() noexcept {
+    return static_cast<hash_element_base*>(&header);
+  }
+
+  void set_sibling(void* other_sentinel) noexcept {
+    header.sibling = other_sentinel;
+  }
+
+  static bool is_end(hash_element_base const* e) noexcept {
+    return e->block == nullptr;
+  }
+
+  static void* sibling(hash_element_base* end) noexcept {
+    return static_cast<hash_header*>(end)->sibling;
+  }
+
+  static hash_element_base* end_of(void* sentinel) noexcept {
+    return static_cast<hash_element_base*>(sentinel);
+  }
+
+  static void next(hash_element_base*& e) noexcept {
+    e = first_from(e->block, e->slot + 1);
+  }
+
+  static void prev(hash_element_base*& e) noexcept {
+    hash_block* b;
+    std::size_t i;
+    if (is_end(e)) {
+      b = static_cast<hash_header*>(e)->table;
+      i = b->capacity;
+    } else {
+      b = e->block;
+      i = e->slot;
+    }
+    do {
+      i--;
+    } while (b->entries[i].elem == nullptr);
+    e = b->entries[i].elem;
+  }
+
+  hash_element_base* insert(element_t& e) {
+    position pos;
+    locate(e.val, pos);
+    link_at(pos, e);
+    return &e;
+  }
+
+  // returns an element equal to x or stores the entry x belongs to in pos
+  element_t* locate(T const& x, position& pos) const noexcept {
+    pos = {hash_of(x), 0};
+    hash_block* b = header.table;
+    if (b == nullptr) {
+      return nullptr;
+    }
+    bool reuse = false;
+    std::size_t mask = b->capacity - 1;
+    for (std::size_t i = pos.hash >> b->shift;; i = (i + 1) & mask) {
+      hash_entry const& en = b->entries[i];
+      if (en.elem == nullptr) {
+        if (!reuse) {
+          pos.slot = i;
+          reuse = en.hash == hash_entry::deleted;
+        }
+        if (en.hash == hash_entry::empty) {
+          return nullptr;
+        }
+      } else if (en.hash == pos.hash && equal(value(en.elem), x)) {
+        return to_derived_ptr(en.elem);
+      }
+    }
+  }
+
+  // hints do not help a hash table
+  bool locate_by_hint(hash_element_base*, T const&, position&) const noexcept {
+    return false;
+  }
+
+  // may throw if the table has to grow, it is unchanged then
+  void link_at(position pos, element_t& e) {
+    hash_block* b = header.table;
+    if (b == nullptr || (b->used + 1) * 4 > b->capacity * 3) {
+      rehash(b == nullptr ? 0 : b->size + 1);
+      b = header.table;
+      pos.slot = free_slot(b, pos.hash);
+    }
+    hash_entry& en = b->entries[pos.slot];
+    if (en.hash != hash_entry::deleted) {
+      b->used++;
+    }
+    en = {pos.hash, &e};
+    b->size++;
+    e.block = b;
+    e.slot = pos.slot;
+  }
+
+  // Gives e the key, which gets the old one in exchange, and moves e to
+  // the key's entry. No other element may have the key. The table grows
+  // first if it has to, so if that fails nothing changes.
+  void relink(element_t& e, T& key) {
+    hash_block* b = e.block;
+    if ((b->used + 1) * 4 > b->capacity * 3) {
+      rehash(b->size + 1);
+    }
+    erase(&e);
+    using std::swap;
+    swap(e.val, key);
+    position pos;
+    locate(e.val, pos);
+    link_at(pos, e);
+  }
+
+  // Copies the entries of other as they are, map returns the copy of each of
+  // its elements. Nothing is hashed again. The table must be empty.
+  template <typename Map>
+  void clone(hash_table const& other, Map&& map) {
+    hash_block* b = other.header.table;
+    if (b == nullptr) {
+      return;
+    }
+    std::unique_ptr<hash_block> nb(
+        new hash_block{&header, b->capacity, b->shift, b->size, b->used});
+    nb->entries.reset(new hash_entry[b->capacity]);
+    for (std::size_t i = 0; i < b->capacity; i++) {
+      hash_entry const& en = b->entries[i];
+      nb->entries[i].hash = en.hash;
+      if (en.elem != nullptr) {
+        element_t* e = map(to_derived_ptr(en.elem));
+        nb->entries[i].elem = e;
+        e->block = nb.get();
+        e->slot = i;
+      }
+    }
+    header.table = nb.release();
+  }
+
+  template <typename K>
+  element_t* find(K const& x) const noexcept {
+    return header.table == nullptr ? nullptr : find(x, hash_of(x));
+  }
+
+  // Stores the element of keys[i] (or nullptr) to res[i] for i < n. The
+  // home entries of a group of keys are prefetched before any is probed.
+  template <typename It>
+  void find_many(It keys, std::size_t n, element_t** res) const noexcept {
+    constexpr std::size_t lanes = 16;
+    std::uint64_t hashes[lanes];
+    hash_block* b = header.table;
+    for (std::size_t from = 0; from < n; from += lanes) {
+      std::size_t count = std::min(lanes, n - from);
+      if (b == nullptr) {
+        std::fill(res + from, res + from + count, nullptr);
+        continue;
+      }
+      for (std::size_t j = 0; j < count; j++) {
+        hashes[j] = hash_of(keys[from + j]);
+        prefetch(&b->entries[hashes[j] >> b->shift]);
+      }
+      for (std::size_t j = 0; j < count; j++) {
+        res[from + j] = find(keys[from + j], hashes[j]);
+      }
+    }
+  }
+
+  // drops all elements without touching them, leaving the table empty
+  void release() noexcept {
+    delete header.table;
+    header.table = nullptr;
+  }
+
+  // calls f for every element and leaves the table empty, f may free the
+  // element
+  template <typename F>
+  void clear(F&& f) noexcept {
+    if (hash_block* b = header.table) {
+      for (std::size_t i = 0; i < b->capacity; i++) {
+        if (b->entries[i].elem != nullptr) {
+          f(to_derived_ptr(b->entries[i].elem));
+        }
+      }
+    }
+    release();
+  }
+
+  void erase(hash_element_base* e) noexcept {
+    hash_block* b = e->block;
+    std::size_t mask = b->capacity - 1;
+    std::size_t i = e->slot;
+    b->entries[i] = {hash_entry::deleted, nullptr};
+    b->size--;
+    // deleted entries right before an empty one end no probe sequence
+    if (is_empty(b->entries[(i + 1) & mask])) {
+      for (; b->entries[i].elem == nullptr &&
+             b->entries[i].hash == hash_entry::deleted;
+           i = (i - 1) & mask) {
+        b->entries[i].hash = hash_entry::empty;
+        b->used--;
+      }
+    }
+    e->block = nullptr;
+    e->slot = 0;
+  }
+
+  template <typename A, typename B>
+  bool equal(A const& a, B const& b) const noexcept {
+    return static_cast<KeyEqual const&>(*this)(a, b);
+  }
+
+  template <typename Left, typename Right, typename CompareLeft,
+            typename CompareRight, typename Allocator>
+  friend struct ::bimap;
+
+private:
+  hash_header header;
+
+  policy_t& get_cmp() {
+    return static_cast<policy_t&>(*this);
+  }
+
+  policy_t const& get_cmp() const {
+    return static_cast<policy_t const&>(*this);
+  }
+
+  // spreads the bits of weak hashes such as the identity for integers, the
+  // top bits select the home entry
+  template <typename K>
+  std::uint64_t hash_of(K const& x) const noexcept {
+    return static_cast<std::uint64_t>(static_cast<Hash const&>(*this)(x)) *
+           0x9E3779B97F4A7C15ull;
+  }
+
+  // the table must exist
+  template <typename K>
+  element_t* find(K const& x, std::uint64_t h) const noexcept {
+    hash_block* b = header.table;
+    for (std::size_t i = h >> b->shift;; i = (i + 1) & (b->capacity - 1)) {
+      hash_entry const& en = b->entries[i];
+      if (en.elem == nullptr) {
+        if (en.hash == hash_entry::empty) {
+          return nullptr;
+        }
+      } else if (en.hash == h && equal(value(en.elem), x)) {
+        return to_derived_ptr(en.elem);
+      }
+    }
+  }
+
+  static element_t* to_derived_ptr(hash_element_base* e) noexcept {
+    return static_cast<element_t*>(e);
+  }
+
+  static T const& value(hash_element_base const* e) noexcept {
+    return static_cast<element_t const*>(e)->val;
+  }
+
+  static bool is_empty(hash_entry const& en) noexcept {
+    return en.elem == nullptr && en.hash == hash_entry::empty;
+  }
+
+  static hash_element_base* first_from(hash_block* b, std::size_t i) noexcept {
+    for (; i < b->capacity; i++) {
+      if (b->entries[i].elem != nullptr) {
+        return b->entries[i].elem;
+      }
+    }
+    return b->header;
+  }
+
+  static std::size_t free_slot(hash_block* b, std::uint64_t h) noexcept {
+    std::size_t i = h >> b->shift;
+    while (b->entries[i].elem != nullptr) {
+      i = (i + 1) & (b->capacity - 1);
+    }
+    return i;
+  }
+
+  // moves the live elements to a table at most half full with size elements
+  void rehash(std::size_t size) {
+    std::size_t capacity = min_capacity;
+    unsigned shift = 64 - 3;
+    while (capacity < size * 2) {
+      capacity *= 2;
+      shift--;
+    }
+    std::unique_ptr<hash_block> nb(new hash_block{&header, capacity, shift});
+    nb->entries.reset(new hash_entry[capacity]);
+    if (hash_block* b = header.table) {
+      for (std::size_t i = 0; i < b->capacity; i++) {
+        hash_entry const& en = b->entries[i];
+        if (en.elem != nullptr) {
+          std::size_t j = free_slot(nb.get(), en.hash);
+          nb->entries[j] = en;
+          en.elem->block = nb.get();
+          en.elem->slot = j;
+        }
+      }
+      nb->size = nb->used = b->size;
+      delete b;
+    }
+    header.table = nb.release();
+  }
+};
+
+template <typename T, typename Tag, typename Hash, typename KeyEqual>
+struct index_traits<T, Tag, hash_index<Hash, KeyEqual>> {
+  using type = hash_table<T, Tag, Hash, KeyEqual>;
+};
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "frozen_bimap.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only bimap over a file written by frozen_bimap::write(). Opening it
+// maps the file and checks the header, lookups and iteration then read the
+// mapped pages directly, so nothing is parsed or allocated and the cost of
+// a start is the page faults of the first queries. Only the header is
+// checked, the arrays are trusted, and the comparators must order the keys
+// the way the ones of the writer did.
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct mapped_bimap
+    : details::frozen_view<Left, Right, CompareLeft, CompareRight> {
+  static_assert(std::is_trivially_copyable_v<Left> &&
+                    std::is_trivially_copyable_v<Right>,
+                "only trivially copyable keys can be mapped");
+  static_assert(alignof(Left) <= details::frozen_file_header::alignment &&
+                    alignof(Right) <= details::frozen_file_header::alignment,
+                "keys are aligned to at most 64 bytes in the file");
+
+  using view_t = details::frozen_view<Left, Right, CompareLeft, CompareRight>;
+  using left_t = Left;
+  using right_t = Right;
+
+  explicit mapped_bimap(char const* path,
+                        CompareLeft compare_left = CompareLeft(),
+                        CompareRight compare_right = CompareRight())
+      : view_t(compare_left, compare_right) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      int err = errno;
+      ::close(fd);
+      throw std::system_error(err, std::generic_category(), path);
+    }
+    length = static_cast<std::size_t>(st.st_size);
+    if (length < sizeof(details::frozen_file_header)) {
+      ::close(fd);
+      throw std::runtime_error("not a frozen bimap file");
+    }
+    void* p = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    int err = errno;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      throw std::system_error(err, std::generic_category(), path);
+    }
+    data = static_cast<char const*>(p);
+    try {
+      attach();
+    } catch (...) {
+      ::munmap(p, length);
+      throw;
+    }
+  }
+
+  mapped_bimap(mapped_bimap&& other) noexcept
+      : view_t(other), data(std::exchange(other.data, nullptr)),
+        length(std::exchange(other.length, 0)) {
+    other.left_side.n = other.right_side.n = 0;
+  }
+
+  mapped_bimap(mapped_bimap const&) = delete;
+  mapped_bimap& operator=(mapped_bimap const&) = delete;
+  mapped_bimap& operator=(mapped_bimap&&) = delete;
+
+  ~mapped_bimap() {
+    if (data != nullptr) {
+      ::munmap(const_cast<char*>(data), length);
+    }
+  }
+
+private:
+  char const* data{nullptr};
+  std::size_t length{0};
+
+  // checks the header and points the sides into the mapping
+  void attach() {
+    using header_t = details::frozen_file_header;
+    header_t header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, header_t::signature, sizeof(header.magic)) !=
+            0 ||
+        header.version != header_t::current_version ||
+        header.byte_order != header_t::byte_order_mark ||
+        header.left_size != sizeof(Left) ||
+        header.right_size != sizeof(Right) || header.count > UINT32_MAX ||
+        header.file_size != length) {
+      throw std::runtime_error("not a frozen bimap file of these types");
+    }
+    std::size_t sizes[4] = {sizeof(Left), sizeof(std::uint32_t),
+                            sizeof(Right), sizeof(std::uint32_t)};
+    for (int i = 0; i < 4; i++) {
+      if (header.offsets[i] % header_t::alignment != 0 ||
+          header.offsets[i] > length ||
+          (length - header.offsets[i]) / sizes[i] < header.count) {
+        throw std::runtime_error("corrupted frozen bimap file");
+      }
+    }
+    auto n = static_cast<std::uint32_t>(header.count);
+    this->left_side.keys =
+        reinterpret_cast<Left const*>(data + header.offsets[0]);
+    this->left_side.cross =
+        reinterpret_cast<std::uint32_t const*>(data + header.offsets[1]);
+    this->left_side.n = n;
+    this->right_side.keys =
+        reinterpret_cast<Right const*>(data + header.offsets[2]);
+    this->right_side.cross =
+        reinterpret_cast<std::uint32_t const*>(data + header.offsets[3]);
+    this->right_side.n = n;
+  }
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace details {
+
+// Nodes of a single map, allocated from chunks that are aligned to their
+// size. Anything inside a chunk finds the chunk, and so the arena, by
+// masking its address. Positions in the arena are named by 32-bit ids that
+// count 4-byte units from the start of the first chunk, id 0 is never used.
+struct node_arena {
+  static constexpr unsigned chunk_shift = 16;
+  static constexpr std::size_t chunk_bytes = std::size_t(1) << chunk_shift;
+  static constexpr unsigned unit_shift = 2;
+  static constexpr unsigned id_chunk_shift = chunk_shift - unit_shift;
+  static constexpr std::uint32_t id_offset_mask =
+      (std::uint32_t(1) << id_chunk_shift) - 1;
+  // the last chunk number is left out, so ids near 2^32 are free for marks
+  static constexpr std::size_t max_chunks =
+      (std::size_t(1) << (32 - id_chunk_shift)) - 1;
+
+  struct chunk_header {
+    node_arena* arena;
+    std::uint32_t number;
+  };
+
+  node_arena(std::size_t node_size, std::size_t node_align) noexcept
+      : stride(round_up(node_size, std::max(node_align, alignof(void*)))),
+        first(round_up(sizeof(chunk_header),
+                       std::max(node_align, alignof(void*)))) {}
+
+  node_arena(node_arena const&) = delete;
+  node_arena& operator=(node_arena const&) = delete;
+
+  ~node_arena() {
+    for (char* c : chunks) {
+      ::operator delete(c, std::align_val_t(chunk_bytes));
+    }
+  }
+
+  void* allocate() {
+    if (free_list != nullptr) {
+      return std::exchange(free_list, *static_cast<void**>(free_list));
+    }
+    if (bump == bump_end) {
+      add_chunk();
+    }
+    return std::exchange(bump, bump + stride);
+  }
+
+  void deallocate(void* p) noexcept {
+    *static_cast<void**>(p) = free_list;
+    free_list = p;
+  }
+
+  static node_arena& of(void const* p) noexcept {
+    return *chunk_of(p)->arena;
+  }
+
+  static std::uint32_t id(void const* p) noexcept {
+    auto a = reinterpret_cast<std::uintptr_t>(p);
+    return chunk_of(p)->number << id_chunk_shift |
+           static_cast<std::uint32_t>((a & (chunk_bytes - 1)) >> unit_shift);
+  }
+
+  void* at(std::uint32_t id) const noexcept {
+    return chunks[id >> id_chunk_shift] +
+           (static_cast<std::size_t>(id & id_offset_mask) << unit_shift);
+  }
+
+  // ends of the indexes of the map, one per side
+  void* ends[2]{nullptr, nullptr};
+
+private:
+  std::size_t stride;
+  std::size_t first;
+  std::vector<char*> chunks;
+  void* free_list{nullptr};
+  char* bump{nullptr};
+  char* bump_end{nullptr};
+
+  static constexpr std::size_t round_up(std::size_t x, std::size_t a) noexcept {
+    return (x + a - 1) / a * a;
+  }
+
+  static chunk_header* chunk_of(void const* p) noexcept {
+    return reinterpret_cast<chunk_header*>(reinterpret_cast<std::uintptr_t>(p) &
+                                           ~(chunk_bytes - 1));
+  }
+
+  void add_chunk() {
+    if (chunks.size() == max_chunks) {
+      throw std::bad_alloc();
+    }
+    // grown before operator new, so that push_back below cannot throw
+    if (chunks.size() == chunks.capacity()) {
+      chunks.reserve(
+          std::min(max_chunks, std::max<std::size_t>(8, 2 * chunks.size())));
+    }
+    char* c = static_cast<char*>(
+        ::operator new(chunk_bytes, std::align_val_t(chunk_bytes)));
+    new (c) chunk_header{this, static_cast<std::uint32_t>(chunks.size())};
+    chunks.push_back(c);
+    bump = c + first;
+    bump_end = bump + (chunk_bytes - first) / stride * stride;
+  }
+};
+
+// Allocates the nodes of one map from an arena of its own. A copy starts
+// with an empty arena, the allocator passed to the map is not used.
+template <typename T>
+struct arena_allocator {
+  using value_type = T;
+
+  static_assert(sizeof(T) * 16 <= node_arena::chunk_bytes,
+                "compact nodes must be small");
+
+  arena_allocator() noexcept = default;
+
+  template <typename Allocator>
+  explicit arena_allocator(Allocator const&) noexcept {}
+
+  arena_allocator(arena_allocator const&) noexcept {}
+  arena_allocator(arena_allocator&&) noexcept = default;
+  arena_allocator& operator=(arena_allocator&&) noexcept = default;
+
+  T* allocate(std::size_t) {
+    if (arena == nullptr) {
+      arena = std::make_unique<node_arena>(sizeof(T), alignof(T));
+    }
+    return static_cast<T*>(arena->allocate());
+  }
+
+  void deallocate(T* p, std::size_t) noexcept {
+    node_arena::of(p).deallocate(p);
+  }
+
+private:
+  std::unique_ptr<node_arena> arena;
+};
+}
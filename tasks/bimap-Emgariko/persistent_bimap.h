@@ -0,0 +1,579 @@
+#pragma once
+
+#include "treap.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace details {
+
+// A pair shared by every version that holds it and by both of their trees.
+// Nothing is ever changed after construction, so readers need no locks.
+template <typename Left, typename Right>
+struct persistent_pair {
+  template <typename L, typename R>
+  persistent_pair(L&& left_, R&& right_)
+      : left(std::forward<L>(left_)), right(std::forward<R>(right_)),
+        prior(random_priority::next()) {}
+
+  Left left;
+  Right right;
+  std::uint32_t prior;
+  mutable std::atomic<std::size_t> refs{1};
+};
+
+template <typename Pair>
+struct persistent_node {
+  persistent_node const* child[2];
+  Pair const* pair;
+  mutable std::atomic<std::size_t> refs{1};
+};
+
+template <typename T>
+T const* acquire(T const* p) noexcept {
+  if (p != nullptr) {
+    p->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  return p;
+}
+
+template <typename T>
+bool unref(T const* p) noexcept {
+  return p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+
+// Treap of one side of a persistent bimap. Updates copy the nodes on the
+// paths they touch and share the rest with older versions, every node
+// holds a reference to its children and to its pair.
+template <typename Left, typename Right, typename Tag, typename Compare>
+struct persistent_tree : Compare {
+  using pair_t = persistent_pair<Left, Right>;
+  using node_t = persistent_node<pair_t>;
+  using key_type =
+      std::conditional_t<std::is_same_v<Tag, left_tag>, Left, Right>;
+  using path_t = std::vector<node_t const*>;
+
+  explicit persistent_tree(Compare const& cmp) : Compare(cmp) {}
+
+  persistent_tree(persistent_tree const& other)
+      : Compare(other.get_cmp()), root(acquire(other.root)) {}
+
+  persistent_tree& operator=(persistent_tree const&) = delete;
+
+  ~persistent_tree() {
+    release(root);
+  }
+
+  static key_type const& key(pair_t const* p) noexcept {
+    if constexpr (std::is_same_v<Tag, left_tag>) {
+      return p->left;
+    } else {
+      return p->right;
+    }
+  }
+
+  template <typename A, typename B>
+  bool less(A const& a, B const& b) const {
+    return get_cmp()(a, b);
+  }
+
+  template <typename K>
+  pair_t const* find(K const& x) const {
+    node_t const* t = root;
+    while (t != nullptr) {
+      if (less(x, key(t->pair))) {
+        t = t->child[0];
+      } else if (less(key(t->pair), x)) {
+        t = t->child[1];
+      } else {
+        return t->pair;
+      }
+    }
+    return nullptr;
+  }
+
+  // stores the path from the root to the first element not less than x
+  // (or greater than x for upper), empty if there is none
+  template <typename K>
+  void bound(K const& x, bool upper, path_t& path) const {
+    path.clear();
+    std::size_t found = 0;
+    for (node_t const* t = root; t != nullptr;) {
+      path.push_back(t);
+      if (upper ? less(x, key(t->pair)) : !less(key(t->pair), x)) {
+        found = path.size();
+        t = t->child[0];
+      } else {
+        t = t->child[1];
+      }
+    }
+    path.resize(found);
+  }
+
+  // extends the path to the extreme element of the subtree of t
+  static void descend(node_t const* t, bool to_right, path_t& path) {
+    for (; t != nullptr; t = t->child[to_right]) {
+      path.push_back(t);
+    }
+  }
+
+  // moves the path to the next element (or the previous one for back),
+  // leaves it empty when stepping off the end
+  static void step(path_t& path, bool back) {
+    if (node_t const* c = path.back()->child[!back]; c != nullptr) {
+      path.push_back(c);
+      descend(c->child[back], back, path);
+      return;
+    }
+    node_t const* from = path.back();
+    path.pop_back();
+    while (!path.empty() && path.back()->child[!back] == from) {
+      from = path.back();
+      path.pop_back();
+    }
+  }
+
+  node_t const* get_root() const noexcept {
+    return root;
+  }
+
+  // the key of p must not be present yet
+  void insert(pair_t const* p) {
+    node_t const* old = std::exchange(root, insert(root, p));
+    release(old);
+  }
+
+  // the key must be present
+  template <typename K>
+  void erase(K const& x) {
+    node_t const* old = std::exchange(root, erase(root, x));
+    release(old);
+  }
+
+  static void release(node_t const* t) noexcept {
+    while (t != nullptr && unref(t)) {
+      release(t->child[0]);
+      if (unref(t->pair)) {
+        delete t->pair;
+      }
+      node_t const* right = t->child[1];
+      delete t;
+      t = right;
+    }
+  }
+
+private:
+  node_t const* root{nullptr};
+
+  Compare const& get_cmp() const noexcept {
+    return static_cast<Compare const&>(*this);
+  }
+
+  // takes over l and r, which are released if the node can not be made
+  static node_t const* make(node_t const* l, pair_t const* p,
+                            node_t const* r) {
+    try {
+      return new node_t{{l, r}, acquire(p)};
+    } catch (...) {
+      release(l);
+      release(r);
+      throw;
+    }
+  }
+
+  // copy of t with one of the children replaced by c, which it takes over
+  static node_t const* with_child(node_t const* t, bool side,
+                                  node_t const* c) {
+    node_t const* other = acquire(t->child[!side]);
+    return side ? make(other, t->pair, c) : make(c, t->pair, other);
+  }
+
+  // The functions below only read their arguments and return new trees.
+
+  // lo gets the keys less than x, hi the rest
+  void split(node_t const* t, key_type const& x, node_t const*& lo,
+             node_t const*& hi) const {
+    if (t == nullptr) {
+      lo = hi = nullptr;
+    } else if (less(key(t->pair), x)) {
+      node_t const* mid;
+      split(t->child[1], x, mid, hi);
+      try {
+        lo = with_child(t, true, mid);
+      } catch (...) {
+        release(hi);
+        throw;
+      }
+    } else {
+      node_t const* mid;
+      split(t->child[0], x, lo, mid);
+      try {
+        hi = with_child(t, false, mid);
+      } catch (...) {
+        release(lo);
+        throw;
+      }
+    }
+  }
+
+  static node_t const* merge(node_t const* a, node_t const* b) {
+    if (a == nullptr || b == nullptr) {
+      return acquire(a == nullptr ? b : a);
+    }
+    if (a->pair->prior > b->pair->prior) {
+      return with_child(a, true, merge(a->child[1], b));
+    }
+    return with_child(b, false, merge(a, b->child[0]));
+  }
+
+  node_t const* insert(node_t const* t, pair_t const* p) const {
+    if (t == nullptr || p->prior > t->pair->prior) {
+      node_t const *lo, *hi;
+      split(t, key(p), lo, hi);
+      return make(lo, p, hi);
+    }
+    bool side = !less(key(p), key(t->pair));
+    return with_child(t, side, insert(t->child[side], p));
+  }
+
+  template <typename K>
+  node_t const* erase(node_t const* t, K const& x) const {
+    if (less(x, key(t->pair))) {
+      return with_child(t, false, erase(t->child[0], x));
+    }
+    if (less(key(t->pair), x)) {
+      return with_child(t, true, erase(t->child[1], x));
+    }
+    return merge(t->child[0], t->child[1]);
+  }
+};
+
+template <typename Left, typename Right, typename CompareLeft,
+          typename CompareRight>
+struct persistent_version {
+  persistent_version(CompareLeft const& compare_left,
+                     CompareRight const& compare_right)
+      : left(compare_left), right(compare_right) {}
+
+  persistent_tree<Left, Right, left_tag, CompareLeft> left;
+  persistent_tree<Left, Right, right_tag, CompareRight> right;
+  std::size_t sz{0};
+};
+}
+
+// An immutable version of a persistent_bimap. It may be read from any
+// thread, its iterators stay valid as long as the snapshot itself.
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct bimap_snapshot {
+  using left_t = Left;
+  using right_t = Right;
+  using version_t =
+      details::persistent_version<Left, Right, CompareLeft, CompareRight>;
+
+  template <typename value, typename Tag>
+  struct iterator {
+    static constexpr bool is_left = std::is_same_v<Tag, details::left_tag>;
+    using tree_t = std::conditional_t<is_left, decltype(version_t::left),
+                                      decltype(version_t::right)>;
+
+    value const& operator*() const noexcept {
+      return tree_t::key(path.back()->pair);
+    }
+
+    value const* operator->() const noexcept {
+      return &**this;
+    }
+
+    iterator& operator++() {
+      tree_t::step(path, false);
+      return *this;
+    }
+
+    iterator operator++(int) {
+      iterator res = *this;
+      ++*this;
+      return res;
+    }
+
+    // decrementing the end iterator gives the last element
+    iterator& operator--() {
+      if (path.empty()) {
+        tree_t::descend(tree().get_root(), true, path);
+      } else {
+        tree_t::step(path, true);
+      }
+      return *this;
+    }
+
+    iterator operator--(int) {
+      iterator res = *this;
+      --*this;
+      return res;
+    }
+
+    using other_tag =
+        std::conditional_t<is_left, details::right_tag, details::left_tag>;
+    using other_t = std::conditional_t<is_left, right_t, left_t>;
+    using other_it = iterator<other_t, other_tag>;
+
+    // takes O(log n), the pair is looked up in the other tree
+    other_it flip() const {
+      other_it res(version);
+      if (!path.empty()) {
+        res.tree().bound(other_it::tree_t::key(path.back()->pair), false,
+                         res.path);
+      }
+      return res;
+    }
+
+    bool operator==(iterator const& other) const noexcept {
+      return (path.empty() ? nullptr : path.back()) ==
+             (other.path.empty() ? nullptr : other.path.back());
+    }
+
+    bool operator!=(iterator const& other) const noexcept {
+      return !(*this == other);
+    }
+
+    friend bimap_snapshot;
+
+    template <typename, typename>
+    friend struct iterator;
+
+  private:
+    explicit iterator(version_t const* version_) noexcept
+        : version(version_) {}
+
+    tree_t const& tree() const noexcept {
+      if constexpr (is_left) {
+        return version->left;
+      } else {
+        return version->right;
+      }
+    }
+
+    version_t const* version;
+    typename tree_t::path_t path;
+  };
+
+  using left_iterator = iterator<left_t, details::left_tag>;
+  using right_iterator = iterator<right_t, details::right_tag>;
+
+  bimap_snapshot() = default;
+
+  explicit bimap_snapshot(std::shared_ptr<version_t const> version_) noexcept
+      : version(std::move(version_)) {}
+
+  left_iterator find_left(left_t const& left) const {
+    return find<left_iterator>(left);
+  }
+
+  right_iterator find_right(right_t const& right) const {
+    return find<right_iterator>(right);
+  }
+
+  right_t const& at_left(left_t const& key) const {
+    if (version != nullptr) {
+      if (auto p = version->left.find(key); p != nullptr) {
+        return p->right;
+      }
+    }
+    throw std::out_of_range("no such element");
+  }
+
+  left_t const& at_right(right_t const& key) const {
+    if (version != nullptr) {
+      if (auto p = version->right.find(key); p != nullptr) {
+        return p->left;
+      }
+    }
+    throw std::out_of_range("no such element");
+  }
+
+  left_iterator lower_bound_left(left_t const& left) const {
+    return bound<left_iterator>(left, false);
+  }
+
+  left_iterator upper_bound_left(left_t const& left) const {
+    return bound<left_iterator>(left, true);
+  }
+
+  right_iterator lower_bound_right(right_t const& right) const {
+    return bound<right_iterator>(right, false);
+  }
+
+  right_iterator upper_bound_right(right_t const& right) const {
+    return bound<right_iterator>(right, true);
+  }
+
+  left_iterator begin_left() const {
+    return begin<left_iterator>();
+  }
+
+  left_iterator end_left() const noexcept {
+    return left_iterator(version.get());
+  }
+
+  right_iterator begin_right() const {
+    return begin<right_iterator>();
+  }
+
+  right_iterator end_right() const noexcept {
+    return right_iterator(version.get());
+  }
+
+  bool empty() const noexcept {
+    return size() == 0;
+  }
+
+  std::size_t size() const noexcept {
+    return version == nullptr ? 0 : version->sz;
+  }
+
+private:
+  std::shared_ptr<version_t const> version;
+
+  template <typename It>
+  It begin() const {
+    It res(version.get());
+    if (version != nullptr) {
+      It::tree_t::descend(res.tree().get_root(), false, res.path);
+    }
+    return res;
+  }
+
+  template <typename It, typename K>
+  It bound(K const& x, bool upper) const {
+    It res(version.get());
+    if (version != nullptr) {
+      res.tree().bound(x, upper, res.path);
+    }
+    return res;
+  }
+
+  template <typename It, typename K>
+  It find(K const& x) const {
+    It res = bound<It>(x, false);
+    if (res.path.empty() ||
+        res.tree().less(x, It::tree_t::key(res.path.back()->pair))) {
+      res.path.clear();
+    }
+    return res;
+  }
+};
+
+// A bimap for one writer and any number of readers. Each update copies
+// O(log n) nodes of the current version and publishes the new one
+// atomically. snapshot() takes O(1) and gives an immutable version that
+// readers traverse without locks, while the writer goes on updating.
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct persistent_bimap {
+  using left_t = Left;
+  using right_t = Right;
+  using snapshot_t = bimap_snapshot<Left, Right, CompareLeft, CompareRight>;
+  using version_t = typename snapshot_t::version_t;
+  using pair_t = details::persistent_pair<Left, Right>;
+
+  explicit persistent_bimap(CompareLeft compare_left = CompareLeft(),
+                            CompareRight compare_right = CompareRight())
+      : current(std::make_shared<version_t const>(compare_left,
+                                                  compare_right)) {}
+
+  // the copy shares all the pairs with other until either is updated
+  persistent_bimap(persistent_bimap const& other)
+      : current(other.load()) {}
+
+  persistent_bimap& operator=(persistent_bimap const& other) {
+    publish(other.load());
+    return *this;
+  }
+
+  // may be called from any thread
+  snapshot_t snapshot() const noexcept {
+    return snapshot_t(load());
+  }
+
+  // The functions below are for the writer, only one thread may call them.
+
+  bool insert(left_t left, right_t right) {
+    if (current->left.find(left) != nullptr ||
+        current->right.find(right) != nullptr) {
+      return false;
+    }
+    auto next = std::make_shared<version_t>(*current);
+    pair_t const* p = new pair_t(std::move(left), std::move(right));
+    try {
+      next->left.insert(p);
+      next->right.insert(p);
+    } catch (...) {
+      // the trees that took p hold references to it, next frees them
+      if (details::unref(p)) {
+        delete p;
+      }
+      throw;
+    }
+    details::unref(p);
+    next->sz++;
+    publish(std::move(next));
+    return true;
+  }
+
+  bool erase_left(left_t const& left) {
+    pair_t const* p = current->left.find(left);
+    if (p == nullptr) {
+      return false;
+    }
+    erase(p);
+    return true;
+  }
+
+  bool erase_right(right_t const& right) {
+    pair_t const* p = current->right.find(right);
+    if (p == nullptr) {
+      return false;
+    }
+    erase(p);
+    return true;
+  }
+
+  void clear() {
+    publish(std::make_shared<version_t const>(current->left, current->right));
+  }
+
+  bool empty() const noexcept {
+    return current->sz == 0;
+  }
+
+  std::size_t size() const noexcept {
+    return current->sz;
+  }
+
+private:
+  // only the writer stores it, readers go through load()
+  std::shared_ptr<version_t const> current;
+
+  std::shared_ptr<version_t const> load() const noexcept {
+    return std::atomic_load_explicit(&current, std::memory_order_acquire);
+  }
+
+  void publish(std::shared_ptr<version_t const> next) noexcept {
+    std::atomic_store_explicit(&current, std::move(next),
+                               std::memory_order_release);
+  }
+
+  void erase(pair_t const* p) {
+    auto next = std::make_shared<version_t>(*current);
+    next->left.erase(p->left);
+    next->right.erase(p->right);
+    next->sz--;
+    publish(std::move(next));
+  }
+};
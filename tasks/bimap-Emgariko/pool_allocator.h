@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace details {
+
+// Hands out single objects from contiguous chunks and recycles freed ones
+// through per-thread free lists. Chunks are shared by the whole process and
+// kept for reuse, so all instances are interchangeable and objects allocated
+// by one container may be released by another. A thread keeps at most
+// 2 * batch_size freed objects, the rest goes back to a shared free list in
+// batches, so objects freed by one thread are reused by the others.
+//
+// Chunks are never returned to the system: destroying or clearing a
+// container keeps the peak number of objects of each type allocated until
+// the process exits. This suits long-lived maps that churn nodes, not maps
+// that are built once and dropped.
+template <typename T>
+struct pool_allocator {
+  using value_type = T;
+  using is_always_equal = std::true_type;
+
+  static constexpr std::size_t min_chunk_size = 16;
+  static constexpr std::size_t max_chunk_size = 4096;
+  static constexpr std::size_t batch_size = 256;
+
+  pool_allocator() noexcept = default;
+
+  template <typename U>
+  pool_allocator(pool_allocator<U> const&) noexcept {}
+
+  T* allocate(std::size_t n) {
+    if (n != 1) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    local_pool& pool = get_local_pool();
+    if (pool.free_list == nullptr && pool.bump == pool.bump_end) {
+      refill(pool);
+    }
+    slot* res;
+    if (pool.free_list != nullptr) {
+      res = pool.free_list;
+      pool.free_list = res->next;
+      pool.free_count--;
+    } else {
+      res = pool.bump++;
+    }
+    return reinterpret_cast<T*>(res);
+  }
+
+  void deallocate(T* ptr, std::size_t n) noexcept {
+    if (n != 1) {
+      ::operator delete(ptr);
+      return;
+    }
+    local_pool& pool = get_local_pool();
+    slot* s = reinterpret_cast<slot*>(ptr);
+    s->next = pool.free_list;
+    pool.free_list = s;
+    if (++pool.free_count > 2 * batch_size) {
+      give_back(pool);
+    }
+  }
+
+  // slots in all chunks allocated so far
+  static std::size_t capacity() {
+    shared_pool& shared = get_shared_pool();
+    std::lock_guard<std::mutex> lg(shared.m);
+    return shared.capacity;
+  }
+
+  friend bool operator==(pool_allocator const&, pool_allocator const&) noexcept {
+    return true;
+  }
+
+  friend bool operator!=(pool_allocator const&, pool_allocator const&) noexcept {
+    return false;
+  }
+
+private:
+  union slot {
+    slot* next;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  // trivially destructible, so it stays usable for objects released during
+  // static destruction after the thread's flush_guard is gone
+  struct local_pool {
+    slot* free_list;
+    slot* bump;
+    slot* bump_end;
+    std::size_t free_count;
+    std::size_t next_chunk_size;
+  };
+
+  struct shared_pool {
+    std::mutex m;
+    // the first slot of every chunk links it to the previously allocated one
+    slot* chunks{nullptr};
+    // slots given back by threads with too many and by finished ones
+    slot* free_list{nullptr};
+    std::size_t capacity{0};
+  };
+
+  struct flush_guard {
+    ~flush_guard() {
+      local_pool& pool = get_local_pool();
+      for (; pool.bump != pool.bump_end; pool.bump++) {
+        pool.bump->next = pool.free_list;
+        pool.free_list = pool.bump;
+      }
+      if (pool.free_list != nullptr) {
+        slot* last = pool.free_list;
+        while (last->next != nullptr) {
+          last = last->next;
+        }
+        shared_pool& shared = get_shared_pool();
+        std::lock_guard<std::mutex> lg(shared.m);
+        last->next = shared.free_list;
+        shared.free_list = pool.free_list;
+      }
+      pool = local_pool{};
+    }
+  };
+
+  static local_pool& get_local_pool() noexcept {
+    thread_local local_pool pool{};
+    thread_local flush_guard guard;
+    return pool;
+  }
+
+  static shared_pool& get_shared_pool() {
+    // never destroyed: chunks may still be in use during static destruction
+    static shared_pool* shared = new shared_pool();
+    return *shared;
+  }
+
+  // Keeps the batch_size most recently freed slots and moves the older ones
+  // to the shared free list.
+  static void give_back(local_pool& pool) noexcept {
+    slot* kept_last = pool.free_list;
+    for (std::size_t i = 1; i < batch_size; i++) {
+      kept_last = kept_last->next;
+    }
+    slot* first = std::exchange(kept_last->next, nullptr);
+    slot* last = first;
+    while (last->next != nullptr) {
+      last = last->next;
+    }
+    pool.free_count = batch_size;
+    shared_pool& shared = get_shared_pool();
+    std::lock_guard<std::mutex> lg(shared.m);
+    last->next = shared.free_list;
+    shared.free_list = first;
+  }
+
+  // takes up to batch_size slots from the shared free list, or a new chunk
+  static void refill(local_pool& pool) {
+    shared_pool& shared = get_shared_pool();
+    std::lock_guard<std::mutex> lg(shared.m);
+    if (shared.free_list != nullptr) {
+      slot* last = shared.free_list;
+      std::size_t taken = 1;
+      for (; taken < batch_size && last->next != nullptr; taken++) {
+        last = last->next;
+      }
+      pool.free_list = std::exchange(shared.free_list, last->next);
+      last->next = nullptr;
+      pool.free_count = taken;
+      return;
+    }
+    std::size_t size = std::max(pool.next_chunk_size, min_chunk_size);
+    slot* chunk = new slot[size];
+    chunk->next = shared.chunks;
+    shared.chunks = chunk;
+    shared.capacity += size - 1;
+    pool.bump = chunk + 1;
+    pool.bump_end = chunk + size;
+    pool.next_chunk_size = std::min(size * 2, max_chunk_size);
+  }
+};
+}
+
+// Opt-in node allocator of bimap, e.g.
+// bimap<int, int, std::less<int>, std::less<int>, pool_allocator<...>>.
+// Its memory lives until the process exits, see details::pool_allocator.
+template <typename T>
+using pool_allocator = details::pool_allocator<T>;
@@ -0,0 +1,531 @@
+#pragma once
+
+#include "bimap.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// A bimap for maps that mostly stay small. Up to N pairs are kept in the
+// object itself together with two arrays of their slot numbers, one sorted
+// by the left keys and one by the right keys, so a small map allocates
+// nothing and a lookup is a binary search over at most N keys. Inserting
+// into a full map moves the pairs into a bimap, which is used from then on
+// until clear(). Iterators work the same way in both modes and stay valid
+// like those of bimap, except that the switch invalidates them.
+template <typename Left, typename Right, std::size_t N = 16,
+          typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct small_bimap {
+  static_assert(N > 0 && N <= 64, "used slots are kept in a 64-bit mask");
+
+  using left_t = Left;
+  using right_t = Right;
+  using bimap_t = bimap<Left, Right, CompareLeft, CompareRight>;
+  static constexpr std::size_t inline_capacity = N;
+
+  template <bool is_left>
+  struct iterator {
+    using value = std::conditional_t<is_left, left_t, right_t>;
+    using big_iterator =
+        std::conditional_t<is_left, typename bimap_t::left_iterator,
+                           typename bimap_t::right_iterator>;
+
+    iterator() = delete;
+
+    value const &operator*() const noexcept {
+      if (map->spilled) {
+        return *big;
+      }
+      return map->template key<is_left>(slot);
+    }
+
+    value const *operator->() const noexcept {
+      return &**this;
+    }
+
+    iterator &operator++() noexcept {
+      if (map->spilled) {
+        ++big;
+      } else {
+        *this = map->template at<is_left>(rank() + 1);
+      }
+      return *this;
+    }
+
+    iterator operator++(int) noexcept {
+      iterator res = *this;
+      ++*this;
+      return res;
+    }
+
+    iterator &operator--() noexcept {
+      if (map->spilled) {
+        --big;
+      } else {
+        *this = map->template at<is_left>(rank() - 1);
+      }
+      return *this;
+    }
+
+    iterator operator--(int) noexcept {
+      iterator res = *this;
+      --*this;
+      return res;
+    }
+
+    // the end of one side flips to the end of the other one, as for bimap
+    iterator<!is_left> flip() const noexcept {
+      if (map->spilled) {
+        return iterator<!is_left>(map, end_slot, 0, big.flip());
+      }
+      return iterator<!is_left>(map, slot, 0,
+                                map->template big_end<!is_left>());
+    }
+
+    bool operator==(iterator const &other) const noexcept {
+      return slot == other.slot && big == other.big;
+    }
+
+    bool operator!=(iterator const &other) const noexcept {
+      return !(*this == other);
+    }
+
+    friend small_bimap;
+    template <bool>
+    friend struct iterator;
+
+  private:
+    static constexpr std::size_t side = is_left ? 0 : 1;
+
+    iterator(small_bimap const *map_, std::uint8_t slot_, std::size_t pos_,
+             big_iterator big_) noexcept
+        : map(map_), slot(slot_), pos(pos_), big(big_) {}
+
+    // rank of the pair on this side, pos is right unless the map changed
+    std::size_t rank() const noexcept {
+      std::uint8_t const *order = map->orders[side];
+      if (pos < map->count && order[pos] == slot) {
+        return pos;
+      }
+      return std::find(order, order + map->count, slot) - order;
+    }
+
+    small_bimap const *map;
+    // the pair while the map is small, end_slot for the end
+    std::uint8_t slot;
+    std::size_t pos;
+    big_iterator big;
+  };
+
+  using left_iterator = iterator<true>;
+  using right_iterator = iterator<false>;
+
+  explicit small_bimap(CompareLeft compare_left_ = CompareLeft(),
+                       CompareRight compare_right_ = CompareRight())
+      : compare_left(std::move(compare_left_)),
+        compare_right(std::move(compare_right_)),
+        big(compare_left, compare_right) {}
+
+  small_bimap(small_bimap const &other)
+      : compare_left(other.compare_left), compare_right(other.compare_right),
+        big(other.big), spilled(other.spilled) {
+    copy_orders(other);
+    try {
+      for (; count < other.count; count++) {
+        std::uint8_t slot = orders[0][count];
+        new (slots() + slot) pair_t(other.slots()[slot]);
+        used |= std::uint64_t(1) << slot;
+      }
+    } catch (...) {
+      destroy_inline();
+      throw;
+    }
+  }
+
+  small_bimap(small_bimap &&other) noexcept(
+      std::is_nothrow_move_constructible_v<std::pair<Left, Right>>)
+      : compare_left(other.compare_left), compare_right(other.compare_right),
+        big(std::move(other.big)), spilled(other.spilled) {
+    take(other);
+  }
+
+  small_bimap &operator=(small_bimap const &other) {
+    if (this != &other) {
+      small_bimap tmp(other);
+      *this = std::move(tmp);
+    }
+    return *this;
+  }
+
+  small_bimap &operator=(small_bimap &&other) noexcept(
+      std::is_nothrow_move_constructible_v<std::pair<Left, Right>>) {
+    if (this != &other) {
+      clear();
+      compare_left = other.compare_left;
+      compare_right = other.compare_right;
+      big = std::move(other.big);
+      spilled = other.spilled;
+      take(other);
+    }
+    return *this;
+  }
+
+  ~small_bimap() {
+    destroy_inline();
+  }
+
+  template <typename left_t_ = left_t, typename right_t_ = right_t>
+  left_iterator insert(left_t_ &&left, right_t_ &&right) {
+    if (!spilled) {
+      std::size_t left_pos = lower_bound<true>(left);
+      std::size_t right_pos = lower_bound<false>(right);
+      if (matches<true>(left_pos, left) || matches<false>(right_pos, right)) {
+        return end_left();
+      }
+      if (count < N) {
+        std::uint8_t slot = 0;
+        while (used >> slot & 1) {
+          slot++;
+        }
+        new (slots() + slot)
+            pair_t(std::forward<left_t_>(left), std::forward<right_t_>(right));
+        used |= std::uint64_t(1) << slot;
+        insert_at(orders[0], left_pos, slot);
+        insert_at(orders[1], right_pos, slot);
+        count++;
+        return at<true>(left_pos);
+      }
+      spill();
+    }
+    return left_iterator(this, end_slot, 0,
+        big.insert(std::forward<left_t_>(left), std::forward<right_t_>(right)));
+  }
+
+  left_iterator erase_left(left_iterator it) noexcept {
+    if (spilled) {
+      return left_iterator(this, end_slot, 0, big.erase_left(it.big));
+    }
+    std::size_t pos = it.rank();
+    remove_slot(it.slot);
+    return at<true>(pos);
+  }
+
+  bool erase_left(left_t const &left) noexcept {
+    left_iterator it = find_left(left);
+    if (it == end_left()) {
+      return false;
+    }
+    erase_left(it);
+    return true;
+  }
+
+  right_iterator erase_right(right_iterator it) noexcept {
+    if (spilled) {
+      return right_iterator(this, end_slot, 0, big.erase_right(it.big));
+    }
+    std::size_t pos = it.rank();
+    remove_slot(it.slot);
+    return at<false>(pos);
+  }
+
+  bool erase_right(right_t const &right) noexcept {
+    right_iterator it = find_right(right);
+    if (it == end_right()) {
+      return false;
+    }
+    erase_right(it);
+    return true;
+  }
+
+  left_iterator find_left(left_t const &left) const noexcept {
+    if (spilled) {
+      return left_iterator(this, end_slot, 0, big.find_left(left));
+    }
+    std::size_t pos = lower_bound<true>(left);
+    return at<true>(matches<true>(pos, left) ? pos : count);
+  }
+
+  right_iterator find_right(right_t const &right) const noexcept {
+    if (spilled) {
+      return right_iterator(this, end_slot, 0, big.find_right(right));
+    }
+    std::size_t pos = lower_bound<false>(right);
+    return at<false>(matches<false>(pos, right) ? pos : count);
+  }
+
+  right_t const &at_left(left_t const &key) const {
+    left_iterator it = find_left(key);
+    if (it == end_left()) {
+      throw std::out_of_range("no such element");
+    }
+    return *it.flip();
+  }
+
+  left_t const &at_right(right_t const &key) const {
+    right_iterator it = find_right(key);
+    if (it == end_right()) {
+      throw std::out_of_range("no such element");
+    }
+    return *it.flip();
+  }
+
+  left_iterator lower_bound_left(left_t const &left) const noexcept {
+    if (spilled) {
+      return left_iterator(this, end_slot, 0, big.lower_bound_left(left));
+    }
+    return at<true>(lower_bound<true>(left));
+  }
+
+  left_iterator upper_bound_left(left_t const &left) const noexcept {
+    if (spilled) {
+      return left_iterator(this, end_slot, 0, big.upper_bound_left(left));
+    }
+    return at<true>(upper_bound<true>(left));
+  }
+
+  right_iterator lower_bound_right(right_t const &right) const noexcept {
+    if (spilled) {
+      return right_iterator(this, end_slot, 0, big.lower_bound_right(right));
+    }
+    return at<false>(lower_bound<false>(right));
+  }
+
+  right_iterator upper_bound_right(right_t const &right) const noexcept {
+    if (spilled) {
+      return right_iterator(this, end_slot, 0, big.upper_bound_right(right));
+    }
+    return at<false>(upper_bound<false>(right));
+  }
+
+  left_iterator begin_left() const noexcept {
+    if (spilled) {
+      return left_iterator(this, end_slot, 0, big.begin_left());
+    }
+    return at<true>(0);
+  }
+
+  left_iterator end_left() const noexcept {
+    return left_iterator(this, end_slot, 0, big.end_left());
+  }
+
+  right_iterator begin_right() const noexcept {
+    if (spilled) {
+      return right_iterator(this, end_slot, 0, big.begin_right());
+    }
+    return at<false>(0);
+  }
+
+  right_iterator end_right() const noexcept {
+    return right_iterator(this, end_slot, 0, big.end_right());
+  }
+
+  // a cleared map is small again
+  void clear() noexcept {
+    destroy_inline();
+    big.clear();
+    spilled = false;
+  }
+
+  bool is_small() const noexcept {
+    return !spilled;
+  }
+
+  bool empty() const noexcept {
+    return size() == 0;
+  }
+
+  std::size_t size() const noexcept {
+    return spilled ? big.size() : count;
+  }
+
+  friend bool operator==(small_bimap const &a, small_bimap const &b) noexcept {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (left_iterator it = a.begin_left(); it != a.end_left(); ++it) {
+      left_iterator other = b.find_left(*it);
+      if (other == b.end_left() ||
+          a.compare_right(*it.flip(), *other.flip()) ||
+          a.compare_right(*other.flip(), *it.flip())) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  friend bool operator!=(small_bimap const &a, small_bimap const &b) noexcept {
+    return !(a == b);
+  }
+
+private:
+  using pair_t = std::pair<left_t, right_t>;
+  static constexpr std::uint8_t end_slot = 0xFF;
+
+  CompareLeft compare_left;
+  CompareRight compare_right;
+  bimap_t big;
+  bool spilled{false};
+  std::uint8_t count{0};
+  std::uint64_t used{0};
+  // slots in the order of the left keys and of the right ones
+  std::uint8_t orders[2][N];
+  alignas(pair_t) unsigned char storage[N * sizeof(pair_t)];
+
+  pair_t *slots() noexcept {
+    return std::launder(reinterpret_cast<pair_t *>(storage));
+  }
+
+  pair_t const *slots() const noexcept {
+    return std::launder(reinterpret_cast<pair_t const *>(storage));
+  }
+
+  template <bool is_left>
+  auto const &key(std::uint8_t slot) const noexcept {
+    if constexpr (is_left) {
+      return slots()[slot].first;
+    } else {
+      return slots()[slot].second;
+    }
+  }
+
+  // iterator to the pair of rank pos on a side of a small map, the end for
+  // pos == count
+  template <bool is_left>
+  iterator<is_left> at(std::size_t pos) const noexcept {
+    std::uint8_t slot = pos < count ? orders[is_left ? 0 : 1][pos] : end_slot;
+    return iterator<is_left>(this, slot, pos, big_end<is_left>());
+  }
+
+  template <bool is_left>
+  auto big_end() const noexcept {
+    if constexpr (is_left) {
+      return big.end_left();
+    } else {
+      return big.end_right();
+    }
+  }
+
+  template <bool is_left, typename A, typename B>
+  bool less(A const &a, B const &b) const noexcept {
+    if constexpr (is_left) {
+      return compare_left(a, b);
+    } else {
+      return compare_right(a, b);
+    }
+  }
+
+  // rank of the first key of a side not less than x
+  template <bool is_left, typename K>
+  std::size_t lower_bound(K const &x) const noexcept {
+    std::uint8_t const *order = orders[is_left ? 0 : 1];
+    return std::lower_bound(order, order + count, x,
+                            [this](std::uint8_t slot, K const &x) {
+                              return less<is_left>(key<is_left>(slot), x);
+                            }) -
+           order;
+  }
+
+  template <bool is_left, typename K>
+  std::size_t upper_bound(K const &x) const noexcept {
+    std::uint8_t const *order = orders[is_left ? 0 : 1];
+    return std::upper_bound(order, order + count, x,
+                            [this](K const &x, std::uint8_t slot) {
+                              return less<is_left>(x, key<is_left>(slot));
+                            }) -
+           order;
+  }
+
+  // whether the key at rank pos, the lower bound of x, is equal to x
+  template <bool is_left, typename K>
+  bool matches(std::size_t pos, K const &x) const noexcept {
+    return pos < count &&
+           !less<is_left>(x, key<is_left>(orders[is_left ? 0 : 1][pos]));
+  }
+
+  void insert_at(std::uint8_t *order, std::size_t pos,
+                 std::uint8_t slot) noexcept {
+    std::copy_backward(order + pos, order + count, order + count + 1);
+    order[pos] = slot;
+  }
+
+  void remove_slot(std::uint8_t slot) noexcept {
+    for (std::uint8_t *order : orders) {
+      std::uint8_t *p = std::find(order, order + count, slot);
+      std::copy(p + 1, order + count, p);
+    }
+    slots()[slot].~pair_t();
+    used &= ~(std::uint64_t(1) << slot);
+    count--;
+  }
+
+  // the pairs are then constructed in left order while count grows, so
+  // that destroy_inline() sees the constructed ones only
+  void copy_orders(small_bimap const &other) noexcept {
+    std::copy(other.orders[0], other.orders[0] + other.count, orders[0]);
+    std::copy(other.orders[1], other.orders[1] + other.count, orders[1]);
+  }
+
+  // moves the inline pairs of other here and leaves other empty
+  void take(small_bimap &other) {
+    copy_orders(other);
+    for (; count < other.count; count++) {
+      std::uint8_t slot = orders[0][count];
+      new (slots() + slot) pair_t(std::move(other.slots()[slot]));
+      used |= std::uint64_t(1) << slot;
+    }
+    other.clear();
+  }
+
+  // pairs are moved into the bimap only if that cannot throw, otherwise
+  // they are copied
+  static constexpr bool spill_moves =
+      std::is_nothrow_move_constructible_v<pair_t> ||
+      !std::is_copy_constructible_v<pair_t>;
+
+  // Moves the pairs into the bimap, which takes over for good. If a node
+  // allocation fails, the pairs moved so far are moved back, so the map is
+  // left as it was.
+  void spill() {
+    bimap_t tmp(compare_left, compare_right);
+    std::size_t i = 0;
+    try {
+      for (; i < count; i++) {
+        pair_t &p = slots()[orders[0][i]];
+        if constexpr (spill_moves) {
+          tmp.insert(tmp.end_left(), tmp.end_right(), std::move(p.first),
+                     std::move(p.second));
+        } else {
+          tmp.insert(tmp.end_left(), tmp.end_right(), std::as_const(p.first),
+                     std::as_const(p.second));
+        }
+      }
+    } catch (...) {
+      if constexpr (spill_moves) {
+        // the first i pairs in left order are in tmp, in the same order
+        for (std::size_t j = 0; j < i; j++) {
+          auto nh = tmp.extract_left(tmp.begin_left());
+          pair_t *p = slots() + orders[0][j];
+          p->~pair_t();
+          new (p) pair_t(std::move(nh.left()), std::move(nh.right()));
+        }
+      }
+      throw;
+    }
+    big = std::move(tmp);
+    destroy_inline();
+    spilled = true;
+  }
+
+  void destroy_inline() noexcept {
+    for (std::size_t i = 0; i < count; i++) {
+      slots()[orders[0][i]].~pair_t();
+    }
+    count = 0;
+    used = 0;
+  }
+};
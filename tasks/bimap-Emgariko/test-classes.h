@@ -51,3 +51,80 @@ private:
   int a;
 };
 
+// copying throws once copies_left drops to zero, a negative value disables it
+struct throwing_copy {
+  static inline int copies_left = -1;
+
+  explicit throwing_copy(int b) : a(b) {}
+  throwing_copy(throwing_copy const &other) : a(other.a) {
+    if (copies_left == 0) {
+      throw std::runtime_error("copy failed");
+    }
+    copies_left--;
+  }
+  friend bool operator<(throwing_copy const &c, throwing_copy const &b) {
+    return c.a < b.a;
+  }
+  friend bool operator==(throwing_copy const &c, throwing_copy const &b) {
+    return c.a == b.a;
+  }
+
+  int a;
+};
+
+// like throwing_copy, but default constructible and moved without
+// throwing, as B+-tree keys must be
+struct throwing_key {
+  static inline int copies_left = -1;
+
+  throwing_key() = default;
+  explicit throwing_key(int b) : a(b) {}
+  throwing_key(throwing_key const &other) : a(other.a) {
+    if (copies_left == 0) {
+      throw std::runtime_error("copy failed");
+    }
+    copies_left--;
+  }
+  throwing_key(throwing_key &&other) noexcept = default;
+  throwing_key &operator=(throwing_key const &other) = default;
+  throwing_key &operator=(throwing_key &&other) noexcept = default;
+  friend bool operator<(throwing_key const &c, throwing_key const &b) {
+    return c.a < b.a;
+  }
+  friend bool operator==(throwing_key const &c, throwing_key const &b) {
+    return c.a == b.a;
+  }
+
+  int a = 0;
+};
+
+struct allocation_counter {
+  static inline size_t allocations = 0;
+  static inline size_t deallocations = 0;
+};
+
+template <typename T>
+struct counting_allocator {
+  using value_type = T;
+
+  counting_allocator() = default;
+  template <typename U>
+  counting_allocator(counting_allocator<U> const &) {}
+
+  T *allocate(size_t n) {
+    allocation_counter::allocations++;
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T *p, size_t n) {
+    allocation_counter::deallocations++;
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  friend bool operator==(counting_allocator const &, counting_allocator const &) {
+    return true;
+  }
+  friend bool operator!=(counting_allocator const &, counting_allocator const &) {
+    return false;
+  }
+};
@@ -1,6 +1,20 @@
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <map>
+#include <mutex>
 #include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 
 #include "bimap.h"
+#include "concurrent_bimap.h"
+#include "flat_bimap.h"
+#include "mapped_bimap.h"
+#include "persistent_bimap.h"
+#include "small_bimap.h"
 #include "test-classes.h"
 #include "gtest/gtest.h"
 
@@ -366,6 +380,395 @@ TEST(bimap, swap) {
   EXPECT_EQ(*b.find_right(3), 3);
 }
 
+template <typename Bimap>
+void check_clear() {
+  allocation_counter::allocations = allocation_counter::deallocations = 0;
+  {
+    Bimap b;
+    for (int i = 0; i < 1000; i++) {
+      b.insert(i, 1000 - i);
+    }
+    b.clear();
+    EXPECT_TRUE(b.empty());
+    EXPECT_EQ(b.begin_left(), b.end_left());
+    EXPECT_EQ(b.begin_right(), b.end_right());
+    EXPECT_EQ(b.end_left().flip(), b.end_right());
+    EXPECT_EQ(b.find_left(5), b.end_left());
+    EXPECT_EQ(allocation_counter::allocations,
+              allocation_counter::deallocations);
+
+    b.insert(5, 6);
+    EXPECT_EQ(b.at_left(5), 6);
+    Bimap other;
+    for (int i = 0; i < 100; i++) {
+      other.insert(i, i);
+    }
+    other = std::move(b);
+    EXPECT_EQ(other.size(), 1);
+    EXPECT_EQ(other.at_right(6), 5);
+    EXPECT_TRUE(b.empty());
+  }
+  EXPECT_EQ(allocation_counter::allocations, allocation_counter::deallocations);
+}
+
+TEST(bimap, clear) {
+  using alloc = counting_allocator<std::pair<int, int>>;
+  check_clear<bimap<int, int, std::less<int>, std::less<int>, alloc>>();
+  check_clear<bimap<int, int, btree_index<std::less<int>>, hash_index<>,
+                    alloc>>();
+  check_clear<bimap<int, int, hash_index<>, std::less<int>, alloc>>();
+}
+
+TEST(bimap, custom_allocator) {
+  allocation_counter::allocations = allocation_counter::deallocations = 0;
+  {
+    bimap<int, int, std::less<int>, std::less<int>,
+          counting_allocator<std::pair<int, int>>>
+        b;
+    for (int i = 0; i < 100; i++) {
+      b.insert(i, -i);
+    }
+    b.insert(5, 1000);
+    EXPECT_EQ(allocation_counter::allocations, 100);
+    for (int i = 0; i < 50; i++) {
+      b.erase_left(i);
+    }
+    EXPECT_EQ(allocation_counter::deallocations, 50);
+    auto copy = b;
+    EXPECT_EQ(allocation_counter::allocations, 150);
+  }
+  EXPECT_EQ(allocation_counter::allocations, allocation_counter::deallocations);
+}
+
+TEST(bimap, pool_reuses_nodes) {
+  using pooled = bimap<int, int, std::less<int>, std::less<int>,
+                       pool_allocator<std::pair<int, int>>>;
+  pooled b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(i, i);
+  }
+  int const *erased = &*b.find_left(42);
+  b.erase_left(42);
+  auto it = b.insert(1000, 1000);
+  EXPECT_EQ(&*it, erased);
+  EXPECT_EQ(b.size(), 100);
+
+  pooled moved(std::move(b));
+  EXPECT_EQ(&*moved.find_left(1000), erased);
+  moved.erase_left(moved.begin_left(), moved.end_left());
+  EXPECT_TRUE(moved.empty());
+}
+
+TEST(bimap, pool_across_threads) {
+  // one thread allocates and a long-lived other one frees, as when pairs
+  // are inserted and erased by different threads
+  struct node {
+    long data[4];
+  };
+  using pool_t = details::pool_allocator<node>;
+  constexpr std::size_t batch = 1000;
+  std::mutex m;
+  std::condition_variable cv;
+  std::vector<node *> handed;
+  bool done = false;
+  std::thread consumer([&] {
+    pool_t alloc;
+    std::unique_lock<std::mutex> lg(m);
+    while (true) {
+      cv.wait(lg, [&] { return done || !handed.empty(); });
+      for (node *p : handed) {
+        alloc.deallocate(p, 1);
+      }
+      handed.clear();
+      cv.notify_all();
+      if (done) {
+        return;
+      }
+    }
+  });
+  pool_t alloc;
+  for (int round = 0; round < 200; round++) {
+    std::vector<node *> nodes;
+    for (std::size_t i = 0; i < batch; i++) {
+      nodes.push_back(alloc.allocate(1));
+    }
+    std::unique_lock<std::mutex> lg(m);
+    cv.wait(lg, [&] { return handed.empty(); });
+    handed = std::move(nodes);
+    cv.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lg(m);
+    done = true;
+  }
+  cv.notify_all();
+  consumer.join();
+  EXPECT_LT(pool_t::capacity(), 8 * batch);
+}
+
+TEST(bimap, opt_in_pool_allocator) {
+  using pooled = bimap<int, int, std::less<int>, std::less<int>,
+                       pool_allocator<std::pair<int, int>>>;
+  pooled a, b;
+  for (int i = 0; i < 100; i++) {
+    a.insert(i, i);
+    b.insert(i + 50, i + 50);
+  }
+  a.merge(b);
+  EXPECT_EQ(a.size(), 150);
+  EXPECT_EQ(b.size(), 50);
+  pooled copy = a;
+  a.clear();
+  EXPECT_EQ(copy.at_left(149), 149);
+}
+
+// keeps subtree sizes on both sides for order statistics
+using ranked_bimap =
+    bimap<int, int, ranked_index<std::less<int>>, ranked_index<std::less<int>>>;
+
+TEST(bimap, bulk_construction) {
+  std::vector<std::pair<int, int>> data;
+  for (int i = 0; i < 1000; i++) {
+    data.emplace_back(i, (i * 37) % 1000);
+  }
+  ranked_bimap sorted(data.begin(), data.end());
+  std::shuffle(data.begin(), data.end(), std::mt19937(42));
+  ranked_bimap shuffled(data.begin(), data.end());
+  ranked_bimap inserted;
+  for (auto const &p : data) {
+    inserted.insert(p.first, p.second);
+  }
+  EXPECT_EQ(sorted.size(), 1000);
+  EXPECT_EQ(sorted, inserted);
+  EXPECT_EQ(shuffled, inserted);
+
+  EXPECT_EQ(*sorted.find_right(37).flip(), 1);
+  EXPECT_EQ(*sorted.lower_bound_left(500).flip(), (500 * 37) % 1000);
+  sorted.insert(-1, -1);
+  sorted.erase_left(500);
+  EXPECT_EQ(sorted.size(), 1000);
+  EXPECT_EQ(*sorted.begin_left(), -1);
+  EXPECT_EQ(*sorted.nth_left(10), 9);
+  EXPECT_EQ(sorted.rank_left(501), 501);
+}
+
+TEST(bimap, bulk_assign_duplicates) {
+  bimap<int, int> b;
+  b.insert(100, 100);
+  std::vector<std::pair<int, int>> data = {
+      {1, 1}, {2, 2}, {1, 3}, {4, 2}, {5, 5}, {5, 5}};
+  EXPECT_EQ(b.assign(data.begin(), data.end()), 3);
+  EXPECT_EQ(b.size(), 3);
+  EXPECT_EQ(b.at_left(1), 1);
+  EXPECT_EQ(b.at_right(2), 2);
+  EXPECT_EQ(b.at_left(5), 5);
+  EXPECT_EQ(b.find_left(100), b.end_left());
+  EXPECT_EQ(b.find_left(4), b.end_left());
+
+  EXPECT_EQ(b.assign(data.end(), data.end()), 0);
+  EXPECT_TRUE(b.empty());
+  EXPECT_EQ(b.begin_left(), b.end_left());
+}
+
+TEST(bimap, bulk_assign_dropped_pair_blocks_nothing) {
+  // (3, 2) only clashes with (1, 2), which is dropped itself
+  std::vector<std::pair<int, int>> data = {{1, 1}, {1, 2}, {3, 2}};
+  bimap<int, int> b(data.begin(), data.end());
+  EXPECT_EQ(b.size(), 2);
+  EXPECT_EQ(b.at_left(1), 1);
+  EXPECT_EQ(b.at_left(3), 2);
+
+  EXPECT_EQ(b.assign(data.begin(), data.end()), 1);
+  EXPECT_EQ(b.size(), 2);
+  EXPECT_EQ(b.at_right(2), 3);
+
+  bimap<int, int, hash_index<>, treap_index<>> h(data.begin(), data.end());
+  EXPECT_EQ(h.size(), 2);
+  EXPECT_EQ(h.at_right(2), 3);
+}
+
+TEST(bimap, bulk_construction_move_only) {
+  std::vector<std::pair<test_object, int>> data;
+  data.emplace_back(test_object(2), 1);
+  data.emplace_back(test_object(1), 2);
+  bimap<test_object, int> b(std::make_move_iterator(data.begin()),
+                            std::make_move_iterator(data.end()));
+  EXPECT_EQ(b.size(), 2);
+  EXPECT_EQ(data[0].first.a, 0);
+  EXPECT_EQ(b.at_right(1), test_object(2));
+  EXPECT_EQ(b.begin_left()->a, 1);
+}
+
+TEST(bimap, insert_with_hint) {
+  ranked_bimap b;
+  for (int i = 0; i < 1000; i++) {
+    auto it = b.insert(b.end_left(), b.end_right(), i, -i);
+    EXPECT_EQ(*it, i);
+  }
+  EXPECT_EQ(b.size(), 1000);
+  auto it = b.insert(b.find_left(500), b.end_right(), 499, 1);
+  EXPECT_EQ(it, b.end_left());
+  it = b.insert(b.begin_left(), b.find_right(-999), -1, -1000);
+  EXPECT_EQ(*it.flip(), -1000);
+
+  // wrong hints still insert in the right place
+  it = b.insert(b.begin_left(), b.end_right(), 10000, 10000);
+  EXPECT_EQ(*it, 10000);
+  EXPECT_EQ(b.insert(b.begin_left(), b.end_right(), 10000, 5), b.end_left());
+  EXPECT_EQ(b.insert(b.end_left(), b.begin_right(), 20000, 10000),
+            b.end_left());
+  EXPECT_EQ(b.size(), 1002);
+
+  EXPECT_EQ(*b.nth_left(500), 499);
+  EXPECT_EQ(*b.nth_right(1), -999);
+  int expected = -1;
+  for (auto lit = b.begin_left(); lit != b.end_left(); ++lit) {
+    EXPECT_EQ(*lit, expected);
+    EXPECT_EQ(b.find_right(*lit.flip()).flip(), lit);
+    expected = expected == 999 ? 10000 : expected + 1;
+  }
+}
+
+TEST(bimap, insert_with_hint_reverse_order) {
+  bimap<int, int, std::less<int>, std::greater<int>> b;
+  auto it = b.end_left();
+  for (int i = 1000; i > 0; i--) {
+    it = b.insert(it, b.end_right(), i, i);
+  }
+  EXPECT_EQ(b.size(), 1000);
+  int expected = 1;
+  for (auto lit = b.begin_left(); lit != b.end_left(); ++lit, ++expected) {
+    EXPECT_EQ(*lit, expected);
+  }
+  EXPECT_EQ(*b.begin_right(), 1000);
+}
+
+// the greatest element is cached for end hints and must follow erases,
+// moves, copies and bulk operations
+template <typename Bimap>
+void check_insert_at_end() {
+  Bimap b;
+  std::map<int, int> expected;
+  std::mt19937 e(11);
+  int next = 0;
+  for (int round = 0; round < 3000; round++) {
+    switch (e() % 8) {
+    case 0:
+      if (!expected.empty()) {
+        int k = std::prev(expected.end())->first;
+        b.erase_left(k);
+        expected.erase(k);
+        next = k;
+      }
+      break;
+    case 1:
+      if (!expected.empty()) {
+        int k = static_cast<int>(e() % next);
+        b.erase_left(k);
+        expected.erase(k);
+      }
+      break;
+    case 2:
+      if (e() % 16 == 0) {
+        Bimap moved(std::move(b));
+        b = std::move(moved);
+      } else if (e() % 16 == 0) {
+        Bimap copy(b);
+        b = std::move(copy);
+      } else if (e() % 32 == 0) {
+        b.clear();
+        expected.clear();
+      }
+      break;
+    default:
+      next += static_cast<int>(e() % 3);
+      // keys below the greatest one make the end hint wrong
+      int k = next > 0 && e() % 8 == 0 ? static_cast<int>(e() % next) : next++;
+      bool inserted = b.insert(b.end_left(), b.end_right(), k, -k) !=
+                      b.end_left();
+      EXPECT_EQ(inserted, expected.emplace(k, -k).second);
+    }
+    if (!b.empty()) {
+      auto greatest = b.end_left();
+      --greatest;
+      EXPECT_EQ(*greatest, std::prev(expected.end())->first);
+    }
+  }
+  ASSERT_EQ(b.size(), expected.size());
+  auto it = b.begin_left();
+  for (auto const &p : expected) {
+    EXPECT_EQ(*it, p.first);
+    EXPECT_EQ(*it.flip(), p.second);
+    ++it;
+  }
+}
+
+TEST(bimap, insert_at_end_after_changes) {
+  check_insert_at_end<bimap<int, int>>();
+  check_insert_at_end<bimap<int, int, compact_index<>, compact_index<>>>();
+}
+
+TEST(bimap, order_statistics) {
+  bimap<int, int, ranked_index<std::less<int>>, ranked_index<std::greater<int>>>
+      b;
+  std::vector<int> keys;
+  std::mt19937 e(7);
+  for (int i = 0; i < 2000; i++) {
+    int k = static_cast<int>(e() % 100000);
+    if (b.insert(k, k) != b.end_left()) {
+      keys.push_back(k);
+    }
+  }
+  for (int i = 0; i < 500; i++) {
+    int k = keys.back();
+    keys.pop_back();
+    if (i % 2 == 0) {
+      b.erase_left(k);
+    } else {
+      b.erase_right(k);
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  ASSERT_EQ(b.size(), keys.size());
+
+  for (size_t i = 0; i < keys.size(); i += 7) {
+    EXPECT_EQ(*b.nth_left(i), keys[i]);
+    EXPECT_EQ(*b.nth_right(i), keys[keys.size() - 1 - i]);
+    EXPECT_EQ(b.rank_left(keys[i]), i);
+    EXPECT_EQ(b.rank_left(keys[i] + 1), i + 1);
+    EXPECT_EQ(b.rank_right(keys[i]), keys.size() - 1 - i);
+  }
+  EXPECT_EQ(b.nth_left(keys.size()), b.end_left());
+  EXPECT_EQ(b.rank_left(-1), 0);
+  EXPECT_EQ(b.rank_left(1000000), keys.size());
+
+  for (int i = 0; i < 100; i++) {
+    int lo = static_cast<int>(e() % 100000), hi = static_cast<int>(e() % 100000);
+    auto expected = std::lower_bound(keys.begin(), keys.end(), hi) -
+                    std::lower_bound(keys.begin(), keys.end(), lo);
+    EXPECT_EQ(b.count_left(lo, hi), std::max<std::ptrdiff_t>(expected, 0));
+  }
+  EXPECT_EQ(b.count_right(keys.back(), keys.front()), keys.size() - 1);
+}
+
+TEST(bimap, iterator_arithmetic) {
+  ranked_bimap b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(i * 2, -i);
+  }
+  auto it = b.begin_left();
+  it += 10;
+  EXPECT_EQ(*it, 20);
+  EXPECT_EQ(*(it + 40), 100);
+  EXPECT_EQ(*(it - 10), 0);
+  EXPECT_EQ(it + 90, b.end_left());
+  EXPECT_EQ(b.end_left() - b.begin_left(), 100);
+  EXPECT_EQ(*(b.end_left() - 1), 198);
+  EXPECT_EQ(b.find_left(50) - b.begin_left(), 25);
+  EXPECT_EQ(*(b.begin_right() + 3), -96);
+  EXPECT_EQ((b.begin_right() + 3).flip() - b.begin_left(), 96);
+}
+
 template <typename T>
 std::vector<std::pair<T, T>>
 eliminate_same(std::vector<T> &lefts, std::vector<T> &rights, std::mt19937 &e) {
@@ -395,6 +798,1853 @@ template struct bimap<non_default_constructible, int>;
 
 static constexpr uint32_t seed = 1488228;
 
+template <typename Bimap>
+void expect_consistent(Bimap const &b) {
+  constexpr bool ranked = details::is_ranked_v<typename Bimap::left_index_t>;
+  size_t i = 0;
+  for (auto it = b.begin_left(); it != b.end_left(); ++it, ++i) {
+    if (i > 0) {
+      auto prev = it;
+      EXPECT_LT(*--prev, *it);
+    }
+    if constexpr (ranked) {
+      EXPECT_EQ(b.nth_left(i), it);
+      EXPECT_EQ(b.rank_left(*it), i);
+    }
+    EXPECT_EQ(b.find_right(*it.flip()).flip(), it);
+  }
+  EXPECT_EQ(i, b.size());
+  i = 0;
+  for (auto it = b.begin_right(); it != b.end_right(); ++it, ++i) {
+    if constexpr (ranked) {
+      EXPECT_EQ(b.nth_right(i), it);
+    }
+    EXPECT_EQ(b.find_left(*it.flip()).flip(), it);
+  }
+  EXPECT_EQ(i, b.size());
+}
+
+TEST(bimap, erase_range_randomized) {
+  std::mt19937 e(seed);
+  ranked_bimap b;
+  bimap<int, int, std::less<int>, hash_index<>> mixed;
+  std::map<int, int> left_view;
+  for (int i = 0; i < 20000; i++) {
+    int l = e() % 100000, r = e() % 100000;
+    if (b.insert(l, r) != b.end_left()) {
+      mixed.insert(l, r);
+      left_view.emplace(l, r);
+    }
+  }
+  // short ranges are erased pair by pair on the other side, long ones in a
+  // single pass over it
+  for (int len : {1, 3, 30, 1000, 5000}) {
+    int from = e() % 100000;
+    auto first = b.lower_bound_left(from);
+    auto last = first;
+    for (int i = 0; i < len && last != b.end_left(); i++) {
+      ++last;
+    }
+    int to = last == b.end_left() ? 100000 : *last;
+    EXPECT_EQ(b.erase_left(first, last), last);
+    mixed.erase_left(mixed.lower_bound_left(from), mixed.lower_bound_left(to));
+    left_view.erase(left_view.lower_bound(from), left_view.lower_bound(to));
+
+    auto rfirst = b.lower_bound_right(from);
+    auto rlast = rfirst;
+    for (int i = 0; i < len && rlast != b.end_right(); i++) {
+      left_view.erase(*rlast.flip());
+      mixed.erase_left(*rlast.flip());
+      ++rlast;
+    }
+    EXPECT_EQ(b.erase_right(rfirst, rlast), rlast);
+
+    expect_consistent(b);
+    EXPECT_EQ(b.size(), left_view.size());
+    EXPECT_EQ(mixed.size(), left_view.size());
+    auto it = b.begin_left();
+    for (auto const &[l, r] : left_view) {
+      EXPECT_EQ(*it, l);
+      EXPECT_EQ(*it.flip(), r);
+      EXPECT_EQ(mixed.at_right(r), l);
+      ++it;
+    }
+  }
+}
+
+TEST(bimap_set_ops, merge_union) {
+  bimap<int, int> a, b;
+  a.insert(1, 1);
+  a.insert(2, 2);
+  a.insert(3, 3);
+  b.insert(1, 10);
+  b.insert(20, 2);
+  b.insert(4, 4);
+  b.insert(5, 3);
+  b.insert(6, 6);
+  int const *moved = &*b.find_left(4);
+
+  a.merge_union(b);
+  EXPECT_EQ(a.size(), 5);
+  EXPECT_EQ(b.size(), 3);
+  EXPECT_EQ(&*a.find_left(4), moved);
+  EXPECT_EQ(a.at_left(6), 6);
+  EXPECT_EQ(b.at_left(1), 10);
+  EXPECT_EQ(b.at_right(2), 20);
+  EXPECT_EQ(b.at_left(5), 3);
+  EXPECT_EQ(b.find_left(4), b.end_left());
+  expect_consistent(a);
+  expect_consistent(b);
+}
+
+TEST(bimap_set_ops, intersect_difference) {
+  bimap<int, int> a, b;
+  for (int i = 0; i < 10; i++) {
+    a.insert(i, i);
+  }
+  b.insert(2, 2);
+  b.insert(3, 30);
+  b.insert(5, 5);
+  b.insert(100, 7);
+  b.insert(8, 8);
+
+  bimap<int, int> c = a;
+  c.intersect(b);
+  EXPECT_EQ(c.size(), 3);
+  EXPECT_EQ(*c.begin_left(), 2);
+  EXPECT_EQ(*--c.end_right(), 8);
+  expect_consistent(c);
+
+  a.difference(b);
+  EXPECT_EQ(a.size(), 7);
+  EXPECT_EQ(a.find_left(5), a.end_left());
+  EXPECT_EQ(a.at_left(3), 3);
+  expect_consistent(a);
+
+  a.difference(a);
+  EXPECT_TRUE(a.empty());
+}
+
+TEST(bimap_set_ops, randomized_large) {
+  std::mt19937 e(seed);
+  ranked_bimap a, b;
+  std::map<int, int> a_left, b_left;
+  std::map<int, int> a_right, b_right;
+  auto fill = [&e](ranked_bimap &m, std::map<int, int> &l,
+                   std::map<int, int> &r, int range) {
+    for (int i = 0; i < 60000; i++) {
+      int x = static_cast<int>(e() % range), y = static_cast<int>(e() % range);
+      if (m.insert(x, y) != m.end_left()) {
+        l[x] = y;
+        r[y] = x;
+      }
+    }
+  };
+  fill(a, a_left, a_right, 200000);
+  fill(b, b_left, b_right, 200000);
+
+  ranked_bimap inter = a, diff = a, uni = a, rest = b;
+  inter.intersect(b);
+  diff.difference(b);
+  uni.merge_union(rest);
+
+  size_t common = 0, movable = 0;
+  for (auto const &p : a_left) {
+    auto it = b_left.find(p.first);
+    bool present = it != b_left.end() && it->second == p.second;
+    common += present;
+    EXPECT_EQ(inter.find_left(p.first) != inter.end_left(), present);
+    EXPECT_EQ(diff.find_left(p.first) != diff.end_left(), !present);
+  }
+  for (auto const &p : b_left) {
+    bool free = a_left.count(p.first) == 0 && a_right.count(p.second) == 0;
+    movable += free;
+    EXPECT_EQ(rest.find_left(p.first) != rest.end_left(), !free);
+    if (free) {
+      EXPECT_EQ(uni.at_left(p.first), p.second);
+    }
+  }
+  EXPECT_EQ(inter.size(), common);
+  EXPECT_EQ(diff.size(), a.size() - common);
+  EXPECT_EQ(uni.size(), a.size() + movable);
+  EXPECT_EQ(rest.size(), b.size() - movable);
+  expect_consistent(inter);
+  expect_consistent(diff);
+  expect_consistent(uni);
+  expect_consistent(rest);
+}
+
+using btree_bimap = bimap<int, std::string, btree_index<std::less<int>>,
+                          btree_index<std::less<std::string>>>;
+
+TEST(bimap_btree, simple) {
+  btree_bimap b;
+  EXPECT_EQ(b.begin_left(), b.end_left());
+  EXPECT_EQ(b.end_left().flip(), b.end_right());
+  EXPECT_EQ(b.end_right().flip(), b.end_left());
+
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_NE(b.insert(i * 7 % 1000, std::to_string(i)), b.end_left());
+  }
+  EXPECT_EQ(b.insert(5, "x"), b.end_left());
+  EXPECT_EQ(b.insert(1000, "5"), b.end_left());
+  EXPECT_EQ(b.size(), 1000);
+
+  EXPECT_EQ(b.at_left(7), "1");
+  EXPECT_EQ(b.at_right("1"), 7);
+  EXPECT_EQ(*b.find_right("2").flip(), 14);
+  EXPECT_EQ(b.find_left(1000), b.end_left());
+  EXPECT_EQ(*b.lower_bound_left(-1), 0);
+  EXPECT_EQ(*b.upper_bound_left(41), 42);
+  EXPECT_EQ(b.upper_bound_left(999), b.end_left());
+  EXPECT_EQ(*b.lower_bound_right("10"), "10");
+  EXPECT_EQ(*--b.end_left(), 999);
+  EXPECT_EQ(*(--b.end_right()).flip(), 999 * 7 % 1000);
+
+  int expected = 0;
+  for (auto it = b.begin_left(); it != b.end_left(); ++it, ++expected) {
+    EXPECT_EQ(*it, expected);
+    EXPECT_EQ(it.flip().flip(), it);
+  }
+
+  btree_bimap c = b;
+  EXPECT_EQ(b, c);
+  EXPECT_TRUE(c.erase_left(7));
+  EXPECT_FALSE(c.erase_right("1"));
+  EXPECT_NE(b, c);
+  btree_bimap d = std::move(c);
+  EXPECT_TRUE(c.empty());
+  EXPECT_EQ(d.size(), 999);
+  EXPECT_EQ(d.end_left().flip(), d.end_right());
+  d.erase_left(d.begin_left(), d.end_left());
+  EXPECT_TRUE(d.empty());
+}
+
+TEST(bimap_btree, mixed_sides) {
+  bimap<int, int, std::less<int>, btree_index<std::greater<int>>> b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(i, i);
+  }
+  EXPECT_EQ(*b.begin_left(), 0);
+  EXPECT_EQ(*b.begin_right(), 99);
+  EXPECT_EQ(*b.lower_bound_right(50), 50);
+  EXPECT_EQ(*b.upper_bound_right(50), 49);
+  EXPECT_EQ(b.begin_right().flip(), --b.end_left());
+  EXPECT_EQ(b.end_right().flip(), b.end_left());
+  EXPECT_EQ(b.end_left().flip(), b.end_right());
+  for (auto it = b.begin_right(); it != b.end_right();) {
+    if (*it % 2 == 0) {
+      it = b.erase_right(it);
+    } else {
+      ++it;
+    }
+  }
+  EXPECT_EQ(b.size(), 50);
+  EXPECT_EQ(*b.begin_left(), 1);
+  EXPECT_EQ(*b.begin_right(), 99);
+}
+
+TEST(bimap_btree, iterators_stay_valid) {
+  btree_bimap b;
+  auto kept = b.insert(500, "kept");
+  for (int i = 0; i < 1000; i++) {
+    b.insert(i, "v" + std::to_string(i));
+  }
+  for (int i = 0; i < 1000; i += 3) {
+    b.erase_left(i);
+  }
+  EXPECT_EQ(*kept, 500);
+  EXPECT_EQ(*kept.flip(), "kept");
+  EXPECT_EQ(kept.flip().flip(), kept);
+  auto next = kept, prev = kept;
+  EXPECT_EQ(*++next, 502);
+  EXPECT_EQ(*--prev, 499);
+}
+
+TEST(bimap_btree, bulk_and_hint) {
+  std::vector<std::pair<int, std::string>> pairs;
+  for (int i = 0; i < 5000; i++) {
+    pairs.emplace_back(i * 31 % 5000, std::to_string(i));
+  }
+  pairs.emplace_back(1, "dup");
+  btree_bimap b(pairs.begin(), pairs.end());
+  EXPECT_EQ(b.size(), 5000);
+  EXPECT_EQ(b.at_right("1"), 31);
+
+  btree_bimap c;
+  for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+    c.insert(c.end_left(), c.lower_bound_right(*it.flip()), *it, *it.flip());
+  }
+  EXPECT_EQ(b, c);
+
+  btree_bimap d;
+  for (int i = 4999; i >= 0; i--) {
+    d.insert(d.begin_left(), d.end_right(), i, "k" + std::to_string(i));
+  }
+  EXPECT_EQ(d.size(), 5000);
+  EXPECT_EQ(*d.begin_left(), 0);
+  EXPECT_EQ(d.at_left(4321), "k4321");
+}
+
+TEST(bimap_btree, randomized_against_maps) {
+  bimap<uint32_t, uint32_t, btree_index<std::less<uint32_t>>,
+        btree_index<std::greater<uint32_t>>>
+      b;
+  std::map<uint32_t, uint32_t> left_view;
+  std::map<uint32_t, uint32_t, std::greater<uint32_t>> right_view;
+
+  std::mt19937 e(seed);
+  for (size_t i = 0; i < 100000; i++) {
+    uint32_t l = e() % 20000, r = e() % 20000;
+    if (e() % 5 < 3) {
+      bool fresh = left_view.count(l) == 0 && right_view.count(r) == 0;
+      EXPECT_EQ(b.insert(l, r) != b.end_left(), fresh);
+      if (fresh) {
+        left_view[l] = r;
+        right_view[r] = l;
+      }
+    } else {
+      auto it = b.lower_bound_left(l);
+      auto mit = left_view.lower_bound(l);
+      ASSERT_EQ(it == b.end_left(), mit == left_view.end());
+      if (mit != left_view.end()) {
+        EXPECT_EQ(*it, mit->first);
+        right_view.erase(mit->second);
+        left_view.erase(mit);
+        b.erase_left(it);
+      }
+      auto rit = b.upper_bound_right(r);
+      auto mrit = right_view.upper_bound(r);
+      ASSERT_EQ(rit == b.end_right(), mrit == right_view.end());
+      if (mrit != right_view.end()) {
+        EXPECT_EQ(*rit, mrit->first);
+        EXPECT_EQ(*rit.flip(), mrit->second);
+      }
+    }
+    if (i % 5000 == 0) {
+      ASSERT_EQ(b.size(), left_view.size());
+      auto lit = b.begin_left();
+      for (auto const& [key, value] : left_view) {
+        EXPECT_EQ(*lit, key);
+        EXPECT_EQ(*lit.flip(), value);
+        ++lit;
+      }
+      EXPECT_EQ(lit, b.end_left());
+      auto rit = b.end_right();
+      for (auto mit = right_view.rbegin(); mit != right_view.rend(); ++mit) {
+        --rit;
+        EXPECT_EQ(*rit, mit->first);
+      }
+      EXPECT_EQ(rit, b.begin_right());
+    }
+  }
+  while (!b.empty()) {
+    b.erase_right(b.begin_right());
+  }
+}
+
+struct colliding_hash {
+  size_t operator()(int x) const {
+    return x % 4;
+  }
+};
+
+TEST(bimap_hash, unordered) {
+  bimap<int, std::string, hash_index<>, hash_index<>> b;
+  EXPECT_EQ(b.begin_left(), b.end_left());
+  EXPECT_EQ(b.end_left().flip(), b.end_right());
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_NE(b.insert(i, std::to_string(i * 3)), b.end_left());
+  }
+  EXPECT_EQ(b.insert(1, "x"), b.end_left());
+  EXPECT_EQ(b.insert(-1, "3"), b.end_left());
+  EXPECT_EQ(b.size(), 1000);
+  EXPECT_EQ(b.at_left(10), "30");
+  EXPECT_EQ(b.at_right("30"), 10);
+  EXPECT_EQ(b.find_left(1000), b.end_left());
+  EXPECT_EQ(b.find_right("1"), b.end_right());
+  EXPECT_EQ(b.end_right().flip(), b.end_left());
+
+  std::vector<char> seen(1000, false);
+  size_t count = 0;
+  for (auto it = b.begin_left(); it != b.end_left(); ++it, ++count) {
+    EXPECT_FALSE(seen[*it]);
+    seen[*it] = true;
+    EXPECT_EQ(*it.flip(), std::to_string(*it * 3));
+    EXPECT_EQ(it.flip().flip(), it);
+  }
+  EXPECT_EQ(count, 1000);
+  auto last = b.end_right();
+  --last;
+  EXPECT_EQ(++last, b.end_right());
+
+  auto c = b;
+  EXPECT_EQ(b, c);
+  for (auto it = c.begin_right(); it != c.end_right();) {
+    if (*it.flip() % 2 == 0) {
+      it = c.erase_right(it);
+    } else {
+      ++it;
+    }
+  }
+  EXPECT_EQ(c.size(), 500);
+  EXPECT_NE(b, c);
+  EXPECT_EQ(c.find_left(4), c.end_left());
+  EXPECT_EQ(c.at_left(5), "15");
+}
+
+TEST(bimap_hash, mixed) {
+  bimap<int, int, hash_index<>, std::greater<int>> a, b;
+  for (int i = 0; i < 200; i++) {
+    a.insert(i, i * 2);
+    b.insert(199 - i, (199 - i) * 2);
+  }
+  EXPECT_EQ(a, b);
+  int expected = 398;
+  for (auto it = a.begin_right(); it != a.end_right(); ++it, expected -= 2) {
+    EXPECT_EQ(*it, expected);
+    EXPECT_EQ(*it.flip(), expected / 2);
+  }
+  EXPECT_EQ(*a.lower_bound_right(101), 100);
+  EXPECT_EQ(a.find_left(50).flip(), a.find_right(100));
+  EXPECT_TRUE(a.erase_left(50));
+  EXPECT_EQ(a.find_right(100), a.end_right());
+  a.erase_right(a.begin_right(), a.find_right(200));
+  EXPECT_EQ(a.size(), 100);
+  EXPECT_EQ(*a.begin_right(), 200);
+  EXPECT_EQ(a.find_left(150), a.end_left());
+}
+
+TEST(bimap_hash, collisions) {
+  bimap<int, int, hash_index<colliding_hash>, hash_index<colliding_hash>> b;
+  std::mt19937 e(seed);
+  std::map<int, int> left_view;
+  for (int i = 0; i < 20000; i++) {
+    int l = e() % 300, r = e() % 300;
+    if (e() % 2) {
+      bool fresh = left_view.count(l) == 0 && b.find_right(r) == b.end_right();
+      EXPECT_EQ(b.insert(l, r) != b.end_left(), fresh);
+      if (fresh) {
+        left_view[l] = r;
+      }
+    } else {
+      EXPECT_EQ(b.erase_left(l), left_view.erase(l) == 1);
+    }
+  }
+  EXPECT_EQ(b.size(), left_view.size());
+  for (auto [l, r] : left_view) {
+    EXPECT_EQ(b.at_left(l), r);
+    EXPECT_EQ(b.at_right(r), l);
+  }
+}
+
+TEST(bimap_hash, bulk_construction) {
+  std::vector<std::pair<int, int>> pairs;
+  std::mt19937 e(seed);
+  for (int i = 0; i < 5000; i++) {
+    pairs.emplace_back(e() % 3000, e() % 3000);
+  }
+  bimap<int, int> ordered(pairs.begin(), pairs.end());
+  bimap<int, int, hash_index<>, std::less<int>> mixed(pairs.begin(),
+                                                        pairs.end());
+  bimap<int, int, hash_index<>, hash_index<>> unordered;
+  EXPECT_EQ(unordered.assign(pairs.begin(), pairs.end()),
+            pairs.size() - ordered.size());
+  EXPECT_EQ(mixed.size(), ordered.size());
+  EXPECT_EQ(unordered.size(), ordered.size());
+  for (auto it = ordered.begin_left(); it != ordered.end_left(); ++it) {
+    EXPECT_EQ(mixed.at_left(*it), *it.flip());
+    EXPECT_EQ(unordered.at_right(*it.flip()), *it);
+  }
+}
+
+using compact_bimap = bimap<int, int, compact_index<>, compact_index<>>;
+
+TEST(bimap_compact, simple) {
+  EXPECT_LE(2 * sizeof(compact_bimap::node_t), sizeof(bimap<int, int>::node_t));
+  compact_bimap b;
+  EXPECT_EQ(b.begin_left(), b.end_left());
+  EXPECT_EQ(b.end_left().flip(), b.end_right());
+  for (int i = 0; i < 100; i++) {
+    b.insert(i, 1000 - i);
+  }
+  EXPECT_FALSE(b.insert(5, 5) != b.end_left());
+  EXPECT_EQ(b.size(), 100);
+  EXPECT_EQ(b.at_left(10), 990);
+  EXPECT_EQ(b.at_right(990), 10);
+  EXPECT_EQ(*b.lower_bound_left(-5), 0);
+  EXPECT_EQ(*b.upper_bound_right(950), 951);
+  EXPECT_EQ(b.lower_bound_right(2000), b.end_right());
+  auto last = b.end_left();
+  --last;
+  EXPECT_EQ(*last, 99);
+  EXPECT_EQ(*last.flip(), 901);
+  EXPECT_EQ(*b.begin_right().flip(), 99);
+
+  EXPECT_TRUE(b.erase_left(50));
+  EXPECT_FALSE(b.erase_left(50));
+  b.erase_right(b.find_right(960), b.end_right());
+  EXPECT_EQ(b.size(), 58);
+  EXPECT_EQ(*b.begin_left(), 41);
+  EXPECT_EQ(*--b.end_right(), 959);
+}
+
+TEST(bimap_compact, copy_move_bulk) {
+  std::vector<std::pair<int, int>> pairs;
+  std::mt19937 e(seed);
+  for (int i = 0; i < 5000; i++) {
+    pairs.emplace_back(e() % 3000, e() % 3000);
+  }
+  bimap<int, int> expected(pairs.begin(), pairs.end());
+  compact_bimap b(pairs.begin(), pairs.end());
+  bimap<int, int, compact_index<>, hash_index<>> mixed;
+  EXPECT_EQ(mixed.assign(pairs.begin(), pairs.end()),
+            pairs.size() - expected.size());
+  ASSERT_EQ(b.size(), expected.size());
+  auto it = b.begin_left();
+  for (auto eit = expected.begin_left(); eit != expected.end_left(); ++eit) {
+    EXPECT_EQ(*it, *eit);
+    EXPECT_EQ(*it.flip(), *eit.flip());
+    EXPECT_EQ(mixed.at_left(*eit), *eit.flip());
+    ++it;
+  }
+
+  compact_bimap copy(b);
+  EXPECT_TRUE(copy == b);
+  compact_bimap moved(std::move(copy));
+  EXPECT_TRUE(copy.empty());
+  EXPECT_TRUE(moved == b);
+  EXPECT_EQ(moved.end_right().flip(), moved.end_left());
+  compact_bimap other;
+  other.insert(1, 2);
+  other.swap(moved);
+  EXPECT_TRUE(other == b);
+  EXPECT_EQ(moved.size(), 1);
+  EXPECT_EQ(*moved.begin_left().flip(), 2);
+  other = moved;
+  EXPECT_EQ(other.size(), 1);
+  other.insert(other.end_left(), other.end_right(), 5, 6);
+  EXPECT_EQ(*--other.end_left(), 5);
+}
+
+TEST(bimap_compact, randomized_against_maps) {
+  bimap<uint32_t, uint32_t, compact_index<std::less<uint32_t>>,
+        compact_index<std::greater<uint32_t>>>
+      b;
+  std::map<uint32_t, uint32_t> left_view;
+  std::map<uint32_t, uint32_t, std::greater<uint32_t>> right_view;
+
+  std::mt19937 e(seed);
+  for (size_t i = 0; i < 100000; i++) {
+    uint32_t l = e() % 20000, r = e() % 20000;
+    if (e() % 5 < 3) {
+      bool fresh = left_view.count(l) == 0 && right_view.count(r) == 0;
+      EXPECT_EQ(b.insert(b.lower_bound_left(l), b.lower_bound_right(r), l, r) !=
+                    b.end_left(),
+                fresh);
+      if (fresh) {
+        left_view[l] = r;
+        right_view[r] = l;
+      }
+    } else {
+      auto it = b.lower_bound_left(l);
+      auto mit = left_view.lower_bound(l);
+      ASSERT_EQ(it == b.end_left(), mit == left_view.end());
+      if (mit != left_view.end()) {
+        EXPECT_EQ(*it, mit->first);
+        right_view.erase(mit->second);
+        left_view.erase(mit);
+        b.erase_left(it);
+      }
+    }
+    if (i % 5000 == 0) {
+      ASSERT_EQ(b.size(), left_view.size());
+      auto lit = b.begin_left();
+      for (auto const& [key, value] : left_view) {
+        EXPECT_EQ(*lit, key);
+        EXPECT_EQ(*lit.flip(), value);
+        ++lit;
+      }
+      EXPECT_EQ(lit, b.end_left());
+      auto rit = b.end_right();
+      for (auto mit = right_view.rbegin(); mit != right_view.rend(); ++mit) {
+        --rit;
+        EXPECT_EQ(*rit, mit->first);
+      }
+      EXPECT_EQ(rit, b.begin_right());
+    }
+  }
+}
+
+TEST(persistent_bimap, simple) {
+  persistent_bimap<int, std::string> b;
+  auto empty = b.snapshot();
+  EXPECT_TRUE(b.insert(1, "one"));
+  EXPECT_TRUE(b.insert(3, "three"));
+  EXPECT_TRUE(b.insert(2, "two"));
+  EXPECT_FALSE(b.insert(2, "deux"));
+  EXPECT_FALSE(b.insert(4, "one"));
+  auto s = b.snapshot();
+  EXPECT_TRUE(b.erase_left(1));
+  EXPECT_FALSE(b.erase_left(1));
+  EXPECT_TRUE(b.erase_right("three"));
+
+  EXPECT_TRUE(empty.empty());
+  EXPECT_EQ(empty.begin_left(), empty.end_left());
+  EXPECT_EQ(s.size(), 3);
+  EXPECT_EQ(b.size(), 1);
+  EXPECT_EQ(s.at_left(1), "one");
+  EXPECT_EQ(s.at_right("three"), 3);
+  EXPECT_THROW(b.snapshot().at_left(1), std::out_of_range);
+  using int_snapshot = bimap_snapshot<int, int>;
+  EXPECT_THROW(int_snapshot().at_right(1), std::out_of_range);
+
+  std::vector<int> lefts;
+  for (auto it = s.begin_left(); it != s.end_left(); it++) {
+    lefts.push_back(*it);
+  }
+  EXPECT_EQ(lefts, std::vector<int>({1, 2, 3}));
+  std::vector<std::string> rights;
+  for (auto it = s.begin_right(); it != s.end_right(); it++) {
+    rights.push_back(*it);
+  }
+  EXPECT_EQ(rights, std::vector<std::string>({"one", "three", "two"}));
+  EXPECT_EQ(*--s.end_left(), 3);
+  EXPECT_EQ(*--s.end_right(), "two");
+  EXPECT_EQ(*s.find_left(3).flip(), "three");
+  EXPECT_EQ(*s.find_right("two").flip(), 2);
+  EXPECT_EQ(s.find_left(4), s.end_left());
+  EXPECT_EQ(s.find_left(4).flip(), s.end_right());
+  EXPECT_EQ(*s.lower_bound_left(2), 2);
+  EXPECT_EQ(*s.upper_bound_left(2), 3);
+  EXPECT_EQ(s.upper_bound_left(3), s.end_left());
+  EXPECT_EQ(*s.lower_bound_right("p"), "three");
+  EXPECT_EQ(*s.upper_bound_right("one"), "three");
+
+  persistent_bimap<int, std::string> copy(b);
+  b.clear();
+  EXPECT_TRUE(b.empty());
+  EXPECT_EQ(copy.size(), 1);
+  EXPECT_EQ(copy.snapshot().at_left(2), "two");
+}
+
+TEST(persistent_bimap, snapshots_against_maps) {
+  std::mt19937 e(seed);
+  persistent_bimap<int, int> b;
+  std::map<int, int> left_to_right, right_to_left;
+  std::vector<std::pair<bimap_snapshot<int, int>, std::map<int, int>>> saved;
+  for (size_t i = 0; i < 20000; i++) {
+    int left = e() % 500, right = e() % 500;
+    switch (e() % 3) {
+    case 0: {
+      bool fresh = left_to_right.count(left) == 0 &&
+                   right_to_left.count(right) == 0;
+      EXPECT_EQ(b.insert(left, right), fresh);
+      if (fresh) {
+        left_to_right[left] = right;
+        right_to_left[right] = left;
+      }
+      break;
+    }
+    case 1: {
+      auto it = left_to_right.find(left);
+      EXPECT_EQ(b.erase_left(left), it != left_to_right.end());
+      if (it != left_to_right.end()) {
+        right_to_left.erase(it->second);
+        left_to_right.erase(it);
+      }
+      break;
+    }
+    default: {
+      auto it = right_to_left.find(right);
+      EXPECT_EQ(b.erase_right(right), it != right_to_left.end());
+      if (it != right_to_left.end()) {
+        left_to_right.erase(it->second);
+        right_to_left.erase(it);
+      }
+    }
+    }
+    if (i % 1000 == 0) {
+      saved.emplace_back(b.snapshot(), left_to_right);
+    }
+  }
+  EXPECT_EQ(b.size(), left_to_right.size());
+  for (auto const& [s, expected] : saved) {
+    ASSERT_EQ(s.size(), expected.size());
+    auto lit = s.begin_left();
+    for (auto const& [left, right] : expected) {
+      ASSERT_EQ(*lit, left);
+      ASSERT_EQ(*lit.flip(), right);
+      ++lit;
+    }
+    EXPECT_EQ(lit, s.end_left());
+    std::map<int, int> reversed;
+    for (auto rit = s.end_right(); rit != s.begin_right();) {
+      --rit;
+      reversed[*rit] = s.at_right(*rit);
+    }
+    EXPECT_EQ(reversed.size(), expected.size());
+    for (auto const& [right, left] : reversed) {
+      EXPECT_EQ(expected.at(left), right);
+    }
+  }
+}
+
+TEST(persistent_bimap, concurrent_readers) {
+  persistent_bimap<int, int> b;
+  std::atomic<bool> done{false};
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 3; r++) {
+    readers.emplace_back([&] {
+      while (!done.load()) {
+        auto s = b.snapshot();
+        size_t n = 0;
+        int prev = -1;
+        for (auto it = s.begin_left(); it != s.end_left(); ++it, ++n) {
+          ASSERT_LT(prev, *it);
+          ASSERT_EQ(*it.flip(), -*it);
+          prev = *it;
+        }
+        ASSERT_EQ(n, s.size());
+      }
+    });
+  }
+  std::mt19937 e(seed);
+  for (int i = 0; i < 20000; i++) {
+    int x = e() % 1000;
+    if (!b.insert(x, -x)) {
+      b.erase_left(x);
+    }
+  }
+  done = true;
+  for (std::thread& t : readers) {
+    t.join();
+  }
+}
+
+TEST(concurrent_bimap, simple) {
+  concurrent_bimap<int, std::string> b(4);
+  EXPECT_EQ(b.shard_count(), 4);
+  EXPECT_TRUE(b.empty());
+  EXPECT_TRUE(b.insert(1, "one"));
+  EXPECT_TRUE(b.insert(2, "two"));
+  EXPECT_FALSE(b.insert(1, "uno"));
+  EXPECT_FALSE(b.insert(3, "two"));
+  EXPECT_EQ(b.size(), 2);
+  EXPECT_EQ(b.find_left(1), "one");
+  EXPECT_EQ(b.find_right("two"), 2);
+  EXPECT_EQ(b.find_left(3), std::nullopt);
+  EXPECT_TRUE(b.erase_right("one"));
+  EXPECT_FALSE(b.erase_left(1));
+  EXPECT_TRUE(b.insert(1, "uno"));
+  EXPECT_TRUE(b.erase_left(2));
+  EXPECT_FALSE(b.erase_right("two"));
+  EXPECT_EQ(b.size(), 1);
+
+  std::vector<std::pair<int, std::string>> batch = {
+      {5, "five"}, {6, "six"}, {5, "cinq"}, {7, "uno"}, {8, "eight"}};
+  EXPECT_EQ(b.insert_many(batch.begin(), batch.end()), 3);
+  EXPECT_EQ(b.find_left(5), "five");
+  std::vector<int> keys = {8, 1, 7, 5};
+  auto found = b.find_left_many(keys.begin(), keys.end());
+  EXPECT_EQ(found, std::vector<std::optional<std::string>>(
+                       {"eight", "uno", std::nullopt, "five"}));
+  std::vector<std::string> names = {"six", "seven"};
+  auto lefts = b.find_right_many(names.begin(), names.end());
+  EXPECT_EQ(lefts, std::vector<std::optional<int>>({6, std::nullopt}));
+}
+
+TEST(concurrent_bimap, insert_many_duplicates) {
+  // pairs sharing a key land in different shard groups, the first one in
+  // the input must still win
+  concurrent_bimap<int, int> b(4);
+  std::vector<std::pair<int, int>> batch = {{0, 1}, {0, 3}};
+  EXPECT_EQ(b.insert_many(batch.begin(), batch.end()), 1);
+  EXPECT_EQ(b.find_left(0), 1);
+  EXPECT_EQ(b.find_right(3), std::nullopt);
+
+  std::mt19937 e(seed);
+  batch.clear();
+  for (int i = 0; i < 2000; i++) {
+    batch.emplace_back(e() % 500, e() % 500);
+  }
+  concurrent_bimap<int, int> many(4), expected(4);
+  std::size_t inserted = 0;
+  for (auto const& [left, right] : batch) {
+    inserted += expected.insert(left, right);
+  }
+  EXPECT_EQ(many.insert_many(batch.begin(), batch.end()), inserted);
+  EXPECT_EQ(many.size(), expected.size());
+  for (int x = 0; x < 500; x++) {
+    EXPECT_EQ(many.find_left(x), expected.find_left(x));
+    EXPECT_EQ(many.find_right(x), expected.find_right(x));
+  }
+}
+
+TEST(concurrent_bimap, insert_many_into_non_empty) {
+  // (1, 20) is rejected by the map, so it must not block (2, 20)
+  concurrent_bimap<int, int> b(4);
+  b.insert(1, 10);
+  std::vector<std::pair<int, int>> batch = {{1, 20}, {2, 20}};
+  EXPECT_EQ(b.insert_many(batch.begin(), batch.end()), 1);
+  EXPECT_EQ(b.size(), 2);
+  EXPECT_EQ(b.find_left(2), 20);
+
+  std::mt19937 e(seed);
+  concurrent_bimap<int, int, hash_index<>, std::less<int>> many(4);
+  concurrent_bimap<int, int> expected(4);
+  for (int i = 0; i < 200; i++) {
+    int l = e() % 500, r = e() % 500;
+    many.insert(l, r);
+    expected.insert(l, r);
+  }
+  batch.clear();
+  for (int i = 0; i < 2000; i++) {
+    batch.emplace_back(e() % 500, e() % 500);
+  }
+  std::size_t inserted = 0;
+  for (auto const& [left, right] : batch) {
+    inserted += expected.insert(left, right);
+  }
+  EXPECT_EQ(many.insert_many(batch.begin(), batch.end()), inserted);
+  EXPECT_EQ(many.size(), expected.size());
+  for (int x = 0; x < 500; x++) {
+    EXPECT_EQ(many.find_left(x), expected.find_left(x));
+    EXPECT_EQ(many.find_right(x), expected.find_right(x));
+  }
+}
+
+TEST(concurrent_bimap, threads) {
+  concurrent_bimap<int, int> b(16);
+  constexpr int threads = 4, per_thread = 5000;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&b, t] {
+      std::mt19937 e(seed + t);
+      for (int i = 0; i < per_thread; i++) {
+        // keys overlap between threads, a left key always maps to its
+        // negation so that every present pair can be checked
+        int x = e() % 2000;
+        switch (e() % 4) {
+        case 0:
+          b.insert(x, -x);
+          break;
+        case 1:
+          b.erase_left(x);
+          break;
+        case 2:
+          b.erase_right(-x);
+          break;
+        default:
+          if (auto r = b.find_left(x)) {
+            EXPECT_EQ(*r, -x);
+          }
+        }
+      }
+    });
+  }
+  for (std::thread& w : workers) {
+    w.join();
+  }
+  std::size_t present = 0;
+  for (int x = 0; x < 2000; x++) {
+    auto r = b.find_left(x);
+    auto l = b.find_right(-x);
+    EXPECT_EQ(r.has_value(), l.has_value());
+    if (r) {
+      EXPECT_EQ(*r, -x);
+      EXPECT_EQ(*l, x);
+      present++;
+    }
+  }
+  EXPECT_EQ(b.size(), present);
+}
+
+template <typename Bimap>
+void check_find_many() {
+  std::mt19937 e(seed);
+  Bimap b;
+  std::vector<int> lefts, rights;
+  for (int i = 0; i < 1000; i++) {
+    int left = e() % 3000, right = e() % 3000;
+    b.insert(left, right);
+    lefts.push_back(left);
+    rights.push_back(right + 1);
+  }
+  std::vector<typename Bimap::left_iterator> found_left;
+  b.find_left_many(lefts.begin(), lefts.end(), std::back_inserter(found_left));
+  ASSERT_EQ(found_left.size(), lefts.size());
+  for (size_t i = 0; i < lefts.size(); i++) {
+    EXPECT_EQ(found_left[i], b.find_left(lefts[i]));
+  }
+  std::vector<typename Bimap::right_iterator> found_right;
+  b.find_right_many(rights.begin(), rights.end(),
+                    std::back_inserter(found_right));
+  ASSERT_EQ(found_right.size(), rights.size());
+  for (size_t i = 0; i < rights.size(); i++) {
+    EXPECT_EQ(found_right[i], b.find_right(rights[i]));
+  }
+
+  Bimap empty;
+  auto end = empty.end_left();
+  empty.find_left_many(lefts.begin(), lefts.begin() + 1, &end);
+  EXPECT_EQ(end, empty.end_left());
+}
+
+TEST(bimap, find_many) {
+  check_find_many<bimap<int, int>>();
+  check_find_many<bimap<int, int, btree_index<>, hash_index<>>>();
+  check_find_many<bimap<int, int, hash_index<>, compact_index<>>>();
+  check_find_many<bimap<int, int, std::greater<>, std::less<>>>();
+}
+
+TEST(bimap_frozen, simple) {
+  bimap<int, std::string> b;
+  EXPECT_TRUE(b.freeze().empty());
+  EXPECT_EQ(b.freeze().begin_left(), b.freeze().end_left());
+  b.insert(3, "three");
+  b.insert(1, "one");
+  b.insert(2, "two");
+  b.insert(5, "five");
+  auto f = b.freeze();
+  EXPECT_EQ(f.size(), 4);
+  EXPECT_EQ(f.at_left(2), "two");
+  EXPECT_EQ(f.at_right("five"), 5);
+  EXPECT_THROW(f.at_left(4), std::out_of_range);
+  EXPECT_EQ(f.find_right("four"), f.end_right());
+  EXPECT_EQ(*f.lower_bound_left(4), 5);
+  EXPECT_EQ(*f.upper_bound_left(3), 5);
+  EXPECT_EQ(f.upper_bound_left(5), f.end_left());
+  EXPECT_EQ(*f.lower_bound_right("p"), "three");
+  EXPECT_EQ(*f.lower_bound_left(0), 1);
+  EXPECT_EQ(f.end_left().flip(), f.end_right());
+
+  std::vector<int> lefts;
+  for (auto it = f.begin_left(); it != f.end_left(); it++) {
+    lefts.push_back(*it);
+  }
+  EXPECT_EQ(lefts, std::vector<int>({1, 2, 3, 5}));
+  std::vector<std::string> rights;
+  for (auto it = f.end_right(); it != f.begin_right();) {
+    rights.push_back(*--it);
+    EXPECT_EQ(*it.flip(), b.at_right(*it));
+  }
+  EXPECT_EQ(rights, std::vector<std::string>({"two", "three", "one", "five"}));
+}
+
+template <typename Bimap>
+void check_freeze(size_t n) {
+  std::mt19937 e(seed);
+  Bimap b;
+  while (b.size() < n) {
+    b.insert(static_cast<int>(e() % (4 * n)), static_cast<int>(e() % (4 * n)));
+  }
+  auto f = b.freeze();
+  ASSERT_EQ(f.size(), b.size());
+  auto lit = b.begin_left();
+  for (auto fit = f.begin_left(); fit != f.end_left(); ++fit, ++lit) {
+    ASSERT_EQ(*fit, *lit);
+    ASSERT_EQ(*fit.flip(), *lit.flip());
+  }
+  EXPECT_EQ(lit, b.end_left());
+  auto rit = b.end_right();
+  for (auto fit = f.end_right(); fit != f.begin_right();) {
+    --fit, --rit;
+    ASSERT_EQ(*fit, *rit);
+    ASSERT_EQ(*fit.flip(), *rit.flip());
+  }
+  for (int x = -1; x <= static_cast<int>(4 * n); x++) {
+    auto lb = b.lower_bound_left(x);
+    auto flb = f.lower_bound_left(x);
+    ASSERT_EQ(flb == f.end_left(), lb == b.end_left());
+    if (lb != b.end_left()) {
+      ASSERT_EQ(*flb, *lb);
+    }
+    auto ub = b.upper_bound_right(x);
+    auto fub = f.upper_bound_right(x);
+    ASSERT_EQ(fub == f.end_right(), ub == b.end_right());
+    if (ub != b.end_right()) {
+      ASSERT_EQ(*fub, *ub);
+    }
+    ASSERT_EQ(f.find_left(x) == f.end_left(), b.find_left(x) == b.end_left());
+  }
+}
+
+TEST(bimap_frozen, against_bimap) {
+  for (size_t n : {1, 2, 3, 7, 8, 9, 100, 1000}) {
+    check_freeze<bimap<int, int>>(n);
+  }
+  check_freeze<bimap<int, int, std::greater<>>>(500);
+  check_freeze<bimap<int, int, btree_index<>, compact_index<>>>(500);
+}
+
+TEST(bimap, priority_policies) {
+  hashed_priority::seed(42);
+  std::vector<uint32_t> first;
+  for (int i = 0; i < 10; i++) {
+    first.push_back(hashed_priority::next());
+  }
+  hashed_priority::seed(42);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(hashed_priority::next(), first[i]);
+  }
+  random_priority::seed(42);
+  uint32_t r = random_priority::next();
+  random_priority::seed(42);
+  EXPECT_EQ(random_priority::next(), r);
+
+  using hashed_bimap =
+      bimap<int, int,
+            treap_index<std::less<int>, hashed_priority, no_statistics,
+                        order_statistics>,
+            treap_index<std::greater<int>, random_priority, no_statistics,
+                        order_statistics>>;
+  hashed_bimap b;
+  std::map<int, int> expected;
+  std::mt19937 e(seed);
+  for (int i = 0; i < 2000; i++) {
+    int x = e() % 10000;
+    if (b.insert(x, x * 3) != b.end_left()) {
+      expected[x] = x * 3;
+    }
+  }
+  ASSERT_EQ(b.size(), expected.size());
+  size_t k = 0;
+  for (auto [left, right] : expected) {
+    EXPECT_EQ(*b.nth_left(k), left);
+    EXPECT_EQ(*b.nth_right(expected.size() - 1 - k), right);
+    EXPECT_EQ(b.rank_left(left), k);
+    k++;
+  }
+  hashed_bimap copy = b;
+  EXPECT_EQ(copy, b);
+  b.erase_left(b.begin_left(), b.nth_left(b.size() / 2));
+  EXPECT_EQ(b.size(), expected.size() - expected.size() / 2);
+}
+
+template <typename Bimap>
+void check_node_handles() {
+  Bimap active, archived;
+  for (int i = 0; i < 100; i++) {
+    active.insert(i, -i);
+  }
+  typename Bimap::node_type nh = active.extract_left(10);
+  ASSERT_FALSE(nh.empty());
+  EXPECT_EQ(nh.left(), 10);
+  EXPECT_EQ(nh.right(), -10);
+  EXPECT_EQ(active.size(), 99);
+  EXPECT_EQ(active.find_left(10), active.end_left());
+  EXPECT_EQ(active.find_right(-10), active.end_right());
+  EXPECT_TRUE(active.extract_left(10).empty());
+
+  auto it = archived.insert(std::move(nh));
+  EXPECT_TRUE(nh.empty());
+  ASSERT_NE(it, archived.end_left());
+  EXPECT_EQ(*it, 10);
+  EXPECT_EQ(*it.flip(), -10);
+
+  // a pair with a taken key stays in the handle
+  nh = active.extract_right(-20);
+  nh.left() = 10;
+  EXPECT_EQ(archived.insert(std::move(nh)), archived.end_left());
+  EXPECT_FALSE(nh.empty());
+  nh.left() = 1000;
+  EXPECT_EQ(*archived.insert(std::move(nh)).flip(), -20);
+  EXPECT_EQ(archived.size(), 2);
+
+  // a handle that is never inserted frees its pair
+  active.extract_left(active.begin_left());
+  EXPECT_EQ(active.size(), 97);
+
+  archived.insert(30, -1);
+  archived.merge(active);
+  EXPECT_EQ(active.size(), 2);
+  EXPECT_NE(active.find_left(30), active.end_left());
+  EXPECT_NE(active.find_right(-1), active.end_right());
+  EXPECT_EQ(archived.size(), 98);
+  for (int i = 2; i < 100; i++) {
+    if (i != 20 && i != 30) {
+      EXPECT_EQ(*archived.find_left(i).flip(), -i);
+    }
+  }
+  archived.merge(archived);
+  EXPECT_EQ(archived.size(), 98);
+}
+
+TEST(bimap, node_handles) {
+  check_node_handles<bimap<int, int>>();
+  check_node_handles<bimap<int, int, btree_index<std::less<int>>,
+                           hash_index<>>>();
+
+  // moving pairs allocates nothing
+  using counted_bimap =
+      bimap<int, int,
+            treap_index<std::less<int>, random_priority, collect_statistics>,
+            std::less<int>>;
+  counted_bimap a, b;
+  for (int i = 0; i < 100; i++) {
+    a.insert(i, i);
+  }
+  a.reset_statistics();
+  b.insert(a.extract_left(5));
+  b.insert(a.extract_right(6));
+  b.merge(a);
+  EXPECT_EQ(b.size(), 100);
+  EXPECT_EQ(a.statistics_left().allocations, 0);
+  EXPECT_EQ(b.statistics_left().allocations, 0);
+  EXPECT_EQ(a.statistics_left().deallocations, 0);
+
+  bimap<std::string, std::string> strings;
+  strings.insert(std::string(100, 'a'), std::string(100, 'b'));
+  auto nh = strings.extract_left(std::string(100, 'a'));
+  char const* data = nh.left().data();
+  bimap<std::string, std::string> other;
+  EXPECT_EQ(other.insert(std::move(nh))->data(), data);
+}
+
+template <typename Bimap>
+void check_replace() {
+  Bimap b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(i, i * 10);
+  }
+  auto it = b.find_left(42);
+  auto rit = it.flip();
+  EXPECT_TRUE(b.replace_left(it, 1000));
+  EXPECT_EQ(*it, 1000);
+  EXPECT_EQ(*rit, 420);
+  EXPECT_EQ(b.find_left(42), b.end_left());
+  EXPECT_EQ(b.find_left(1000), it);
+  EXPECT_EQ(b.find_right(420), rit);
+  EXPECT_EQ(b.size(), 100);
+
+  // a key of another pair is refused, the own one is kept
+  EXPECT_FALSE(b.replace_left(it, 7));
+  EXPECT_EQ(*it, 1000);
+  EXPECT_TRUE(b.replace_left(it, 1000));
+
+  EXPECT_TRUE(b.replace_right(b.find_right(0), -5));
+  EXPECT_EQ(*b.find_left(0).flip(), -5);
+  EXPECT_FALSE(b.replace_right(b.find_right(-5), 10));
+
+  for (int i = 0; i < 100; i++) {
+    if (i != 42) {
+      EXPECT_TRUE(b.replace_left(b.find_left(i), i + 200));
+    }
+  }
+  for (int i = 0; i < 100; i++) {
+    if (i != 42) {
+      ASSERT_NE(b.find_left(i + 200), b.end_left());
+      EXPECT_EQ(*b.find_left(i + 200).flip(), i == 0 ? -5 : i * 10);
+    }
+  }
+}
+
+TEST(bimap, replace) {
+  check_replace<bimap<int, int>>();
+  check_replace<bimap<int, int, btree_index<std::less<int>>, hash_index<>>>();
+  check_replace<bimap<int, int, compact_index<>, compact_index<>>>();
+
+  using counted_bimap =
+      bimap<int, int,
+            treap_index<std::less<int>, random_priority, collect_statistics>,
+            treap_index<std::less<int>, random_priority, collect_statistics>>;
+  counted_bimap b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(i, i);
+  }
+  b.reset_statistics();
+  for (int i = 0; i < 100; i++) {
+    b.replace_left(b.find_left(i), -i - 1);
+  }
+  EXPECT_EQ(b.statistics_left().allocations, 0);
+  EXPECT_EQ(b.statistics_left().inserts, 100);
+  EXPECT_EQ(b.statistics_right().inserts, 0);
+  EXPECT_EQ(*b.begin_left(), -100);
+}
+
+TEST(bimap, failed_replace_keeps_pair) {
+  bimap<throwing_key, int, btree_index<std::less<>>> b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(throwing_key(i), i);
+  }
+  // the copy of the new key for the leaf fails
+  throwing_key::copies_left = 0;
+  auto it = b.find_left(throwing_key(42));
+  EXPECT_THROW(b.replace_left(it, throwing_key(1000)), std::runtime_error);
+  throwing_key::copies_left = -1;
+  EXPECT_EQ(b.size(), 100);
+  EXPECT_EQ(b.find_left(throwing_key(42)), it);
+  EXPECT_EQ(b.find_right(42).flip(), it);
+  EXPECT_EQ(b.find_left(throwing_key(1000)), b.end_left());
+
+  EXPECT_TRUE(b.replace_left(it, throwing_key(1000)));
+  EXPECT_EQ(b.at_right(42), throwing_key(1000));
+  EXPECT_EQ(b.find_left(throwing_key(1000)), it);
+  EXPECT_EQ(b.size(), 100);
+}
+
+TEST(bimap, failed_merge_keeps_pair) {
+  using btree_bimap = bimap<throwing_key, int, btree_index<std::less<>>>;
+  btree_bimap a, b;
+  for (int i = 0; i < 100; i++) {
+    a.insert(throwing_key(i), i);
+  }
+
+  // linking into b fails after some pairs have moved
+  b.insert(throwing_key(-1), -1);
+  throwing_key::copies_left = 10;
+  EXPECT_THROW(b.merge(a), std::runtime_error);
+  throwing_key::copies_left = -1;
+  EXPECT_EQ(a.size() + b.size(), 101);
+  for (int i = -1; i < 100; i++) {
+    auto in_a = a.find_left(throwing_key(i));
+    auto in_b = b.find_left(throwing_key(i));
+    ASSERT_NE(in_a == a.end_left(), in_b == b.end_left());
+    EXPECT_EQ(in_a == a.end_left() ? *in_b.flip() : *in_a.flip(), i);
+  }
+  b.merge(a);
+  EXPECT_TRUE(a.empty());
+  EXPECT_EQ(b.size(), 101);
+}
+
+// reversed order, only through a three-way compare
+struct reverse_compare {
+  int compare(int a, int b) const {
+    return b - a;
+  }
+};
+
+TEST(bimap, three_way_compare) {
+  using string_bimap = bimap<
+      std::string, int,
+      treap_index<compare_three_way, random_priority, collect_statistics>,
+      treap_index<std::less<int>, random_priority, collect_statistics>>;
+  string_bimap b;
+  std::map<std::string, int> expected;
+  std::mt19937 e(seed);
+  for (int i = 0; i < 1000; i++) {
+    std::string key(50, 'x');
+    key += std::to_string(e() % 5000);
+    if (b.insert(key, i) != b.end_left()) {
+      expected[key] = i;
+    }
+  }
+  ASSERT_EQ(b.size(), expected.size());
+  b.reset_statistics();
+  for (auto const& [key, value] : expected) {
+    EXPECT_EQ(b.at_left(key), value);
+    EXPECT_EQ(b.find_left(key.c_str()).flip(), b.find_right(value));
+  }
+  // one comparison per visited node with the three-way comparator, up to
+  // two with std::less
+  EXPECT_EQ(b.statistics_left().comparisons, b.statistics_left().visits);
+  EXPECT_GT(b.statistics_right().comparisons, b.statistics_right().visits);
+  EXPECT_EQ(b.find_left(std::string("nothing")), b.end_left());
+  EXPECT_EQ(*b.begin_left(), expected.begin()->first);
+  string_bimap copy = b;
+  EXPECT_EQ(copy, b);
+
+  bimap<int, int, ranked_index<reverse_compare>> r;
+  for (int i = 0; i < 100; i++) {
+    r.insert(i, i);
+  }
+  EXPECT_EQ(*r.begin_left(), 99);
+  EXPECT_EQ(*r.lower_bound_left(50), 50);
+  EXPECT_EQ(*r.upper_bound_left(50), 49);
+  EXPECT_EQ(r.rank_left(90), 9);
+  EXPECT_FALSE(r.erase_left(100));
+  EXPECT_TRUE(r.erase_left(10));
+  EXPECT_EQ(r.size(), 99);
+}
+
+TEST(flat_bimap, simple) {
+  flat_bimap<int, std::string> b;
+  EXPECT_TRUE(b.empty());
+  EXPECT_EQ(b.begin_left(), b.end_left());
+  EXPECT_EQ(b.end_left().flip(), b.end_right());
+  auto it = b.insert(3, "c");
+  EXPECT_EQ(*it, 3);
+  EXPECT_EQ(*it.flip(), "c");
+  EXPECT_NE(b.insert(1, "a"), b.end_left());
+  EXPECT_EQ(b.insert(1, "x"), b.end_left());
+  EXPECT_EQ(b.insert(5, "a"), b.end_left());
+  b.insert(2, "b");
+  EXPECT_EQ(*it, 3);
+  EXPECT_EQ(it.flip().flip(), it);
+  EXPECT_EQ(b.find_left(2).flip(), b.find_right("b"));
+  EXPECT_EQ(b.at_left(3), "c");
+  EXPECT_EQ(b.at_right("a"), 1);
+  EXPECT_THROW(b.at_left(4), std::out_of_range);
+
+  EXPECT_EQ(*b.begin_left(), 1);
+  EXPECT_EQ(*++b.begin_left(), 2);
+  EXPECT_EQ(*--b.end_right(), "c");
+  EXPECT_EQ(*b.lower_bound_left(2), 2);
+  EXPECT_EQ(*b.upper_bound_left(2), 3);
+  EXPECT_EQ(b.upper_bound_left(3), b.end_left());
+  EXPECT_EQ(*b.lower_bound_right("bb"), "c");
+  EXPECT_EQ(*b.nth_right(1), "b");
+  EXPECT_EQ(b.rank_left(3), 2);
+  EXPECT_EQ(b.end_left() - b.begin_left(), 3);
+  EXPECT_EQ(*(b.begin_right() + 2), "c");
+
+  flat_bimap<int, std::string> copy = b;
+  EXPECT_EQ(copy, b);
+  EXPECT_EQ(*b.erase_left(b.find_left(2)), 3);
+  EXPECT_FALSE(b.erase_right("b"));
+  EXPECT_TRUE(b.erase_right("a"));
+  EXPECT_EQ(b.size(), 1);
+  EXPECT_NE(copy, b);
+  EXPECT_EQ(copy.erase_left(copy.begin_left(), copy.find_left(3)),
+            copy.find_left(3));
+  EXPECT_EQ(copy, b);
+  copy.clear();
+  EXPECT_TRUE(copy.empty());
+
+  std::vector<std::pair<int, std::string>> input = {
+      {2, "b"}, {1, "a"}, {2, "x"}, {3, "a"}, {4, "d"}};
+  flat_bimap<int, std::string> loaded(input.begin(), input.end());
+  EXPECT_EQ(loaded.size(), 3);
+  EXPECT_EQ(loaded.at_right("a"), 1);
+  EXPECT_EQ(loaded.assign(input.begin(), input.begin() + 2), 0);
+  EXPECT_EQ(loaded.size(), 2);
+
+  // (3, 2) only clashes with (1, 2), which is dropped itself
+  std::vector<std::pair<int, int>> cascade = {{1, 1}, {1, 2}, {3, 2}};
+  flat_bimap<int, int> kept(cascade.begin(), cascade.end());
+  EXPECT_EQ(kept.size(), 2);
+  EXPECT_EQ(kept.at_right(2), 3);
+  EXPECT_EQ(kept.assign(cascade.begin(), cascade.end()), 1);
+}
+
+TEST(flat_bimap, at_or_default) {
+  flat_bimap<int, std::string> b;
+  EXPECT_EQ(b.at_left_or_default(1), "");
+  EXPECT_EQ(b.size(), 1);
+  // the pair holding the default value is re-keyed
+  EXPECT_EQ(b.at_left_or_default(2), "");
+  EXPECT_EQ(b.size(), 1);
+  EXPECT_EQ(b.find_left(1), b.end_left());
+  EXPECT_EQ(b.at_right(""), 2);
+  b.insert(3, "c");
+  EXPECT_EQ(b.at_left_or_default(3), "c");
+  EXPECT_EQ(b.at_right_or_default("c"), 3);
+  EXPECT_EQ(b.at_right_or_default("d"), 0);
+  EXPECT_EQ(b.size(), 3);
+  EXPECT_EQ(b.at_right_or_default("e"), 0);
+  EXPECT_EQ(b.find_right("d"), b.end_right());
+  EXPECT_EQ(b.at_left(0), "e");
+
+  flat_bimap<int, int> flat;
+  bimap<int, int> expected;
+  std::mt19937 e(seed);
+  for (int i = 0; i < 1000; i++) {
+    int k = e() % 50;
+    if (e() % 2 == 0) {
+      EXPECT_EQ(flat.at_left_or_default(k), expected.at_left_or_default(k));
+    } else {
+      EXPECT_EQ(flat.at_right_or_default(k), expected.at_right_or_default(k));
+    }
+  }
+  ASSERT_EQ(flat.size(), expected.size());
+  for (auto it = expected.begin_left(); it != expected.end_left(); ++it) {
+    EXPECT_EQ(flat.at_left(*it), *it.flip());
+  }
+}
+
+TEST(flat_bimap, against_bimap) {
+  flat_bimap<int, int, std::less<int>, std::greater<int>> b;
+  bimap<int, int, ranked_index<std::less<int>>, ranked_index<std::greater<int>>>
+      expected;
+  std::mt19937 e(seed);
+  for (int i = 0; i < 3000; i++) {
+    int l = e() % 2000, r = e() % 2000;
+    EXPECT_EQ(b.insert(l, r) == b.end_left(),
+              expected.insert(l, r) == expected.end_left());
+    if (i % 7 == 0) {
+      int k = e() % 2000;
+      EXPECT_EQ(b.erase_left(k), expected.erase_left(k));
+    }
+    if (i % 100 == 0) {
+      int k = e() % 2000;
+      auto found = b.find_right(k);
+      ASSERT_EQ(found == b.end_right(),
+                expected.find_right(k) == expected.end_right());
+      if (found != b.end_right()) {
+        EXPECT_EQ(*found.flip(), *expected.find_right(k).flip());
+      }
+    }
+  }
+  b.commit();
+  ASSERT_EQ(b.size(), expected.size());
+  auto it = b.begin_right();
+  for (auto e_it = expected.begin_right(); e_it != expected.end_right();
+       ++e_it, ++it) {
+    EXPECT_EQ(*it, *e_it);
+    EXPECT_EQ(*it.flip(), *e_it.flip());
+  }
+  EXPECT_EQ(it, b.end_right());
+  for (int k = 0; k < 2000; k += 13) {
+    auto lb = b.lower_bound_left(k);
+    auto e_lb = expected.lower_bound_left(k);
+    ASSERT_EQ(lb == b.end_left(), e_lb == expected.end_left());
+    if (lb != b.end_left()) {
+      EXPECT_EQ(*lb, *e_lb);
+      EXPECT_EQ(*lb.flip(), *e_lb.flip());
+    }
+    EXPECT_EQ(b.rank_left(k), expected.rank_left(k));
+  }
+
+  // bulk loading keeps the pairs a loop of insert keeps
+  std::vector<std::pair<int, int>> input;
+  for (int i = 0; i < 3000; i++) {
+    input.emplace_back(e() % 1000, e() % 1000);
+  }
+  flat_bimap<int, int, std::less<int>, std::greater<int>> loaded(input.begin(),
+                                                                 input.end());
+  bimap<int, int, ranked_index<std::less<int>>, ranked_index<std::greater<int>>>
+      inserted;
+  for (auto const &[l, r] : input) {
+    inserted.insert(l, r);
+  }
+  ASSERT_EQ(loaded.size(), inserted.size());
+  auto l_it = loaded.begin_left();
+  for (auto e_it = inserted.begin_left(); e_it != inserted.end_left();
+       ++e_it, ++l_it) {
+    EXPECT_EQ(*l_it, *e_it);
+    EXPECT_EQ(*l_it.flip(), *e_it.flip());
+  }
+}
+
+TEST(flat_bimap, pending_inserts) {
+  // ordered queries see the delta without merging it
+  flat_bimap<int, int, std::less<int>, std::greater<int>> b;
+  bimap<int, int, ranked_index<std::less<int>>, ranked_index<std::greater<int>>>
+      expected;
+  std::mt19937 e(seed);
+  auto check = [&] {
+    ASSERT_EQ(b.size(), expected.size());
+    auto it = b.begin_left();
+    std::ptrdiff_t rank = 0;
+    for (auto e_it = expected.begin_left(); e_it != expected.end_left();
+         ++e_it, ++it, ++rank) {
+      ASSERT_EQ(*it, *e_it);
+      EXPECT_EQ(*it.flip(), *e_it.flip());
+      EXPECT_EQ(it - b.begin_left(), rank);
+      EXPECT_EQ(b.nth_right(b.rank_right(*it.flip())), it.flip());
+    }
+    EXPECT_EQ(it, b.end_left());
+    auto rit = b.end_right();
+    for (auto e_it = expected.end_right(); e_it != expected.begin_right();) {
+      --e_it;
+      --rit;
+      ASSERT_EQ(*rit, *e_it);
+    }
+    for (int k = 0; k < 500; k += 7) {
+      auto ub = b.upper_bound_right(k);
+      auto e_ub = expected.upper_bound_right(k);
+      ASSERT_EQ(ub == b.end_right(), e_ub == expected.end_right());
+      if (ub != b.end_right()) {
+        EXPECT_EQ(*ub, *e_ub);
+      }
+      EXPECT_EQ(b.rank_left(k), expected.rank_left(k));
+    }
+  };
+  for (int round = 0; round < 40; round++) {
+    int n = e() % 70;
+    for (int i = 0; i < n; i++) {
+      int l = e() % 500, r = e() % 500;
+      EXPECT_EQ(b.insert(l, r) == b.end_left(),
+                expected.insert(l, r) == expected.end_left());
+    }
+    check();
+    if (round % 5 == 0) {
+      int k = e() % 500;
+      EXPECT_EQ(b.erase_right(k), expected.erase_right(k));
+    }
+  }
+  b.commit();
+  check();
+
+  // const calls only read, so threads may share a map with pending pairs
+  for (int i = 0; i < 10; i++) {
+    b.insert(1000 + i, 1000 + i);
+  }
+  std::vector<std::thread> readers;
+  std::atomic<std::size_t> total{0};
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&b, &total] {
+      std::size_t count = 0;
+      for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+        count += b.lower_bound_right(*it.flip()) != b.end_right();
+      }
+      total += count;
+    });
+  }
+  for (std::thread &t : readers) {
+    t.join();
+  }
+  EXPECT_EQ(total, 4 * b.size());
+}
+
+TEST(small_bimap, simple) {
+  small_bimap<int, std::string, 4> b;
+  EXPECT_TRUE(b.empty());
+  EXPECT_EQ(b.begin_left(), b.end_left());
+  EXPECT_EQ(b.end_left().flip(), b.end_right());
+  EXPECT_NE(b.insert(3, "c"), b.end_left());
+  EXPECT_NE(b.insert(1, "a"), b.end_left());
+  EXPECT_EQ(b.insert(1, "x"), b.end_left());
+  EXPECT_EQ(b.insert(5, "a"), b.end_left());
+  auto it = b.insert(2, "b");
+  EXPECT_EQ(*it, 2);
+  EXPECT_EQ(*it.flip(), "b");
+  EXPECT_EQ(it.flip().flip(), it);
+  EXPECT_EQ(*b.begin_left(), 1);
+  EXPECT_EQ(*++b.begin_left(), 2);
+  EXPECT_EQ(*--b.end_right(), "c");
+  EXPECT_EQ(b.at_left(3), "c");
+  EXPECT_EQ(b.at_right("a"), 1);
+  EXPECT_THROW(b.at_left(4), std::out_of_range);
+  EXPECT_EQ(*b.lower_bound_left(2), 2);
+  EXPECT_EQ(*b.upper_bound_left(2), 3);
+  EXPECT_EQ(b.upper_bound_left(3), b.end_left());
+  EXPECT_EQ(*b.lower_bound_right("bb"), "c");
+  EXPECT_TRUE(b.is_small());
+
+  b.insert(4, "d");
+  EXPECT_TRUE(b.is_small());
+  small_bimap<int, std::string, 4> copy = b;
+  b.insert(0, "z");
+  EXPECT_FALSE(b.is_small());
+  EXPECT_EQ(b.size(), 5);
+  EXPECT_EQ(*b.begin_left(), 0);
+  EXPECT_EQ(*b.begin_left().flip(), "z");
+  EXPECT_EQ(*b.upper_bound_right("c"), "d");
+  EXPECT_TRUE(b.erase_left(0));
+  EXPECT_EQ(b, copy);
+  EXPECT_TRUE(copy.erase_right("b"));
+  EXPECT_EQ(copy.erase_left(copy.find_left(3)), copy.find_left(4));
+  EXPECT_EQ(copy.size(), 2);
+  EXPECT_NE(b, copy);
+
+  copy = b;
+  EXPECT_FALSE(copy.is_small());
+  b.clear();
+  EXPECT_TRUE(b.is_small());
+  EXPECT_TRUE(b.empty());
+  b = std::move(copy);
+  EXPECT_EQ(b.size(), 4);
+  EXPECT_TRUE(copy.empty());
+}
+
+TEST(small_bimap, against_bimap) {
+  using small_t = small_bimap<int, int, 8, std::less<int>, std::greater<int>>;
+  std::mt19937 e(seed);
+  for (int round = 0; round < 200; round++) {
+    small_t small;
+    bimap<int, int, std::less<int>, std::greater<int>> expected;
+    int n = e() % 20;
+    for (int i = 0; i < n; i++) {
+      int l = e() % 16, r = e() % 16;
+      bool inserted = small.insert(l, r) != small.end_left();
+      EXPECT_EQ(inserted, expected.insert(l, r) != expected.end_left());
+      if (e() % 4 == 0) {
+        int k = e() % 16;
+        EXPECT_EQ(small.erase_right(k), expected.erase_right(k));
+      }
+    }
+    small_t copy = small;
+    ASSERT_EQ(copy.size(), expected.size());
+    auto it = copy.begin_left();
+    for (auto e_it = expected.begin_left(); e_it != expected.end_left();
+         ++e_it, ++it) {
+      EXPECT_EQ(*it, *e_it);
+      EXPECT_EQ(*it.flip(), *e_it.flip());
+    }
+    EXPECT_EQ(it, copy.end_left());
+    auto rit = copy.begin_right();
+    for (auto e_it = expected.begin_right(); e_it != expected.end_right();
+         ++e_it, ++rit) {
+      EXPECT_EQ(*rit, *e_it);
+      EXPECT_EQ(rit.flip().flip(), rit);
+    }
+    for (int k = 0; k < 16; k++) {
+      EXPECT_EQ(copy.find_right(k) == copy.end_right(),
+                expected.find_right(k) == expected.end_right());
+      auto lb = copy.lower_bound_right(k);
+      auto e_lb = expected.lower_bound_right(k);
+      EXPECT_EQ(lb == copy.end_right(), e_lb == expected.end_right());
+      if (e_lb != expected.end_right()) {
+        EXPECT_EQ(*lb, *e_lb);
+      }
+    }
+  }
+}
+
+TEST(small_bimap, throwing_spill) {
+  // the right keys are copied, so the left ones must not be moved out
+  small_bimap<std::string, throwing_copy, 4> b;
+  for (int i = 0; i < 4; i++) {
+    b.insert(std::string(20, char('a' + i)), throwing_copy(i));
+  }
+  throwing_copy::copies_left = 2;
+  EXPECT_THROW(b.insert(std::string(20, 'e'), throwing_copy(4)),
+               std::runtime_error);
+  throwing_copy::copies_left = -1;
+  ASSERT_EQ(b.size(), 4);
+  int i = 0;
+  for (auto it = b.begin_left(); it != b.end_left(); ++it, ++i) {
+    EXPECT_EQ(*it, std::string(20, char('a' + i)));
+    EXPECT_EQ(it.flip()->a, i);
+    EXPECT_EQ(b.find_right(throwing_copy(i)).flip(), it);
+  }
+  EXPECT_NE(b.insert(std::string(20, 'e'), throwing_copy(4)), b.end_left());
+  EXPECT_EQ(b.size(), 5);
+  EXPECT_EQ(b.find_left(std::string(20, 'c')).flip()->a, 2);
+}
+
+TEST(bimap, statistics) {
+  static_assert(std::is_empty_v<no_statistics>);
+  static_assert(sizeof(bimap<int, int>) ==
+                sizeof(bimap<int, int, treap_index<std::less<int>>,
+                             treap_index<std::less<int>>>));
+  using counted_bimap =
+      bimap<int, int,
+            treap_index<std::less<int>, random_priority, collect_statistics>,
+            std::less<int>>;
+  counted_bimap b;
+  for (int i = 0; i < 1000; i++) {
+    b.insert(i, -i);
+  }
+  operation_counts const& counts = b.statistics_left();
+  EXPECT_EQ(counts.inserts, 1000);
+  EXPECT_EQ(counts.allocations, 1000);
+  EXPECT_EQ(counts.lookups, 1000);
+  EXPECT_GT(counts.rotations, 0);
+  EXPECT_GE(counts.comparisons, counts.visits);
+
+  b.reset_statistics();
+  EXPECT_EQ(b.find_left(500).flip(), b.find_right(-500));
+  EXPECT_EQ(counts.lookups, 1);
+  EXPECT_GT(counts.visits, 0);
+  EXPECT_EQ(counts.inserts, 0);
+  b.erase_left(500);
+  EXPECT_EQ(counts.deallocations, 1);
+  EXPECT_GT(counts.merges, 0);
+
+  tree_shape left = b.shape_left(), right = b.shape_right();
+  for (tree_shape const& shape : {left, right}) {
+    size_t by_depth = 0, by_height = 0;
+    for (size_t x : shape.depths) {
+      by_depth += x;
+    }
+    for (size_t x : shape.heights) {
+      by_height += x;
+    }
+    EXPECT_EQ(by_depth, b.size());
+    EXPECT_EQ(by_height, b.size());
+    EXPECT_EQ(shape.depths[0], 1);
+    EXPECT_EQ(shape.heights[shape.height], 1);
+    EXPECT_LT(shape.height, 60);
+  }
+  EXPECT_EQ(counted_bimap().shape_left().height, 0);
+}
+
+TEST(bimap_frozen, mapped_file) {
+  std::string path = testing::TempDir() + "bimap_mapped_file.bin";
+  std::mt19937 e(seed);
+  bimap<uint64_t, int32_t, std::less<>, std::greater<>> b;
+  for (int i = 0; i < 5000; i++) {
+    b.insert(e() % 100000, static_cast<int32_t>(e() % 100000) - 50000);
+  }
+  {
+    std::ofstream out(path, std::ios::binary);
+    b.freeze().write(out);
+  }
+  mapped_bimap<uint64_t, int32_t, std::less<>, std::greater<>> m(path.c_str());
+  ASSERT_EQ(m.size(), b.size());
+  auto it = b.begin_left();
+  for (auto mit = m.begin_left(); mit != m.end_left(); ++mit, ++it) {
+    ASSERT_EQ(*mit, *it);
+    ASSERT_EQ(*mit.flip(), *it.flip());
+  }
+  auto rit = b.end_right();
+  for (auto mit = m.end_right(); mit != m.begin_right();) {
+    --mit, --rit;
+    ASSERT_EQ(*mit, *rit);
+  }
+  for (int x = 0; x < 1000; x++) {
+    uint64_t key = e() % 100000;
+    EXPECT_EQ(m.find_left(key) == m.end_left(), b.find_left(key) == b.end_left());
+    auto lb = b.lower_bound_right(static_cast<int32_t>(key) - 50000);
+    auto mlb = m.lower_bound_right(static_cast<int32_t>(key) - 50000);
+    ASSERT_EQ(mlb == m.end_right(), lb == b.end_right());
+    if (lb != b.end_right()) {
+      EXPECT_EQ(*mlb, *lb);
+      EXPECT_EQ(m.at_right(*mlb), *lb.flip());
+    }
+  }
+
+  auto moved = std::move(m);
+  EXPECT_EQ(moved.size(), b.size());
+  EXPECT_TRUE(m.empty());
+
+  using wrong_types = mapped_bimap<uint32_t, int32_t>;
+  EXPECT_THROW(wrong_types{path.c_str()}, std::runtime_error);
+  {
+    std::ofstream out(path, std::ios::binary);
+    out << "definitely not a bimap, just some text that is long enough";
+  }
+  using right_types = mapped_bimap<uint64_t, int32_t>;
+  EXPECT_THROW(right_types{path.c_str()}, std::runtime_error);
+  std::remove(path.c_str());
+  EXPECT_THROW(right_types{path.c_str()}, std::system_error);
+
+  {
+    std::ofstream out(path, std::ios::binary);
+    bimap<uint64_t, int32_t>().freeze().write(out);
+  }
+  right_types empty(path.c_str());
+  EXPECT_TRUE(empty.empty());
+  EXPECT_EQ(empty.begin_left(), empty.end_left());
+  std::remove(path.c_str());
+}
+
+struct string_hash {
+  using is_transparent = void;
+
+  size_t operator()(std::string_view s) const {
+    return std::hash<std::string_view>{}(s);
+  }
+};
+
+template <typename Bimap, typename K, typename = void>
+struct finds_left : std::false_type {};
+
+template <typename Bimap, typename K>
+struct finds_left<Bimap, K,
+                  std::void_t<decltype(std::declval<Bimap const&>().find_left(
+                      std::declval<K>()))>> : std::true_type {};
+
+template <typename Bimap>
+void check_transparent_lookup() {
+  Bimap b;
+  b.insert("apple", 1);
+  b.insert("banana", 2);
+  b.insert("cherry", 3);
+  std::string_view key = "banana";
+  EXPECT_EQ(*b.find_left(key).flip(), 2);
+  EXPECT_EQ(*b.find_left("cherry").flip(), 3);
+  EXPECT_EQ(b.find_left(std::string_view("durian")), b.end_left());
+  EXPECT_EQ(b.at_left(std::string_view("apple")), 1);
+  EXPECT_THROW(b.at_left(std::string_view("durian")), std::out_of_range);
+  EXPECT_TRUE(b.erase_left(key));
+  EXPECT_FALSE(b.erase_left(key));
+  EXPECT_EQ(b.size(), 2);
+  EXPECT_EQ(*b.find_left(std::string("apple")).flip(), 1);
+}
+
+TEST(bimap, transparent_lookup) {
+  using treap_side = bimap<std::string, int, std::less<>>;
+  using btree_side = bimap<std::string, int, btree_index<std::less<>>>;
+  using hash_side =
+      bimap<std::string, int, hash_index<string_hash, std::equal_to<>>>;
+  check_transparent_lookup<treap_side>();
+  check_transparent_lookup<btree_side>();
+  check_transparent_lookup<hash_side>();
+
+  treap_side b;
+  for (std::string s : {"a", "c", "e", "g"}) {
+    b.insert(s, static_cast<int>(s[0]));
+  }
+  EXPECT_EQ(*b.lower_bound_left(std::string_view("b")), "c");
+  EXPECT_EQ(*b.upper_bound_left(std::string_view("c")), "e");
+  EXPECT_EQ(b.upper_bound_left(std::string_view("g")), b.end_left());
+
+  // other key types need a transparent comparator, or hash for hash sides
+  EXPECT_TRUE((finds_left<treap_side, std::string_view>::value));
+  EXPECT_TRUE((finds_left<hash_side, std::string_view>::value));
+  EXPECT_FALSE((finds_left<bimap<std::string, int>, std::string_view>::value));
+  EXPECT_FALSE((finds_left<bimap<std::string, int, hash_index<>>,
+                           std::string_view>::value));
+  EXPECT_TRUE((finds_left<bimap<std::string, int>, char const*>::value));
+}
+
+template <typename Bimap>
+void check_copy(Bimap const &b) {
+  Bimap copy(b);
+  EXPECT_EQ(copy.size(), b.size());
+  EXPECT_TRUE(copy == b);
+  auto it = b.begin_left();
+  for (auto cit = copy.begin_left(); cit != copy.end_left(); ++cit, ++it) {
+    EXPECT_EQ(*cit, *it);
+    EXPECT_EQ(*cit.flip(), *it.flip());
+    EXPECT_NE(&*cit, &*it);
+    EXPECT_EQ(copy.find_right(*cit.flip()), cit.flip());
+  }
+  EXPECT_EQ(it, b.end_left());
+  EXPECT_EQ(copy.end_left().flip(), copy.end_right());
+  EXPECT_EQ(copy.end_right().flip(), copy.end_left());
+
+  if (!copy.empty()) {
+    copy.erase_left(copy.begin_left());
+    copy.insert(-1, -1);
+    EXPECT_EQ(copy.size(), b.size());
+    EXPECT_FALSE(copy == b);
+    EXPECT_EQ(b.find_left(-1), b.end_left());
+  }
+}
+
+TEST(bimap, copy_keeps_structure) {
+  ranked_bimap treap_sides;
+  bimap<int, int, btree_index<std::less<int>>, btree_index<std::less<int>>>
+      btree_sides;
+  bimap<int, int, hash_index<>, hash_index<>> hash_sides;
+  bimap<int, int, hash_index<>, btree_index<std::less<int>>> mixed;
+  std::mt19937 e(seed);
+  for (int i = 0; i < 5000; i++) {
+    int l = e() % 10000, r = e() % 10000;
+    treap_sides.insert(l, r);
+    btree_sides.insert(l, r);
+    hash_sides.insert(l, r);
+    mixed.insert(l, r);
+  }
+  // leaves deleted entries in the hash tables
+  for (int i = 0; i < 10000; i += 3) {
+    treap_sides.erase_left(i);
+    btree_sides.erase_left(i);
+    hash_sides.erase_left(i);
+    mixed.erase_left(i);
+  }
+  check_copy(treap_sides);
+  check_copy(btree_sides);
+  check_copy(hash_sides);
+  check_copy(mixed);
+
+  ranked_bimap copy(treap_sides);
+  for (std::size_t k = 0; k < copy.size(); k += 97) {
+    EXPECT_EQ(*copy.nth_left(k), *treap_sides.nth_left(k));
+    EXPECT_EQ(*copy.nth_right(k), *treap_sides.nth_right(k));
+  }
+  check_copy(bimap<int, int>());
+}
+
+TEST(bimap, copy_throwing) {
+  bimap<throwing_copy, int> b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(throwing_copy(i), i);
+  }
+  throwing_copy::copies_left = 50;
+  using throwing_bimap = bimap<throwing_copy, int>;
+  EXPECT_THROW(throwing_bimap{b}, std::runtime_error);
+  throwing_copy::copies_left = -1;
+  EXPECT_EQ(b.size(), 100);
+  bimap<throwing_copy, int> copy(b);
+  EXPECT_TRUE(copy == b);
+}
+
 TEST(bimap_randomized, comparison) {
   std::cout << "Seed used for randomized compare test is " << seed << std::endl;
 
@@ -1,16 +1,162 @@
 #pragma once
 
+#include "fork_join.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <random>
+#include <tuple>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 template <typename Left, typename Right, typename CompareLeft,
-          typename CompareRight>
+          typename CompareRight, typename Allocator>
 struct bimap;
 
+// Priority sources of a treap, see treap_index. Any one keeps the treap
+// balanced in expectation, since priorities do not depend on the keys. The
+// state is per thread, so the same operations after the same seed() give
+// trees of the same shape.
+
+// steps of a std::mt19937, the default
+struct random_priority {
+  static std::uint32_t next() noexcept {
+    return static_cast<std::uint32_t>(engine());
+  }
+
+  static void seed(std::uint32_t s) noexcept {
+    engine.seed(s);
+  }
+
+private:
+  static inline thread_local std::mt19937 engine{};
+};
+
+// SplitMix64 outputs, a few multiplications instead of a step of mt19937
+struct hashed_priority {
+  static std::uint32_t next() noexcept {
+    std::uint64_t z = state += 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return static_cast<std::uint32_t>((z ^ (z >> 31)) >> 32);
+  }
+
+  static void seed(std::uint64_t s) noexcept {
+    state = s;
+  }
+
+private:
+  static inline thread_local std::uint64_t state{0};
+};
+
+// Operation counters of a treap index. Comparisons count every call of
+// the comparator, visits are the nodes passed by lookups, so visits /
+// lookups is the average search path. Allocations are the nodes the bimap
+// allocated while the index was in it.
+struct operation_counts {
+  std::uint64_t comparisons{0};
+  std::uint64_t lookups{0};
+  std::uint64_t visits{0};
+  std::uint64_t inserts{0};
+  std::uint64_t rotations{0};
+  std::uint64_t merges{0};
+  std::uint64_t allocations{0};
+  std::uint64_t deallocations{0};
+};
+
+// Statistics policies of a treap, see treap_index. The default is empty and
+// its hook does nothing, so the counting compiles away.
+struct no_statistics {
+  static constexpr bool enabled = false;
+
+  void count(std::uint64_t operation_counts::*) const noexcept {}
+};
+
+struct collect_statistics {
+  static constexpr bool enabled = true;
+
+  void count(std::uint64_t operation_counts::*counter) const noexcept {
+    counts.*counter += 1;
+  }
+
+  mutable operation_counts counts;
+};
+
+// Subtree size policies of a treap, see treap_index. With order_statistics
+// every element keeps the size of its subtree, which nth, rank, count and
+// iterator arithmetic need, at the cost of a word per element and a walk
+// to the root on every link and unlink. The default keeps none.
+struct no_order_statistics {
+  static constexpr bool enabled = false;
+};
+
+struct order_statistics {
+  static constexpr bool enabled = true;
+};
+
+// Shape of a treap: depths[d] nodes lie at depth d (the root at 0) and
+// heights[h] nodes have subtrees of height h (a leaf has 1).
+struct tree_shape {
+  std::size_t height{0};
+  std::vector<std::size_t> depths;
+  std::vector<std::size_t> heights;
+};
+
+// Comparator wrapper that keeps the treap index of a side and picks its
+// priority source, statistics and subtree sizes, e.g. bimap<int, int,
+// treap_index<std::less<int>, hashed_priority, collect_statistics>>.
+template <typename Compare = std::less<>, typename Priority = random_priority,
+          typename Statistics = no_statistics,
+          typename Order = no_order_statistics>
+struct treap_index : Compare {
+  treap_index() = default;
+  treap_index(Compare cmp) : Compare(std::move(cmp)) {}
+};
+
+// treap side with subtree sizes, e.g. bimap<int, int, ranked_index<>>
+template <typename Compare = std::less<>>
+using ranked_index =
+    treap_index<Compare, random_priority, no_statistics, order_statistics>;
+
 namespace details {
 
-thread_local inline std::mt19937 rnd{};
+// hint that *p is going to be read soon
+inline void prefetch(void const* p) noexcept {
+#if defined(__GNUC__)
+  __builtin_prefetch(p);
+#else
+  (void)p;
+#endif
+}
+
+template <typename F, typename = void>
+inline constexpr bool is_transparent_v = false;
+
+template <typename F>
+inline constexpr bool is_transparent_v<F, std::void_t<typename F::is_transparent>> =
+    true;
+
+// comparators with a three-way compare(a, b), see compare_three_way
+template <typename C, typename A, typename B, typename = void>
+inline constexpr bool has_compare_v = false;
+
+template <typename C, typename A, typename B>
+inline constexpr bool has_compare_v<
+    C, A, B,
+    std::void_t<decltype(std::declval<C const&>().compare(
+        std::declval<A const&>(), std::declval<B const&>()))>> = true;
+
+// keys with a compare member, such as std::string
+template <typename A, typename B, typename = void>
+inline constexpr bool has_key_compare_v = false;
+
+template <typename A, typename B>
+inline constexpr bool has_key_compare_v<
+    A, B,
+    std::void_t<decltype(std::declval<A const&>().compare(
+        std::declval<B const&>()))>> = true;
 
 struct left_tag;
 struct right_tag;
@@ -25,7 +171,7 @@ struct map_element_base {
   void adopt(map_element_base* new_parent) noexcept;
 
   template <typename Left, typename Right, typename CompareLeft,
-            typename CompareRight>
+            typename CompareRight, typename Allocator>
   friend struct ::bimap;
 
   template <typename T_, typename Tag_, typename Comparator>
@@ -37,12 +183,22 @@ private:
   map_element_base* right{nullptr};
 };
 
-template <typename T, typename Tag>
-struct map_element : map_element_base {
+// elements in the subtree of an element, kept with order_statistics only
+template <bool Sized>
+struct subtree_size {};
+
+template <>
+struct subtree_size<true> {
+  std::size_t size{1};
+};
+
+template <typename T, typename Tag, typename Priority = random_priority,
+          bool Sized = false>
+struct map_element : map_element_base, subtree_size<Sized> {
   map_element() noexcept = default;
 
   explicit map_element(T val_) noexcept
-      : val(std::move(val_)), prior(rnd()) {}
+      : val(std::move(val_)), prior(Priority::next()) {}
 
   ~map_element() = default;
 
@@ -50,7 +206,7 @@ struct map_element : map_element_base {
   map_element& operator=(map_element const&) = delete;
 
   template <typename Left, typename Right, typename CompareLeft,
-            typename CompareRight>
+            typename CompareRight, typename Allocator>
   friend struct ::bimap;
 
   template <typename T_, typename Tag_, typename Comparator>
@@ -61,19 +217,80 @@ private:
   uint32_t prior{static_cast<uint32_t>(-1)};
 };
 
-template <typename K, typename V>
-struct bimap_node : map_element<K, left_tag>, map_element<V, right_tag> {
+// a pair is stored once and linked into both indexes through its elements
+template <typename LeftElement, typename RightElement>
+struct bimap_node : LeftElement, RightElement {
   bimap_node() noexcept = default;
 
+  // the keys are copied or moved into the parameters of the element
+  // constructors, which may throw
   template <typename K_, typename V_>
-  bimap_node(K_&& left, V_&& right) noexcept
-      : map_element<K, left_tag>(std::forward<K_>(left)),
-        map_element<V, right_tag>(std::forward<V_>(right)) {}
+  bimap_node(K_&& left, V_&& right) noexcept(
+      std::is_nothrow_constructible_v<LeftElement, K_&&> &&
+      std::is_nothrow_constructible_v<RightElement, V_&&>)
+      : LeftElement(std::forward<K_>(left)),
+        RightElement(std::forward<V_>(right)) {}
+};
+
+template <typename Compare>
+struct priority_of {
+  using type = random_priority;
 };
 
+template <typename Compare, typename Priority, typename Statistics,
+          typename Order>
+struct priority_of<treap_index<Compare, Priority, Statistics, Order>> {
+  using type = Priority;
+};
+
+template <typename Compare>
+using priority_of_t = typename priority_of<Compare>::type;
+
+template <typename Compare>
+struct statistics_of {
+  using type = no_statistics;
+};
+
+template <typename Compare, typename Priority, typename Statistics,
+          typename Order>
+struct statistics_of<treap_index<Compare, Priority, Statistics, Order>> {
+  using type = Statistics;
+};
+
+template <typename Compare>
+using statistics_of_t = typename statistics_of<Compare>::type;
+
+template <typename Compare>
+struct order_of {
+  using type = no_order_statistics;
+};
+
+template <typename Compare, typename Priority, typename Statistics,
+          typename Order>
+struct order_of<treap_index<Compare, Priority, Statistics, Order>> {
+  using type = Order;
+};
+
+template <typename Compare>
+using order_of_t = typename order_of<Compare>::type;
+
 template <typename T, typename Tag, typename Comparator>
-struct treap : Comparator {
-  using treap_element_t = map_element<T, Tag>;
+struct treap : Comparator, statistics_of_t<Comparator> {
+  using statistics_t = statistics_of_t<Comparator>;
+  static constexpr bool sized = order_of_t<Comparator>::enabled;
+  using treap_element_t =
+      map_element<T, Tag, priority_of_t<Comparator>, sized>;
+  using element_t = treap_element_t;
+  using element_base_t = map_element_base;
+  using key_type = T;
+  static constexpr bool ordered = true;
+  static constexpr bool transparent = is_transparent_v<Comparator>;
+
+  // empty child slot of parent where a new element is to be linked
+  struct position {
+    map_element_base* parent;
+    bool to_left;
+  };
 
   treap() noexcept = default;
   explicit treap(const Comparator& cmp_) : Comparator(cmp_) {}
@@ -90,9 +307,8 @@ struct treap : Comparator {
     return fake.left == nullptr;
   }
 
+  // the fakes keep their links to the other index of the same bimap
   static void swap_fake(map_element_base& a, map_element_base& b) noexcept {
-    std::swap(a.right, b.right);
-    std::swap(a.right->right, b.right->right);
     std::swap(a.left, b.left);
     if (a.left != nullptr) {
       a.left->par = &a;
@@ -104,51 +320,384 @@ struct treap : Comparator {
 
   void swap(treap& other) noexcept {
     swap_fake(fake, other.fake);
+    std::swap(last, other.last);
     std::swap(get_cmp(), other.get_cmp());
+    std::swap(get_stats(), other.get_stats());
   }
 
-  map_element_base* insert(treap_element_t& node) noexcept {
-    if (empty()) {
-      fake.left = &to_base(node);
+  // The fake element is the end of the sequence, its right link points to
+  // the end of the index on the other side.
+  map_element_base const* begin() const noexcept {
+    return min();
+  }
+
+  map_element_base const* end() const noexcept {
+    return &fake;
+  }
+
+  void* sentinel() noexcept {
+    return static_cast<map_element_base*>(&fake);
+  }
+
+  void set_sibling(void* other_sentinel) noexcept {
+    fake.right = static_cast<map_element_base*>(other_sentinel);
+  }
+
+  static bool is_end(map_element_base const* t) noexcept {
+    return t->par == nullptr;
+  }
+
+  static void* sibling(map_element_base* end) noexcept {
+    return end->right;
+  }
+
+  static map_element_base* end_of(void* sentinel) noexcept {
+    return static_cast<map_element_base*>(sentinel);
+  }
+
+  static void next(map_element_base*& t) noexcept {
+    if (t->right) {
+      t = t->right;
+      while (t->left) {
+        t = t->left;
+      }
+    } else if (t->is_left_son()) {
+      t = t->par;
+    } else if (t->is_right_son()) {
+      while (t->is_right_son()) {
+        t = t->par;
+      }
+      t = t->par;
+    }
+  }
+
+  static void prev(map_element_base*& t) noexcept {
+    if (t->left) {
+      t = t->left;
+      while (t->right) {
+        t = t->right;
+      }
+    } else if (t->is_right_son()) {
+      t = t->par;
     } else {
-      auto [l, r] =
-          split(node.val, to_derived_ptr(fake.left));
-      treap_element_t* ptr = merge(l, &node);
-      fake.left = merge(ptr, r);
+      while (t->is_left_son()) {
+        t = t->par;
+      }
+      t = t->par;
     }
-    fake.left->par = &fake;
+  }
+
+  map_element_base* insert(treap_element_t& node) noexcept {
+    position pos;
+    locate(node.val, pos);
+    link_at(pos, node);
     return &node;
   }
 
-  treap_element_t* find(T const& val) const noexcept {
+  // returns an element equal to x or stores the slot x belongs to in pos
+  treap_element_t* locate(T const& x, position& pos) noexcept {
+    record(&operation_counts::lookups);
+    pos = {&fake, true};
+    treap_element_t* cur = to_derived_ptr(fake.left);
+    while (cur != nullptr) {
+      record(&operation_counts::visits);
+      int c = order(cur->val, x);
+      if (c < 0) {
+        pos = {cur, false};
+        cur = to_derived_ptr(cur->right);
+      } else if (c > 0) {
+        pos = {cur, true};
+        cur = to_derived_ptr(cur->left);
+      } else {
+        return cur;
+      }
+    }
+    return nullptr;
+  }
+
+  // succeeds if x belongs right before hint, which may be the fake element,
+  // the end is resolved in O(1) while the greatest element is cached
+  bool locate_by_hint(map_element_base* hint, T const& x,
+                      position& pos) noexcept {
+    if (hint != &fake && !less(x, to_derived_ptr(hint)->val)) {
+      return false;
+    }
+    map_element_base* prev;
+    if (hint != &fake) {
+      prev = predecessor(hint);
+    } else {
+      if (last == nullptr) {
+        last = predecessor(&fake);
+      }
+      prev = last;
+    }
+    if (prev != nullptr && !less(to_derived_ptr(prev)->val, x)) {
+      return false;
+    }
+    pos = hint->left == nullptr ? position{hint, true} : position{prev, false};
+    return true;
+  }
+
+  // with subtree sizes O(depth), as the sizes of all ancestors of pos grow
+  // by one, otherwise O(1) expected
+  void link_at(position pos, treap_element_t& node) noexcept {
+    record(&operation_counts::inserts);
+    node.left = node.right = nullptr;
+    update_size(&node);
+    if (pos.parent == &fake || (pos.parent == last && !pos.to_left)) {
+      last = &node;
+    }
+    link(pos.parent, pos.to_left, &node);
+    if constexpr (sized) {
+      for (map_element_base* t = pos.parent; t != &fake; t = t->par) {
+        to_derived_ptr(t)->size++;
+      }
+    }
+    while (node.par != &fake && to_derived_ptr(node.par)->prior < node.prior) {
+      rotate_up(&node);
+    }
+  }
+
+  // elements must be strictly increasing and the treap must be empty
+  template <typename It>
+  void build(It first, It last) noexcept {
+    map_element_base* rightmost = &fake;
+    for (; first != last; ++first) {
+      treap_element_t* node = *first;
+      map_element_base* popped = nullptr;
+      while (rightmost != &fake &&
+             to_derived_ptr(rightmost)->prior < node->prior) {
+        popped = rightmost;
+        update_size(popped);
+        rightmost = rightmost->par;
+      }
+      node->left = popped;
+      node->right = nullptr;
+      if (popped != nullptr) {
+        popped->adopt(node);
+      }
+      if (rightmost == &fake) {
+        fake.left = node;
+      } else {
+        rightmost->right = node;
+      }
+      node->adopt(rightmost);
+      rightmost = node;
+    }
+    update_sizes(rightmost, &fake);
+  }
+
+  // Gives the treap the shape and priorities of other, map returns the copy
+  // of each of its elements. The treap must be empty, if map throws it holds
+  // the copies made so far.
+  template <typename Map>
+  void clone(treap const& other, Map&& map) {
+    map_element_base const* from = other.fake.left;
+    map_element_base* to = &fake;
+    if (from == nullptr) {
+      return;
+    }
+    link_left(to, copy_element(from, map));
+    to = to->left;
+    while (true) {
+      if (from->left != nullptr && to->left == nullptr) {
+        from = from->left;
+        link_left(to, copy_element(from, map));
+        to = to->left;
+      } else if (from->right != nullptr && to->right == nullptr) {
+        from = from->right;
+        link_right(to, copy_element(from, map));
+        to = to->right;
+      } else if (from == other.fake.left) {
+        return;
+      } else {
+        from = from->par;
+        to = to->par;
+      }
+    }
+  }
+
+  template <typename K>
+  treap_element_t* find(K const& val) const noexcept {
     return find(val, to_derived_ptr(fake.left));
   }
 
+  // Stores the element of keys[i] (or nullptr) to res[i] for i < n. The
+  // searches go down one level per round and prefetch the nodes of the next
+  // round, so that the cache misses of different keys overlap.
+  template <typename It>
+  void find_many(It keys, std::size_t n, element_t** res) const noexcept {
+    constexpr std::size_t lanes = 16;
+    std::size_t live[lanes];
+    for (std::size_t from = 0; from < n; from += lanes) {
+      std::size_t count = 0;
+      for (std::size_t i = from; i < from + lanes && i < n; i++) {
+        record(&operation_counts::lookups);
+        res[i] = to_derived_ptr(fake.left);
+        if (res[i] != nullptr) {
+          live[count++] = i;
+        }
+      }
+      while (count > 0) {
+        std::size_t still = 0;
+        for (std::size_t j = 0; j < count; j++) {
+          std::size_t i = live[j];
+          map_element_base* next;
+          record(&operation_counts::visits);
+          int c = order(res[i]->val, keys[i]);
+          if (c < 0) {
+            next = res[i]->right;
+          } else if (c > 0) {
+            next = res[i]->left;
+          } else {
+            continue;
+          }
+          res[i] = to_derived_ptr(next);
+          if (next != nullptr) {
+            prefetch(&res[i]->val);
+            live[still++] = i;
+          }
+        }
+        count = still;
+      }
+    }
+  }
+
+  map_element_base const* nth(std::size_t k) const noexcept {
+    return select(const_cast<map_element_base*>(&fake), k);
+  }
+
+  // number of elements less than x
+  template <typename K>
+  std::size_t rank(K const& x) const noexcept {
+    std::size_t res = 0;
+    treap_element_t const* cur = to_derived_ptr(fake.left);
+    while (cur != nullptr) {
+      if (less(cur->val, x)) {
+        res += size_of(cur->left) + 1;
+        cur = to_derived_ptr(cur->right);
+      } else {
+        cur = to_derived_ptr(cur->left);
+      }
+    }
+    return res;
+  }
+
+  tree_shape shape() const {
+    tree_shape res;
+    shape(fake.left, 0, res);
+    res.height = res.depths.size();
+    return res;
+  }
+
   map_element_base const* min() const noexcept {
     return min(&fake);
   }
 
+  treap_element_t const* root() const noexcept {
+    return to_derived_ptr(fake.left);
+  }
+
+  // detaches the whole tree, leaving the treap empty
+  treap_element_t* release() noexcept {
+    treap_element_t* res = detach(fake.left);
+    fake.left = nullptr;
+    last = nullptr;
+    return res;
+  }
+
+  // calls f for every element in post-order and leaves the treap empty, f
+  // may free the element
+  template <typename F>
+  void clear(F&& f) noexcept {
+    dismantle(release(), f);
+  }
+
+  // the treap must be empty
+  void reset(treap_element_t* root) noexcept {
+    link_left(&fake, root);
+  }
+
   bool erase(T const& val) noexcept {
     return erase_in_subtree(val, to_derived_ptr(fake.left));
   }
 
+  // detaches the elements of [first, last) as a tree in O(log n)
+  treap_element_t* cut(map_element_base* first,
+                       map_element_base* last) noexcept {
+    std::pair<treap_element_t*, treap_element_t*> parts =
+        split(to_derived_ptr(first)->val, release());
+    treap_element_t* greater = nullptr;
+    if (last != &fake) {
+      std::tie(parts.second, greater) =
+          split(to_derived_ptr(last)->val, parts.second);
+    }
+    reset(merge(parts.first, greater));
+    return parts.second;
+  }
+
+  // Marks an element to be unlinked by drop_marked, the treap is not usable
+  // in between. Unlinking many elements at once takes one pass over the
+  // treap instead of an erase each. A marked element is its own parent.
+  static void mark(map_element_base* t) noexcept {
+    t->par = t;
+  }
+
+  // the root is taken without detaching it, which would clear its mark
+  void drop_marked() noexcept {
+    treap_element_t* root = to_derived_ptr(fake.left);
+    fake.left = nullptr;
+    last = nullptr;
+    reset(drop_marked(root));
+  }
+
+  // elements of the detached tree t, O(1) with subtree sizes
+  static std::size_t count(map_element_base* t) noexcept {
+    if constexpr (sized) {
+      return size_of(t);
+    } else {
+      std::size_t res = 0;
+      for_each(t, [&res](treap_element_t*) { res++; });
+      return res;
+    }
+  }
+
+  // position of t in the in-order sequence, the fake element is past the
+  // end
+  static std::size_t index_of(map_element_base const* t) noexcept {
+    std::size_t res = size_of(t->left);
+    for (; t->par != nullptr && t->par->par != nullptr; t = t->par) {
+      if (t->par->right == t) {
+        res += size_of(t->par->left) + 1;
+      }
+    }
+    return res;
+  }
+
+  static map_element_base* advance(map_element_base* t,
+                                   std::ptrdiff_t n) noexcept {
+    map_element_base* fake = t;
+    while (fake->par != nullptr) {
+      fake = fake->par;
+    }
+    return select(fake, index_of(t) + n);
+  }
+
   bool erase_in_subtree(T const& val, treap_element_t* t) noexcept {
+    t = find(val, t);
     if (t == nullptr) {
       return false;
     }
-    if (less(t->val, val)) {
-      return erase_in_subtree(val, t->right);
-    } else if (greater_or_equal(t->val, val)) {
-      erase(t);
-      return true;
-    } else {
-      return erase_in_subtree(val, t->left);
-    }
+    erase(t);
+    return true;
   }
 
   void erase(map_element_base* t) noexcept {
     treap_element_t* res =
         merge(to_derived_ptr(t->left), to_derived_ptr(t->right));
+    if (t == last) {
+      last = nullptr;
+    }
     if (t == fake.left) {
       fake.left = res;
     }
@@ -160,45 +709,84 @@ struct treap : Comparator {
     } else {
       t->par->left = res;
     }
+    if constexpr (sized) {
+      for (map_element_base* p = t->par; p != &fake; p = p->par) {
+        to_derived_ptr(p)->size--;
+      }
+    }
     t->left = t->right = t->par = nullptr;
   }
 
-  map_element_base const* lower_bound(const T& x) const noexcept {
-    return bound(x, [this](const T& a, const T& b)
+  // Gives e the key, which gets the old one in exchange, and moves e to
+  // the key's place. No other element may have the key.
+  void relink(treap_element_t& e, T& key) noexcept {
+    erase(&e);
+    using std::swap;
+    swap(e.val, key);
+    position pos;
+    locate(e.val, pos);
+    link_at(pos, e);
+  }
+
+  template <typename K>
+  map_element_base const* lower_bound(const K& x) const noexcept {
+    return bound(x, [this](const auto& a, const auto& b)
                  { return greater(a, b); });
   }
 
-  map_element_base const* upper_bound(const T& x) const noexcept {
-    return bound(x, [this](const T& a, const T& b)
+  template <typename K>
+  map_element_base const* upper_bound(const K& x) const noexcept {
+    return bound(x, [this](const auto& a, const auto& b)
                  { return greater_or_equal(a, b); });
   }
 
-  bool less(const T& a, const T& b) const noexcept {
+  // the operands may be of other types than T if the comparator is
+  // transparent
+  template <typename A, typename B>
+  bool less(const A& a, const B& b) const noexcept {
     return cmp(a, b);
   }
 
-  bool greater(const T&a, const T&b) const noexcept {
+  template <typename A, typename B>
+  bool greater(const A&a, const B&b) const noexcept {
     return cmp(b, a);
   }
 
-  bool less_or_equal(const T& a, const T& b) const noexcept {
+  template <typename A, typename B>
+  bool less_or_equal(const A& a, const B& b) const noexcept {
     return !cmp(b, a);
   }
 
-  bool greater_or_equal(const T& a, const T& b) const noexcept {
+  template <typename A, typename B>
+  bool greater_or_equal(const A& a, const B& b) const noexcept {
     return !cmp(a, b);
   }
 
   bool equal(const T& a, const T& b) const noexcept {
-    return less_or_equal(a, b) && greater_or_equal(a, b);
+    return order(a, b) == 0;
+  }
+
+  // negative, zero or positive as a is less than, equivalent to or greater
+  // than b, one call if the comparator has a three-way compare member
+  template <typename A, typename B>
+  int order(const A& a, const B& b) const noexcept {
+    if constexpr (has_compare_v<Comparator, A, B>) {
+      record(&operation_counts::comparisons);
+      auto res = get_cmp().compare(a, b);
+      return res < 0 ? -1 : res > 0 ? 1 : 0;
+    } else {
+      return less(a, b) ? -1 : less(b, a) ? 1 : 0;
+    }
   }
 
   template <typename Left, typename Right, typename CompareLeft,
-            typename CompareRight>
+            typename CompareRight, typename Allocator>
   friend struct ::bimap;
 
 private:
   map_element_base fake;
+  // the greatest element, or nullptr if it is not known yet
+  map_element_base* last{nullptr};
 
   Comparator& get_cmp() {
     return static_cast<Comparator&>(*this);
@@ -208,8 +796,27 @@ private:
     return static_cast<Comparator const&>(*this);
   }
 
-  bool cmp(const T& a, const T& b) const noexcept {
-    return get_cmp()(a, b);
+  statistics_t& get_stats() noexcept {
+    return static_cast<statistics_t&>(*this);
+  }
+
+  statistics_t const& get_stats() const noexcept {
+    return static_cast<statistics_t const&>(*this);
+  }
+
+  void record(std::uint64_t operation_counts::*counter) const noexcept {
+    get_stats().count(counter);
+  }
+
+  // a comparator may have only the three-way compare
+  template <typename A, typename B>
+  bool cmp(const A& a, const B& b) const noexcept {
+    record(&operation_counts::comparisons);
+    if constexpr (std::is_invocable_v<Comparator const&, A const&, B const&>) {
+      return get_cmp()(a, b);
+    } else {
+      return get_cmp().compare(a, b) < 0;
+    }
   }
 
   static map_element_base& to_base(treap_element_t& elem) noexcept {
@@ -220,8 +827,8 @@ private:
     return static_cast<treap_element_t*>(base);
   }
 
-  template <typename F>
-  map_element_base const* bound(const T& x, F&& check_bound) const noexcept {
+  template <typename K, typename F>
+  map_element_base const* bound(const K& x, F&& check_bound) const noexcept {
     map_element_base const* possible_answer = &fake;
     treap_element_t const* cur = to_derived_ptr(fake.left);
     while (cur != nullptr) {
@@ -235,71 +842,368 @@ private:
     return possible_answer;
   }
 
-  std::pair<treap_element_t*, treap_element_t*>
-  split(T& x, treap_element_t* t) noexcept {
-    if (t == nullptr) {
-      return {nullptr, nullptr};
+  static void link_left(map_element_base* parent,
+                        map_element_base* child) noexcept {
+    parent->left = child;
+    if (child != nullptr) {
+      child->adopt(parent);
     }
-    if (less(t->val, x)) {
-      std::pair<map_element_base*, map_element_base*> tt =
-          split(x, to_derived_ptr(t->right));
-      t->right = tt.first;
-      if (tt.second != nullptr) {
-        tt.second->adopt(nullptr);
+  }
+
+  static void link_right(map_element_base* parent,
+                         map_element_base* child) noexcept {
+    parent->right = child;
+    if (child != nullptr) {
+      child->adopt(parent);
+    }
+  }
+
+  static void link(map_element_base* parent, bool to_left,
+                   map_element_base* child) noexcept {
+    if (to_left) {
+      link_left(parent, child);
+    } else {
+      link_right(parent, child);
+    }
+  }
+
+  // splits t into elements less than x and the rest, the roots are detached
+  std::pair<treap_element_t*, treap_element_t*>
+  split(T const& x, treap_element_t* t) noexcept {
+    map_element_base less_head, rest_head;
+    map_element_base* less_tail = &less_head;
+    map_element_base* rest_tail = &rest_head;
+    while (t != nullptr) {
+      if (less(t->val, x)) {
+        link_right(less_tail, t);
+        less_tail = t;
+        t = to_derived_ptr(t->right);
+      } else {
+        link_left(rest_tail, t);
+        rest_tail = t;
+        t = to_derived_ptr(t->left);
       }
-      if (tt.first != nullptr) {
-        tt.first->adopt(t);
+    }
+    less_tail->right = nullptr;
+    rest_tail->left = nullptr;
+    update_sizes(less_tail, &less_head);
+    update_sizes(rest_tail, &rest_head);
+    return {detach(less_head.right), detach(rest_head.left)};
+  }
+
+  // every element of t1 must be less than every element of t2
+  treap_element_t* merge(treap_element_t* t1, treap_element_t* t2) noexcept {
+    record(&operation_counts::merges);
+    map_element_base head;
+    map_element_base* parent = &head;
+    bool to_left = true;
+    while (t1 != nullptr && t2 != nullptr) {
+      treap_element_t* top;
+      bool next_to_left;
+      if (t1->prior > t2->prior) {
+        top = t1;
+        t1 = to_derived_ptr(t1->right);
+        next_to_left = false;
+      } else {
+        top = t2;
+        t2 = to_derived_ptr(t2->left);
+        next_to_left = true;
       }
-      return {t, to_derived_ptr(tt.second)};
+      link(parent, to_left, top);
+      parent = top;
+      to_left = next_to_left;
+    }
+    link(parent, to_left, t1 != nullptr ? t1 : t2);
+    update_sizes(parent, &head);
+    return detach(head.left);
+  }
+
+  void rotate_up(map_element_base* x) noexcept {
+    record(&operation_counts::rotations);
+    map_element_base* p = x->par;
+    map_element_base* g = p->par;
+    bool p_is_left = g->left == p;
+    if (p->left == x) {
+      link_left(p, x->right);
+      link_right(x, p);
     } else {
-      std::pair<map_element_base*, map_element_base*> tt =
-          split(x, to_derived_ptr(t->left));
-      t->left = tt.second;
-      if (tt.first != nullptr) {
-        tt.first->adopt(nullptr);
+      link_right(p, x->left);
+      link_left(x, p);
+    }
+    link(g, p_is_left, x);
+    update_size(p);
+    update_size(x);
+  }
+
+  map_element_base* predecessor(map_element_base* t) noexcept {
+    if (t->left != nullptr) {
+      t = t->left;
+      while (t->right != nullptr) {
+        t = t->right;
       }
-      if (tt.second != nullptr) {
-        tt.second->adopt(t);
+      return t;
+    }
+    while (t != &fake && t->is_left_son()) {
+      t = t->par;
+    }
+    return t == &fake ? nullptr : t->par;
+  }
+
+  // like split, but an element equal to x is taken out and returned in the
+  // middle
+  std::tuple<treap_element_t*, treap_element_t*, treap_element_t*>
+  split3(T const& x, treap_element_t* t) noexcept {
+    map_element_base less_head, rest_head;
+    map_element_base* less_tail = &less_head;
+    map_element_base* rest_tail = &rest_head;
+    treap_element_t* equal = nullptr;
+    while (t != nullptr) {
+      int c = order(t->val, x);
+      if (c < 0) {
+        link_right(less_tail, t);
+        less_tail = t;
+        t = to_derived_ptr(t->right);
+      } else if (c > 0) {
+        link_left(rest_tail, t);
+        rest_tail = t;
+        t = to_derived_ptr(t->left);
+      } else {
+        equal = t;
+        break;
       }
-      return {to_derived_ptr(tt.first), t};
     }
+    link_right(less_tail, equal != nullptr ? equal->left : nullptr);
+    link_left(rest_tail, equal != nullptr ? equal->right : nullptr);
+    update_sizes(less_tail, &less_head);
+    update_sizes(rest_tail, &rest_head);
+    if (equal != nullptr) {
+      equal->left = equal->right = equal->par = nullptr;
+      update_size(equal);
+    }
+    return {detach(less_head.right), equal, detach(rest_head.left)};
   }
 
-  treap_element_t* merge(treap_element_t* t1, treap_element_t* t2) noexcept {
-    if (t1 == nullptr) {
-      return t2;
+  static constexpr std::size_t parallel_cutoff = 1 << 14;
+
+  // Joins two detached treaps with disjoint keys, forking while depth
+  // allows. n is about the number of their elements, each half of a split
+  // is taken to hold half of them.
+  treap_element_t* unite(treap_element_t* a, treap_element_t* b,
+                         unsigned depth, std::size_t n) noexcept {
+    if (a == nullptr) {
+      return b;
     }
-    if (t2 == nullptr) {
-      return t1;
+    if (b == nullptr) {
+      return a;
     }
-    if (t1->prior > t2->prior) {
-      map_element_base* res = merge(to_derived_ptr(t1->right), t2);
-      t1->right = res;
-      if (res != nullptr) {
-        res->adopt(t1);
+    if (a->prior < b->prior) {
+      std::swap(a, b);
+    }
+    bool fork = depth > 0 && n >= parallel_cutoff;
+    unsigned next = fork ? depth - 1 : 0;
+    auto [b_less, b_greater] = split(a->val, b);
+    treap_element_t* a_less = detach(a->left);
+    treap_element_t* a_greater = detach(a->right);
+    fork_join(
+        fork, [&] { a_less = unite(a_less, b_less, next, n / 2); },
+        [&] { a_greater = unite(a_greater, b_greater, next, n / 2); });
+    link_left(a, a_less);
+    link_right(a, a_greater);
+    update_size(a);
+    return a;
+  }
+
+  // Splits the detached treap b into elements that have an equal element in
+  // a satisfying match(a_element, b_element) and the rest. a is only read.
+  // n is as for unite.
+  template <typename Match>
+  std::pair<treap_element_t*, treap_element_t*>
+  partition(treap_element_t const* a, treap_element_t* b, Match const& match,
+            unsigned depth, std::size_t n) noexcept {
+    if (b == nullptr) {
+      return {nullptr, nullptr};
+    }
+    if (a == nullptr) {
+      return {nullptr, b};
+    }
+    bool fork = depth > 0 && n >= parallel_cutoff;
+    unsigned next = fork ? depth - 1 : 0;
+    auto [b_less, equal, b_greater] = split3(a->val, b);
+    std::pair<treap_element_t*, treap_element_t*> l, r;
+    fork_join(
+        fork,
+        [&] {
+          l = partition(to_derived_ptr(a->left), b_less, match, next, n / 2);
+        },
+        [&] {
+          r = partition(to_derived_ptr(a->right), b_greater, match, next,
+                        n / 2);
+        });
+    if (equal != nullptr && match(*a, *equal)) {
+      return {merge(merge(l.first, equal), r.first), merge(l.second, r.second)};
+    }
+    return {merge(l.first, r.first), merge(merge(l.second, equal), r.second)};
+  }
+
+  // adds the subtree of t to the histograms and returns its height
+  static std::size_t shape(map_element_base const* t, std::size_t depth,
+                           tree_shape& res) {
+    if (t == nullptr) {
+      return 0;
+    }
+    if (res.depths.size() <= depth) {
+      res.depths.resize(depth + 1);
+    }
+    res.depths[depth]++;
+    std::size_t height = 1 + std::max(shape(t->left, depth + 1, res),
+                                      shape(t->right, depth + 1, res));
+    if (res.heights.size() <= height) {
+      res.heights.resize(height + 1);
+    }
+    res.heights[height]++;
+    return height;
+  }
+
+  // calls f for every element in order, f must not relink the tree
+  template <typename F>
+  static void for_each(map_element_base* root, F&& f) {
+    if (root == nullptr) {
+      return;
+    }
+    map_element_base* t = leftmost(root);
+    while (true) {
+      f(to_derived_ptr(t));
+      if (t->right != nullptr) {
+        t = leftmost(t->right);
+        continue;
       }
-      return t1;
-    } else {
-      map_element_base* res = merge(t1, to_derived_ptr(t2->left));
-      t2->left = res;
-      if (res != nullptr) {
-        res->adopt(t2);
+      while (t != root && t->par->right == t) {
+        t = t->par;
       }
-      return t2;
+      if (t == root) {
+        return;
+      }
+      t = t->par;
     }
   }
 
-  treap_element_t* find(T const& val, treap_element_t* node) const noexcept {
-    if (node == nullptr) {
+  // calls f for every element of a detached tree in post-order, unlinking
+  // each one from its parent before the call
+  template <typename F>
+  static void dismantle(map_element_base* t, F&& f) {
+    while (t != nullptr) {
+      if (t->left != nullptr) {
+        t = t->left;
+      } else if (t->right != nullptr) {
+        t = t->right;
+      } else {
+        map_element_base* p = t->par;
+        if (p != nullptr) {
+          (p->left == t ? p->left : p->right) = nullptr;
+        }
+        f(to_derived_ptr(t));
+        t = p;
+      }
+    }
+  }
+
+  template <typename Map>
+  static treap_element_t* copy_element(map_element_base const* from,
+                                       Map& map) {
+    auto* e = static_cast<treap_element_t const*>(from);
+    treap_element_t* res = map(e);
+    res->left = res->right = nullptr;
+    if constexpr (sized) {
+      res->size = e->size;
+    }
+    res->prior = e->prior;
+    return res;
+  }
+
+  treap_element_t* drop_marked(treap_element_t* t) noexcept {
+    if (t == nullptr) {
       return nullptr;
     }
-    if (less(node->val, val)) {
-      return find(val, to_derived_ptr(node->right));
-    } else if (greater_or_equal(val, node->val)) {
-      return node;
-    } else {
-      return find(val, to_derived_ptr(node->left));
+    treap_element_t* l = drop_marked(to_derived_ptr(t->left));
+    treap_element_t* r = drop_marked(to_derived_ptr(t->right));
+    if (t->par == t) {
+      t->left = t->right = t->par = nullptr;
+      return merge(l, r);
+    }
+    link_left(t, l);
+    link_right(t, r);
+    update_size(t);
+    return t;
+  }
+
+  static treap_element_t* detach(map_element_base* root) noexcept {
+    if (root != nullptr) {
+      root->adopt(nullptr);
+    }
+    return to_derived_ptr(root);
+  }
+
+  template <typename K>
+  treap_element_t* find(K const& val, treap_element_t* node) const noexcept {
+    record(&operation_counts::lookups);
+    while (node != nullptr) {
+      record(&operation_counts::visits);
+      int c = order(node->val, val);
+      if (c < 0) {
+        node = to_derived_ptr(node->right);
+      } else if (c > 0) {
+        node = to_derived_ptr(node->left);
+      } else {
+        return node;
+      }
     }
+    return nullptr;
+  }
+
+  static std::size_t size_of(map_element_base const* t) noexcept {
+    static_assert(sized, "subtree sizes are kept with order_statistics");
+    return t == nullptr ? 0 : static_cast<treap_element_t const*>(t)->size;
+  }
+
+  static void update_size(map_element_base* t) noexcept {
+    if constexpr (sized) {
+      to_derived_ptr(t)->size = 1 + size_of(t->left) + size_of(t->right);
+    }
+  }
+
+  // updates the sizes from t up to the ancestor stop, which is left as is
+  static void update_sizes(map_element_base* t,
+                           map_element_base const* stop) noexcept {
+    if constexpr (sized) {
+      for (; t != stop; t = t->par) {
+        update_size(t);
+      }
+    }
+  }
+
+  // k-th element of the tree hanging from fake, or fake itself if k >= size
+  static map_element_base* select(map_element_base* fake,
+                                  std::size_t k) noexcept {
+    map_element_base* t = fake->left;
+    while (t != nullptr) {
+      std::size_t left_size = size_of(t->left);
+      if (k < left_size) {
+        t = t->left;
+      } else if (k == left_size) {
+        return t;
+      } else {
+        k -= left_size + 1;
+        t = t->right;
+      }
+    }
+    return fake;
+  }
+
+  static map_element_base* leftmost(map_element_base* t) noexcept {
+    while (t->left != nullptr) {
+      t = t->left;
+    }
+    return t;
   }
 
   static map_element_base const* min(map_element_base const* t) noexcept {
@@ -310,4 +1214,62 @@ private:
     return ptr;
   }
 };
+
+// index used for a side of bimap, the comparator type selects it
+template <typename T, typename Tag, typename Compare>
+struct index_traits {
+  using type = treap<T, Tag, Compare>;
+};
+
+template <typename T, typename Tag, typename Compare>
+using index_t = typename index_traits<T, Tag, Compare>::type;
+
+template <typename Left, typename Right, typename CompareLeft,
+          typename CompareRight>
+using bimap_node_t =
+    bimap_node<typename index_t<Left, left_tag, CompareLeft>::element_t,
+               typename index_t<Right, right_tag, CompareRight>::element_t>;
+
+// keys an index looks up directly, any comparable type if it is transparent
+template <typename Index, typename K>
+inline constexpr bool accepts_key_v =
+    Index::transparent || std::is_same_v<K, typename Index::key_type>;
+
+template <typename Index>
+inline constexpr bool is_treap_v = false;
+
+template <typename T, typename Tag, typename Compare>
+inline constexpr bool is_treap_v<treap<T, Tag, Compare>> = true;
+
+// treaps that keep subtree sizes
+template <typename Index>
+inline constexpr bool is_ranked_v = false;
+
+template <typename T, typename Tag, typename Compare>
+inline constexpr bool is_ranked_v<treap<T, Tag, Compare>> =
+    treap<T, Tag, Compare>::sized;
 }
+
+// Transparent comparator that also orders keys three-way. A treap side
+// whose comparator has a compare(a, b) member, negative, zero or positive
+// as a is less than, equivalent to or greater than b, decides every node of
+// a search with one call instead of two, which pays off for keys such as
+// long strings. This one uses the compare member of the keys if they have
+// one and operator< otherwise.
+struct compare_three_way {
+  using is_transparent = void;
+
+  template <typename A, typename B>
+  bool operator()(A const& a, B const& b) const {
+    return a < b;
+  }
+
+  template <typename A, typename B>
+  int compare(A const& a, B const& b) const {
+    if constexpr (details::has_key_compare_v<A, B>) {
+      return a.compare(b);
+    } else {
+      return a < b ? -1 : b < a ? 1 : 0;
+    }
+  }
+};